@@ -1,34 +1,121 @@
 #include <stdio.h>
+#include <string.h>
 #include <stdarg.h>
 #include <time.h>
-#include <sys/time.h>
 #include "mlog.h"
 #include "mlog_inner.h"
+#include "mlog_time.h"
+#include "mlog_fmt.h"
 
 
-static int      g_log_level;
+static int      g_format_mode;
 
-static const char *err_levels[] = {
-    "error",
-    "warn",
-    "info",
-    "debug"
-};
+static __thread mlog_time_cache_t   mlog_tcache;
+
+
+void
+mlog_conf_default(mlog_conf_t *conf)
+{
+    conf->level = MLOG_LEVEL_INFO;
+    conf->filename = NULL;
+    conf->buf_size = 0;
+    conf->batch_count = MLOG_DEFAULT_BATCH_COUNT;
+    conf->batch_bytes = MLOG_DEFAULT_BATCH_BYTES;
+    conf->order = MLOG_ORDER_GLOBAL;
+    conf->reorder_window = MLOG_DEFAULT_REORDER_WINDOW;
+    conf->format_mode = MLOG_FORMAT_EAGER;
+    conf->output = MLOG_OUTPUT_TEXT;
+    conf->site_rate = 0;
+    conf->site_burst = 0;
+    conf->overflow[MLOG_LEVEL_ERROR] = MLOG_OVERFLOW_DROP;
+    conf->overflow[MLOG_LEVEL_WARN] = MLOG_OVERFLOW_DROP;
+    conf->overflow[MLOG_LEVEL_INFO] = MLOG_OVERFLOW_DROP;
+    conf->overflow[MLOG_LEVEL_DEBUG] = MLOG_OVERFLOW_DROP;
+    conf->spill_size = 0;
+    conf->watermark[MLOG_LEVEL_ERROR] = 100;
+    conf->watermark[MLOG_LEVEL_WARN] = 100;
+    conf->watermark[MLOG_LEVEL_INFO] = 100;
+    conf->watermark[MLOG_LEVEL_DEBUG] = 100;
+    conf->stats_file = NULL;
+    conf->idle = MLOG_IDLE_BLOCK;
+    conf->idle_spin = MLOG_DEFAULT_IDLE_SPIN;
+    conf->idle_park = MLOG_DEFAULT_IDLE_PARK;
+    conf->writer_cpus = NULL;
+    conf->writer_node = -1;
+    conf->flush_usec = 0;
+    conf->flush_bytes = 0;
+    conf->flush_level = MLOG_LEVEL_ERROR;
+    conf->rotate_size = 0;
+    conf->rotate_interval = 0;
+    conf->rotate_keep = MLOG_DEFAULT_ROTATE_KEEP;
+    conf->reopen_signal = 0;
+    conf->compress = MLOG_COMPRESS_NONE;
+    conf->compress_level = MLOG_DEFAULT_COMPRESS_LEVEL;
+    conf->io = MLOG_IO_WRITE;
+    conf->mmap_window = MLOG_DEFAULT_MMAP_WINDOW;
+    conf->uring_depth = MLOG_DEFAULT_URING_DEPTH;
+    conf->batch_fsync = 0;
+    conf->crash_file = NULL;
+    conf->crash_slots = MLOG_DEFAULT_CRASH_SLOTS;
+    conf->fatal_flush = 0;
+    conf->sig_buf_size = 0;
+    memset(conf->sinks, 0, sizeof(conf->sinks));
+    conf->nsinks = 0;
+}
 
 
 int
 mlog_init(int level, const char *filename, unsigned int buf_size)
 {
-    if (level < MLOG_LEVEL_ERROR && level > MLOG_LEVEL_DEBUG) {
-        MLOG_ERROR("log level %d invalid", level);
+    mlog_conf_t  conf;
+
+    mlog_conf_default(&conf);
+
+    conf.level = level;
+    conf.filename = filename;
+    conf.buf_size = buf_size;
+
+    return mlog_init_conf(&conf);
+}
+
+
+int
+mlog_init_conf(const mlog_conf_t *conf)
+{
+    if (conf->level < MLOG_LEVEL_ERROR || conf->level > MLOG_LEVEL_DEBUG) {
+        MLOG_ERROR("log level %d invalid", conf->level);
+        return -1;
+    }
+
+    if (conf->format_mode != MLOG_FORMAT_EAGER
+        && conf->format_mode != MLOG_FORMAT_DEFERRED)
+    {
+        MLOG_ERROR("format mode %d invalid", conf->format_mode);
+        return -1;
+    }
+
+    if (conf->output != MLOG_OUTPUT_TEXT
+        && conf->output != MLOG_OUTPUT_BINARY)
+    {
+        MLOG_ERROR("output %d invalid", conf->output);
         return -1;
     }
 
-    if (mlog_inner_init(filename, buf_size) != 0) {
+    /* binary records carry the raw arguments; set before the writer runs */
+
+    g_format_mode = conf->output == MLOG_OUTPUT_BINARY
+                    ? MLOG_FORMAT_DEFERRED : conf->format_mode;
+
+    if (mlog_inner_init(conf) != 0) {
         return -1;
     }
 
-    g_log_level = level;
+    mlog_set_log_level(conf->level);
+
+    if (conf->site_rate) {
+        mlog_site_limit(NULL, NULL, 0, 0, MLOG_LEVEL_ANY, conf->site_rate,
+                        conf->site_burst, MLOG_LIMIT_REPORT);
+    }
 
     return 0;
 }
@@ -41,67 +128,231 @@ mlog_uinit()
 }
 
 
+int
+mlog_get_stats(mlog_stats_t *stats)
+{
+    return mlog_inner_stats(stats);
+}
+
+
+int
+mlog_get_latency(mlog_latency_t *queue, mlog_latency_t *producer)
+{
+    return mlog_inner_latency(queue, producer);
+}
+
+
+/* waits until what this thread logged so far is in the file */
+
+int
+mlog_flush()
+{
+    return mlog_inner_flush();
+}
+
+
+/*
+ * writes what all threads queued from the calling one, safe in a crash
+ * handler; returns the lines written or -1
+ */
+
+int
+mlog_crash_flush()
+{
+    return mlog_inner_crash_flush();
+}
+
+
+/* gives the calling thread its signal kfifo, see mlog_log_sigsafe() */
+
+int
+mlog_sigsafe_register()
+{
+    return mlog_inner_sig_register();
+}
+
+
+/* for logrotate without copytruncate, safe in a signal handler */
+
 void
-mlog_set_log_level(int level)
+mlog_reopen()
 {
-    if (level >= MLOG_LEVEL_ERROR && level <= MLOG_LEVEL_DEBUG) {
-        g_log_level = level;
-    }
+    mlog_inner_reopen();
 }
 
 
 void
-mlog_format(int level, const char *func, long line, const char *fmt, ...)
+mlog_tz_reload()
+{
+    mlog_time_tz_reload();
+}
+
+
+/* only the raw arguments go into the kfifo, the writer formats them */
+
+static int
+mlog_format_deferred(const mlog_site_t *desc, const char *fmt, va_list args)
 {
     int                  len;
-    char                *p, *last, buf[MLOG_MAX_LOG_LEN] = { 0 };
-    pid_t                pid, tid;
-    va_list              arglist;
-    struct tm            tm;
-    struct timeval       tv;
+    unsigned char       *p;
+    unsigned int         size;
+    struct timespec      ts;
+    mlog_fmt_site_t     *site;
 
-    if (g_log_level < level) {
-        return;
+    p = mlog_reserve_log_buf(&size);
+    if (p == NULL || size < sizeof(mlog_fmt_site_t)) {
+        return -1;
     }
 
+    len = mlog_fmt_capture(p + sizeof(mlog_fmt_site_t),
+                           size - sizeof(mlog_fmt_site_t), fmt, args);
+    if (len < 0) {
+        return -1;
+    }
+
+    site = (mlog_fmt_site_t *) p;
+    site->fmt = fmt;
+    site->desc = desc;
+
+    mlog_time_now(&ts);
+
+    return mlog_commit_log_buf(ts.tv_sec * 1000 + ts.tv_nsec / 1000000,
+                               desc->level,
+                               MLOG_RECORD_DEFERRED,
+                               sizeof(mlog_fmt_site_t) + len);
+}
+
+
+static void
+mlog_format_eager(const mlog_site_t *desc, const char *fmt, va_list args)
+{
+    int                  len, copy;
+    char                *p, *start, *last, buf[MLOG_MAX_LOG_LEN];
+    pid_t                pid, tid;
+    unsigned int         size;
+    unsigned long        msec;
+    struct timespec      ts;
+
     if (mlog_get_pid_and_tid(&pid, &tid) != 0) {
         MLOG_ERROR("get_pid_and_tid failed");
         return;
     }
 
-    gettimeofday(&tv, NULL);
-    localtime_r(&tv.tv_sec, &tm);
+    /*
+     * format straight into the thread's kfifo, the stack buffer is only
+     * used when the kfifo can not offer a whole line of contiguous space
+     */
 
-    p = buf;
-    last = buf + MLOG_MAX_LOG_LEN;
+    start = (char *) mlog_reserve_log_buf(&size);
+    if (start == NULL) {
+        MLOG_ERROR("reserve log buf failed");
+        return;
+    }
+
+    copy = size < MLOG_MAX_LOG_LEN;
+    if (copy) {
+        start = buf;
+        size = MLOG_MAX_LOG_LEN;
+    }
 
-    len = snprintf(p, last - p,
-                   "%4d/%02d/%02d %02d:%02d:%02d [%s] %d#%d %s#%ld: ",
-                   tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-                   tm.tm_hour, tm.tm_min, tm.tm_sec, err_levels[level],
-                   pid, tid, func, line);
+    mlog_time_now(&ts);
+
+    p = start;
+    last = start + size - 1;    /* keep room for the '\n' */
+
+    len = mlog_fmt_prefix(p, last - p, &mlog_tcache, ts.tv_sec, desc->level,
+                          pid, tid, desc->func, desc->line);
     if (len <= 0) {
-        MLOG_ERROR("snprintf failed ret=%d", len);
+        MLOG_ERROR("format prefix failed ret=%d", len);
         return;
     }
 
     p += len;
 
-    va_start(arglist, fmt);
-    len = vsnprintf(p, last - p, fmt, arglist);
-    va_end(arglist);
+    len = vsnprintf(p, last - p, fmt, args);
 
-    if (len <= 0) {
+    if (len < 0) {
         MLOG_ERROR("vsnprintf failed ret=%d", len);
         return;
     }
 
-    p += len;
+    /* truncate overlong lines */
+
+    p += len < last - p ? len : last - p - 1;
     *p++ = '\n';
-    len = p - buf;
+    len = p - start;
+    msec = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 
-    if (mlog_post_log_task(tv.tv_sec * 1000 + tv.tv_usec / 1000, buf, len) != 0)
+    /* a full kfifo is handled and counted by the overflow policy */
+
+    if (copy) {
+        (void) mlog_post_log_task(msec, desc->level, (unsigned char *) buf,
+                                  len);
+
+    } else if (mlog_commit_log_buf(msec, desc->level, MLOG_RECORD_TEXT, len)
+               != 0)
     {
-        MLOG_ERROR("post_log_task failed");
+        MLOG_ERROR("commit_log_buf failed");
+    }
+}
+
+
+/* the mlog_log() macro has checked the call site already */
+
+void
+mlog_format(const mlog_site_t *site, const char *fmt, ...)
+{
+    int                  ret;
+    va_list              arglist, copy;
+#ifdef MLOG_LATENCY
+    unsigned long        start;
+#endif
+
+    /* under pressure the less important lines are not even formatted */
+
+    if (mlog_shed(site->level)) {
+        return;
     }
+
+#ifdef MLOG_LATENCY
+    start = mlog_latency_begin();
+#endif
+
+    va_start(arglist, fmt);
+
+    if (g_format_mode == MLOG_FORMAT_DEFERRED) {
+
+        /* formats that can not be captured, or no room, go the eager way */
+
+        va_copy(copy, arglist);
+        ret = mlog_format_deferred(site, fmt, copy);
+        va_end(copy);
+
+        if (ret == 0) {
+            goto done;
+        }
+    }
+
+    mlog_format_eager(site, fmt, arglist);
+
+done:
+
+    va_end(arglist);
+
+#ifdef MLOG_LATENCY
+    mlog_latency_end(start);
+#endif
+}
+
+
+/* the mlog_log_sigsafe() macro has checked the call site already */
+
+void
+mlog_format_sigsafe(const mlog_site_t *site, const char *fmt, ...)
+{
+    va_list  args;
+
+    va_start(args, fmt);
+    (void) mlog_inner_sig_log(site, fmt, args);
+    va_end(args);
 }
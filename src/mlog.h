@@ -8,20 +8,319 @@
 #define MLOG_LEVEL_DEBUG    3
 
 
-#define mlog_error(args...) \
-    mlog_format(MLOG_LEVEL_ERROR, __func__, __LINE__, args)
-#define mlog_warn(args...) \
-    mlog_format(MLOG_LEVEL_WARN, __func__, __LINE__, args)
-#define mlog_info(args...) \
-    mlog_format(MLOG_LEVEL_INFO, __func__, __LINE__, args)
-#define mlog_debug(args...) \
-    mlog_format(MLOG_LEVEL_DEBUG, __func__, __LINE__, args)
+/* calls above this level are not compiled in at all */
+#ifndef MLOG_COMPILE_LEVEL
+#define MLOG_COMPILE_LEVEL  MLOG_LEVEL_DEBUG
+#endif
 
 
-void mlog_format(int level, const char *func, long line, const char *fmt, ...);
+/* how the writer orders lines of different threads */
+#define MLOG_ORDER_GLOBAL   0   /* merge everything queued, by time */
+#define MLOG_ORDER_THREAD   1   /* per thread order only, cheapest */
+#define MLOG_ORDER_WINDOW   2   /* merge, holding lines for reorder_window */
+
+
+/* where the line is formatted */
+#define MLOG_FORMAT_EAGER       0   /* by the caller */
+#define MLOG_FORMAT_DEFERRED    1   /* by the writer, fmt must be static */
+
+
+/* what a thread does when its kfifo is full, per level */
+#define MLOG_OVERFLOW_DROP      0   /* drop the new line, count it */
+#define MLOG_OVERFLOW_BLOCK     1   /* spin, then sleep until the writer drains */
+#define MLOG_OVERFLOW_OVERWRITE 2   /* drop the oldest lines the writer has not taken */
+#define MLOG_OVERFLOW_SPILL     3   /* put the line into a shared arena */
+
+
+/* what the writer does when all kfifos are empty */
+#define MLOG_IDLE_BLOCK     0   /* sleep until woken */
+#define MLOG_IDLE_SPIN      1   /* poll the kfifos, never sleep */
+#define MLOG_IDLE_YIELD     2   /* spin for idle_spin usec, then sched_yield() */
+#define MLOG_IDLE_PARK      3   /* spin, then sleep for idle_park msec at most */
+
+
+/* what goes into the file */
+#define MLOG_OUTPUT_TEXT        0
+#define MLOG_OUTPUT_BINARY      1   /* see mlog_bin.h, read with mlog_decode */
+
+
+/* how the writer puts batches into the file */
+#define MLOG_IO_WRITE           0   /* writev() */
+#define MLOG_IO_MMAP            1   /* memcpy() into a mapped window */
+#define MLOG_IO_URING           2   /* io_uring, batches in flight */
+
+
+/* how the writer stores batches, for either output */
+#define MLOG_COMPRESS_NONE      0
+#define MLOG_COMPRESS_GZIP      1   /* a member per batch, needs MLOG_WITH_ZLIB */
+
+
+/* where a sink writes the lines next to the file */
+#define MLOG_SINK_FILE          0   /* appends to path */
+#define MLOG_SINK_STDERR        1
+#define MLOG_SINK_UNIX_DGRAM    2   /* a datagram per line to the socket path */
+#define MLOG_SINK_UNIX_STREAM   3   /* a connection to the socket path */
+
+#define MLOG_MAX_SINKS          8
+
+
+#define MLOG_DEFAULT_BATCH_COUNT        256
+#define MLOG_DEFAULT_BATCH_BYTES        (64 * 1024)
+#define MLOG_DEFAULT_REORDER_WINDOW     10
+#define MLOG_DEFAULT_IDLE_SPIN          50      /* usec */
+#define MLOG_DEFAULT_IDLE_PARK          10      /* msec */
+#define MLOG_DEFAULT_ROTATE_KEEP        10
+#define MLOG_DEFAULT_COMPRESS_LEVEL     1
+#define MLOG_DEFAULT_MMAP_WINDOW        (8 * 1024 * 1024)
+#define MLOG_DEFAULT_CRASH_SLOTS        64
+#define MLOG_DEFAULT_URING_DEPTH        4
+#define MLOG_DEFAULT_SINK_BUF_SIZE      (256 * 1024)
+
+
+typedef struct {
+    int                 type;           /* MLOG_SINK_* */
+    const char         *path;           /* of the file or the socket */
+    int                 level;          /* lines up to it go to the sink */
+    unsigned int        buf_size;       /* its queue, 2^n, 0 for the default */
+} mlog_sink_conf_t;
+
+
+typedef struct {
+    int                 level;
+    const char         *filename;
+    unsigned int        buf_size;       /* per-thread kfifo size, 2^n */
+    unsigned int        batch_count;    /* max messages per writev() */
+    unsigned int        batch_bytes;    /* max bytes per writev() */
+    int                 order;          /* MLOG_ORDER_* */
+    unsigned int        reorder_window; /* msec, for MLOG_ORDER_WINDOW */
+    int                 format_mode;    /* MLOG_FORMAT_* */
+    int                 output;         /* MLOG_OUTPUT_* */
+    unsigned int        site_rate;      /* lines/s per call site, 0 no limit */
+    unsigned int        site_burst;
+    int                 overflow[MLOG_LEVEL_DEBUG + 1]; /* MLOG_OVERFLOW_* */
+    unsigned int        spill_size;     /* 2^n, 0 for 4 * buf_size */
+    unsigned int        watermark[MLOG_LEVEL_DEBUG + 1]; /* % of a kfifo */
+    const char         *stats_file;     /* mmap'd mlog_stats_t, for mlogstat */
+    int                 idle;           /* MLOG_IDLE_* */
+    unsigned int        idle_spin;      /* usec */
+    unsigned int        idle_park;      /* msec, for MLOG_IDLE_PARK */
+    const char         *writer_cpus;    /* cpulist such as "2,4-5" */
+    int                 writer_node;    /* NUMA node, -1 for any */
+    unsigned int        flush_usec;     /* hold a batch this long, 0 none */
+    unsigned int        flush_bytes;    /* or until this big, 0 batch_bytes */
+    int                 flush_level;    /* lines up to it are not held */
+    unsigned long       rotate_size;    /* bytes per file, 0 no limit */
+    unsigned int        rotate_interval; /* sec per file, 0 no limit */
+    unsigned int        rotate_keep;    /* filename.1 (newest) .. .keep */
+    int                 reopen_signal;  /* reopens the file, 0 none */
+    int                 compress;       /* MLOG_COMPRESS_* */
+    int                 compress_level; /* 1 fastest .. 9 smallest */
+    int                 io;             /* MLOG_IO_* */
+    unsigned int        mmap_window;    /* bytes mapped at a time */
+    unsigned int        uring_depth;    /* batches in flight */
+    int                 batch_fsync;    /* fdatasync() after each batch */
+    const char         *crash_file;     /* kfifos in a file, NULL in memory */
+    unsigned int        crash_slots;    /* kfifos it holds, more are in memory */
+    int                 fatal_flush;    /* drain the kfifos on SIGSEGV etc. */
+    unsigned int        sig_buf_size;   /* per-thread kfifo of the handlers,
+                                           2^n, 0 none */
+    mlog_sink_conf_t    sinks[MLOG_MAX_SINKS]; /* besides filename */
+    unsigned int        nsinks;
+} mlog_conf_t;
+
+
+/* what threads did, each thread only writes its own */
+typedef struct {
+    unsigned long       lines[MLOG_LEVEL_DEBUG + 1];    /* queued */
+    unsigned long       bytes[MLOG_LEVEL_DEBUG + 1];
+    unsigned long       dropped;        /* kfifo full */
+    unsigned long       shed;           /* above the level's watermark */
+    unsigned long       overwritten;    /* lost to MLOG_OVERFLOW_OVERWRITE */
+    unsigned long       spilled;        /* went to the spill arena */
+    unsigned long       blocked;        /* waits of MLOG_OVERFLOW_BLOCK */
+    unsigned long       wakeups;        /* of the sleeping writer */
+} mlog_counters_t;
+
+
+typedef struct {
+    int                 tid;            /* 0 for the spill arena */
+    unsigned int        size;           /* kfifo bytes */
+    unsigned int        used;
+    unsigned int        peak;
+    mlog_counters_t     counters;
+} mlog_thread_stats_t;
+
+
+#define MLOG_STATS_MAGIC        0x4d4c4f4753544131UL   /* "MLOGSTA1" */
+#define MLOG_STATS_THREADS      64
+
+
+typedef struct {
+    unsigned long       magic;
+    unsigned long       seq;            /* odd while the stats file changes */
+    unsigned long       msec;           /* when it was taken */
+    unsigned long       start_msec;     /* mlog_init() */
+    int                 pid;
+    unsigned int        nthreads;       /* live kfifos, may exceed threads[] */
+    mlog_counters_t     total;          /* including exited threads */
+    unsigned long       batches;        /* writev() calls */
+    unsigned long       batch_lines;
+    unsigned long       batch_bytes;
+    unsigned long       write_errors;
+    unsigned long       sink_lines;     /* queued to the sinks, all of them */
+    unsigned long       sink_dropped;   /* their queue full */
+    unsigned long       sink_errors;    /* their failed writes */
+    unsigned long       writer_cpu_usec;
+    mlog_thread_stats_t threads[MLOG_STATS_THREADS];
+} mlog_stats_t;
+
+
+/* nsec, from a build with -DMLOG_LATENCY */
+typedef struct {
+    unsigned long       count;
+    unsigned long       mean;
+    unsigned long       p50;
+    unsigned long       p99;
+    unsigned long       p999;
+    unsigned long       max;
+} mlog_latency_t;
+
+
+/* matches any level in mlog_site_set() */
+#define MLOG_LEVEL_ANY      -1
+
+
+/* mlog_site_t.enabled */
+#define MLOG_SITE_OFF       0
+#define MLOG_SITE_ON        1
+#define MLOG_SITE_LIMITED   2   /* on, behind a token bucket */
+
+
+/* what happens to calls over the limit of mlog_site_limit() */
+#define MLOG_LIMIT_DROP     0   /* only counted */
+#define MLOG_LIMIT_REPORT   1   /* counted, "repeated N times" each second */
+
+
+/*
+ * Every call site owns one of these, placed in the "mlog_sites" section so
+ * that __start_mlog_sites and __stop_mlog_sites bound them all.
+ */
+typedef struct {
+    int                 level;
+    int                 enabled;        /* MLOG_SITE_* */
+    long                line;
+    const char         *func;
+    const char         *file;
+
+    unsigned long       interval;       /* nsec per call allowed */
+    unsigned long       tolerance;      /* nsec the bucket may run ahead */
+    unsigned long       tat;            /* theoretical arrival time */
+    unsigned long       suppressed;     /* calls over the limit */
+    int                 limit_mode;     /* MLOG_LIMIT_* */
+} mlog_site_t;
+
+
+typedef void (*mlog_site_handler_pt)(const mlog_site_t *site, void *data);
+
+
+/*
+ * The arguments are only evaluated when the call site is enabled, and for
+ * a rate limited site only when the bucket has a token.
+ */
+#define mlog_log(lvl, args...)  mlog_site_call(lvl, mlog_format, args)
+
+#define mlog_site_call(lvl, call, args...)                                    \
+    do {                                                                      \
+        static mlog_site_t  mlog_site_                                        \
+            __attribute__((section("mlog_sites"), aligned(8), used)) =        \
+            { .level = lvl, .enabled = (lvl) == MLOG_LEVEL_ERROR,             \
+              .line = __LINE__, .func = __func__, .file = __FILE__ };         \
+        int  mlog_on_;                                                        \
+                                                                              \
+        mlog_on_ = __atomic_load_n(&mlog_site_.enabled, __ATOMIC_RELAXED);    \
+                                                                              \
+        if (mlog_on_ && (mlog_on_ == MLOG_SITE_ON                             \
+                         || mlog_site_allow(&mlog_site_)))                    \
+        {                                                                     \
+            call(&mlog_site_, args);                                          \
+        }                                                                     \
+    } while (0)
+
+#define mlog_error(args...) mlog_log(MLOG_LEVEL_ERROR, args)
+
+#if (MLOG_COMPILE_LEVEL >= MLOG_LEVEL_WARN)
+#define mlog_warn(args...)  mlog_log(MLOG_LEVEL_WARN, args)
+#else
+#define mlog_warn(args...)  do {} while (0)
+#endif
+
+#if (MLOG_COMPILE_LEVEL >= MLOG_LEVEL_INFO)
+#define mlog_info(args...)  mlog_log(MLOG_LEVEL_INFO, args)
+#else
+#define mlog_info(args...)  do {} while (0)
+#endif
+
+#if (MLOG_COMPILE_LEVEL >= MLOG_LEVEL_DEBUG)
+#define mlog_debug(args...) mlog_log(MLOG_LEVEL_DEBUG, args)
+#else
+#define mlog_debug(args...) do {} while (0)
+#endif
+
+
+/*
+ * Safe in a signal handler, with conf->sig_buf_size set: the arguments
+ * are captured as by MLOG_FORMAT_DEFERRED into a kfifo of the thread kept
+ * for handlers, so fmt must be a literal. The kfifo comes with the first
+ * line the thread logs, or mlog_sigsafe_register(); a line of a thread
+ * without one, one that does not fit and one of a nested handler are
+ * dropped. Neither shedding nor the overflow policies apply.
+ */
+#define mlog_log_sigsafe(lvl, args...)                                        \
+    mlog_site_call(lvl, mlog_format_sigsafe, args)
+
+#define mlog_error_sigsafe(args...) mlog_log_sigsafe(MLOG_LEVEL_ERROR, args)
+
+#if (MLOG_COMPILE_LEVEL >= MLOG_LEVEL_WARN)
+#define mlog_warn_sigsafe(args...)  mlog_log_sigsafe(MLOG_LEVEL_WARN, args)
+#else
+#define mlog_warn_sigsafe(args...)  do {} while (0)
+#endif
+
+#if (MLOG_COMPILE_LEVEL >= MLOG_LEVEL_INFO)
+#define mlog_info_sigsafe(args...)  mlog_log_sigsafe(MLOG_LEVEL_INFO, args)
+#else
+#define mlog_info_sigsafe(args...)  do {} while (0)
+#endif
+
+#if (MLOG_COMPILE_LEVEL >= MLOG_LEVEL_DEBUG)
+#define mlog_debug_sigsafe(args...) mlog_log_sigsafe(MLOG_LEVEL_DEBUG, args)
+#else
+#define mlog_debug_sigsafe(args...) do {} while (0)
+#endif
+
+
+void mlog_format(const mlog_site_t *site, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void mlog_format_sigsafe(const mlog_site_t *site, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+int mlog_sigsafe_register();
 void mlog_set_log_level(int level);
+int mlog_site_set(const char *file, const char *func, long line_from,
+    long line_to, int level, int enable);
+void mlog_site_walk(mlog_site_handler_pt handler, void *data);
+int mlog_site_limit(const char *file, const char *func, long line_from,
+    long line_to, int level, unsigned int rate, unsigned int burst, int mode);
+int mlog_site_allow(mlog_site_t *site);
+void mlog_tz_reload();
 int mlog_init(int level, const char *filename, unsigned int buf_size);
+void mlog_conf_default(mlog_conf_t *conf);
+int mlog_init_conf(const mlog_conf_t *conf);
 void mlog_uinit();
+int mlog_get_stats(mlog_stats_t *stats);
+int mlog_get_latency(mlog_latency_t *queue, mlog_latency_t *producer);
+int mlog_flush();
+void mlog_reopen();
+int mlog_crash_flush();
 
 
 #endif /* __M_LOG_H__ */
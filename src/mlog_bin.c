@@ -0,0 +1,467 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "mlog_bin.h"
+
+
+#define MLOG_BIN_DICT_CAP   64
+
+
+static inline unsigned int
+mlog_bin_hash(const mlog_fmt_site_t *site)
+{
+    uintptr_t  h;
+
+    h = (uintptr_t) site->fmt * 31 + (uintptr_t) site->desc;
+
+    return (unsigned int) (h ^ (h >> 17));
+}
+
+
+int
+mlog_bin_dict_init(mlog_bin_dict_t *dict)
+{
+    memset(dict, 0, sizeof(mlog_bin_dict_t));
+
+    dict->sites = calloc(MLOG_BIN_DICT_CAP, sizeof(mlog_bin_site_t));
+    if (dict->sites == NULL) {
+        return -1;
+    }
+
+    dict->cap = MLOG_BIN_DICT_CAP;
+    dict->gen = 1;              /* fresh thread data carry 0 */
+    dict->header = 1;
+
+    return 0;
+}
+
+
+void
+mlog_bin_dict_free(mlog_bin_dict_t *dict)
+{
+    free(dict->sites);
+    dict->sites = NULL;
+    dict->cap = 0;
+}
+
+
+/* a new file starts from scratch */
+
+void
+mlog_bin_dict_reset(mlog_bin_dict_t *dict)
+{
+    memset(dict->sites, 0, dict->cap * sizeof(mlog_bin_site_t));
+
+    dict->nsites = 0;
+    dict->nthreads = 0;
+    dict->gen++;
+    dict->last_msec = 0;
+    dict->header = 1;
+}
+
+
+static int
+mlog_bin_dict_grow(mlog_bin_dict_t *dict)
+{
+    unsigned int      i, j, cap;
+    mlog_bin_site_t  *sites;
+
+    cap = dict->cap * 2;
+
+    sites = calloc(cap, sizeof(mlog_bin_site_t));
+    if (sites == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < dict->cap; i++) {
+        if (dict->sites[i].fmt == NULL) {
+            continue;
+        }
+
+        j = mlog_bin_hash((mlog_fmt_site_t *) &dict->sites[i]) & (cap - 1);
+
+        while (sites[j].fmt) {
+            j = (j + 1) & (cap - 1);
+        }
+
+        sites[j] = dict->sites[i];
+    }
+
+    free(dict->sites);
+    dict->sites = sites;
+    dict->cap = cap;
+
+    return 0;
+}
+
+
+/*
+ * Looks the call site up by its pointers. Returns 1 if the site is new
+ * and its entry must be written before the record, 0 if the file already
+ * has it, -1 on allocation failure.
+ */
+
+int
+mlog_bin_intern(mlog_bin_dict_t *dict, const mlog_fmt_site_t *site,
+    unsigned int *id)
+{
+    unsigned int      i;
+    mlog_bin_site_t  *s;
+
+    if ((dict->nsites + 1) * 2 > dict->cap && mlog_bin_dict_grow(dict) != 0) {
+        return -1;
+    }
+
+    i = mlog_bin_hash(site) & (dict->cap - 1);
+
+    for ( ;; ) {
+        s = &dict->sites[i];
+
+        if (s->fmt == NULL) {
+            break;
+        }
+
+        if (s->fmt == site->fmt && s->desc == site->desc) {
+            *id = s->id;
+            return 0;
+        }
+
+        i = (i + 1) & (dict->cap - 1);
+    }
+
+    s->fmt = site->fmt;
+    s->desc = site->desc;
+    s->id = dict->nsites++;
+
+    *id = s->id;
+
+    return 1;
+}
+
+
+unsigned int
+mlog_bin_site_len(const mlog_fmt_site_t *site)
+{
+    return 1 + 5 * MLOG_BIN_VARINT_LEN + strlen(site->desc->func)
+           + strlen(site->fmt);
+}
+
+
+unsigned char *
+mlog_bin_put_varint(unsigned char *p, unsigned long long v)
+{
+    while (v >= 0x80) {
+        *p++ = (unsigned char) (v | 0x80);
+        v >>= 7;
+    }
+
+    *p++ = (unsigned char) v;
+
+    return p;
+}
+
+
+int
+mlog_bin_get_varint(const unsigned char **p, const unsigned char *last,
+    unsigned long long *v)
+{
+    unsigned int          shift;
+    const unsigned char  *q;
+
+    *v = 0;
+
+    for (q = *p, shift = 0; q < last && shift < 64; q++, shift += 7) {
+        *v |= (unsigned long long) (*q & 0x7f) << shift;
+
+        if ((*q & 0x80) == 0) {
+            *p = q + 1;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+unsigned char *
+mlog_bin_put_site(unsigned char *p, unsigned int id,
+    const mlog_fmt_site_t *site)
+{
+    size_t  len;
+
+    *p++ = MLOG_BIN_SITE;
+    p = mlog_bin_put_varint(p, id);
+    p = mlog_bin_put_varint(p, mlog_bin_zigzag(site->desc->line));
+
+    len = strlen(site->desc->func);
+    p = mlog_bin_put_varint(p, len);
+    memcpy(p, site->desc->func, len);
+    p += len;
+
+    len = strlen(site->fmt);
+    p = mlog_bin_put_varint(p, len);
+    memcpy(p, site->fmt, len);
+    p += len;
+
+    return p;
+}
+
+
+/* the common head of record and text entries */
+
+unsigned char *
+mlog_bin_put_head(unsigned char *p, int tag, int level, long delta,
+    unsigned int thread, unsigned int n)
+{
+    *p++ = (unsigned char) (tag | level);
+    p = mlog_bin_put_varint(p, mlog_bin_zigzag(delta));
+    p = mlog_bin_put_varint(p, thread);
+    p = mlog_bin_put_varint(p, n);
+
+    return p;
+}
+
+
+#define mlog_bin_slot(a, alast, v)                                            \
+    if ((alast) - (a) < (ptrdiff_t) MLOG_FMT_ALIGN(sizeof(v))) {              \
+        return -1;                                                            \
+    }                                                                         \
+    memcpy(&(v), a, sizeof(v));                                               \
+    (a) += MLOG_FMT_ALIGN(sizeof(v))
+
+#define mlog_bin_room(p, last, n)                                             \
+    if ((size_t) ((last) - (p)) < (size_t) (n)) {                             \
+        return -1;                                                            \
+    }
+
+
+/*
+ * Packs the slots mlog_fmt_capture() filled. Returns the bytes used, -1
+ * if buf is too small or the slots do not match fmt.
+ */
+
+int
+mlog_bin_encode_args(unsigned char *buf, unsigned int size, const char *fmt,
+    const unsigned char *args, unsigned int len)
+{
+    int                   iv;
+    long long             llv, slen;
+    unsigned long long    ullv;
+    unsigned char        *p, *last, raw[sizeof(long double)];
+    const unsigned char  *a, *alast;
+    mlog_fmt_spec_t       spec;
+
+    p = buf;
+    last = buf + size;
+    a = args;
+    alast = args + len;
+
+    while (mlog_fmt_next(&fmt, &spec)) {
+
+        if (spec.type == MLOG_ARG_NONE) {
+            continue;
+        }
+
+        if (spec.type == MLOG_ARG_BAD) {
+            return -1;
+        }
+
+        if (spec.star_width) {
+            mlog_bin_slot(a, alast, iv);
+            mlog_bin_room(p, last, MLOG_BIN_VARINT_LEN);
+            p = mlog_bin_put_varint(p, mlog_bin_zigzag(iv));
+        }
+
+        if (spec.star_prec) {
+            mlog_bin_slot(a, alast, iv);
+            mlog_bin_room(p, last, MLOG_BIN_VARINT_LEN);
+            p = mlog_bin_put_varint(p, mlog_bin_zigzag(iv));
+        }
+
+        mlog_bin_room(p, last, MLOG_BIN_VARINT_LEN);
+
+        switch (spec.type) {
+
+        case MLOG_ARG_INT:
+            mlog_bin_slot(a, alast, iv);
+            p = mlog_bin_put_varint(p, mlog_bin_zigzag(iv));
+            break;
+
+        case MLOG_ARG_LONG:
+        case MLOG_ARG_LLONG:
+        case MLOG_ARG_INTMAX:
+        case MLOG_ARG_PTRDIFF:
+            mlog_bin_slot(a, alast, llv);
+            p = mlog_bin_put_varint(p, mlog_bin_zigzag(llv));
+            break;
+
+        case MLOG_ARG_SIZE:
+        case MLOG_ARG_PTR:
+            mlog_bin_slot(a, alast, ullv);
+            p = mlog_bin_put_varint(p, ullv);
+            break;
+
+        case MLOG_ARG_DOUBLE:
+            if (alast - a < MLOG_FMT_SLOT) {
+                return -1;
+            }
+
+            memcpy(p, a, sizeof(double));
+            p += sizeof(double);
+            a += MLOG_FMT_ALIGN(sizeof(double));
+            break;
+
+        case MLOG_ARG_LDOUBLE:
+            mlog_bin_slot(a, alast, raw);
+            mlog_bin_room(p, last, sizeof(raw));
+            memcpy(p, raw, sizeof(raw));
+            p += sizeof(raw);
+            break;
+
+        case MLOG_ARG_STR:
+            mlog_bin_slot(a, alast, slen);
+            p = mlog_bin_put_varint(p, mlog_bin_zigzag(slen));
+
+            if (slen < 0) {
+                break;
+            }
+
+            if (alast - a < slen) {
+                return -1;
+            }
+
+            mlog_bin_room(p, last, slen);
+            memcpy(p, a, slen);
+            p += slen;
+            a += MLOG_FMT_ALIGN(slen + 1);
+            break;
+        }
+    }
+
+    return p - buf;
+}
+
+
+/*
+ * The reverse of mlog_bin_encode_args(): rebuilds the slots at buf for
+ * mlog_fmt_render(). Returns the slot bytes, -1 if *p is malformed.
+ */
+
+int
+mlog_bin_decode_args(unsigned char *buf, unsigned int size, const char *fmt,
+    const unsigned char **p, const unsigned char *last)
+{
+    int                   iv;
+    long long             llv, slen;
+    unsigned long long    v;
+    unsigned char        *a, *alast;
+    const unsigned char  *q;
+    mlog_fmt_spec_t       spec;
+
+    q = *p;
+    a = buf;
+    alast = buf + size;
+
+#define mlog_bin_put_slot(val)                                                \
+    if (alast - a < (ptrdiff_t) MLOG_FMT_ALIGN(sizeof(val))) {                \
+        return -1;                                                            \
+    }                                                                         \
+    memcpy(a, &(val), sizeof(val));                                           \
+    a += MLOG_FMT_ALIGN(sizeof(val))
+
+    while (mlog_fmt_next(&fmt, &spec)) {
+
+        if (spec.type == MLOG_ARG_NONE) {
+            continue;
+        }
+
+        if (spec.type == MLOG_ARG_BAD) {
+            return -1;
+        }
+
+        if (spec.star_width) {
+            if (mlog_bin_get_varint(&q, last, &v) != 0) {
+                return -1;
+            }
+
+            iv = (int) mlog_bin_unzigzag(v);
+            mlog_bin_put_slot(iv);
+        }
+
+        if (spec.star_prec) {
+            if (mlog_bin_get_varint(&q, last, &v) != 0) {
+                return -1;
+            }
+
+            iv = (int) mlog_bin_unzigzag(v);
+            mlog_bin_put_slot(iv);
+        }
+
+        switch (spec.type) {
+
+        case MLOG_ARG_DOUBLE:
+        case MLOG_ARG_LDOUBLE:
+            slen = spec.type == MLOG_ARG_DOUBLE ? sizeof(double)
+                                                : sizeof(long double);
+
+            if (last - q < slen || alast - a < MLOG_FMT_ALIGN(slen)) {
+                return -1;
+            }
+
+            memcpy(a, q, slen);
+            q += slen;
+            a += MLOG_FMT_ALIGN(slen);
+            continue;
+        }
+
+        if (mlog_bin_get_varint(&q, last, &v) != 0) {
+            return -1;
+        }
+
+        switch (spec.type) {
+
+        case MLOG_ARG_INT:
+            iv = (int) mlog_bin_unzigzag(v);
+            mlog_bin_put_slot(iv);
+            break;
+
+        case MLOG_ARG_LONG:
+        case MLOG_ARG_LLONG:
+        case MLOG_ARG_INTMAX:
+        case MLOG_ARG_PTRDIFF:
+            llv = mlog_bin_unzigzag(v);
+            mlog_bin_put_slot(llv);
+            break;
+
+        case MLOG_ARG_SIZE:
+        case MLOG_ARG_PTR:
+            mlog_bin_put_slot(v);
+            break;
+
+        case MLOG_ARG_STR:
+            slen = mlog_bin_unzigzag(v);
+            mlog_bin_put_slot(slen);
+
+            if (slen < 0) {
+                break;
+            }
+
+            if (last - q < slen || alast - a < MLOG_FMT_ALIGN(slen + 1)) {
+                return -1;
+            }
+
+            memcpy(a, q, slen);
+            a[slen] = '\0';
+            q += slen;
+            a += MLOG_FMT_ALIGN(slen + 1);
+            break;
+        }
+    }
+
+#undef mlog_bin_put_slot
+
+    *p = q;
+
+    return a - buf;
+}
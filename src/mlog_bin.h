@@ -0,0 +1,85 @@
+#ifndef __M_LOG_BIN_H__
+#define __M_LOG_BIN_H__
+
+#include <sys/types.h>
+#include "mlog_fmt.h"
+
+
+/*
+ * A binary log file is a sequence of entries, each starting with a tag
+ * byte. Numbers are LEB128 varints, signed ones zigzag encoded first.
+ *
+ *   header   "MLOGBIN1", resets the dictionary and the time base
+ *   site     tag, id, line, func len, func, fmt len, fmt
+ *   thread   tag, id, pid, tid
+ *   record   tag | level, msec delta, thread id, site id, arguments
+ *   text     tag | level, msec delta, thread id, len, formatted line
+ *
+ * The arguments of a record follow the conversions of its site's fmt:
+ * integers and pointers as varints, doubles as raw bytes and strings as
+ * a length (-1 for NULL) and their bytes.
+ */
+
+#define MLOG_BIN_MAGIC          "MLOGBIN1"
+#define MLOG_BIN_MAGIC_LEN      8
+
+#define MLOG_BIN_HEADER         'M'
+#define MLOG_BIN_SITE           0x01
+#define MLOG_BIN_THREAD         0x02
+#define MLOG_BIN_RECORD         0x10    /* low bits carry the level */
+#define MLOG_BIN_TEXT           0x20
+#define MLOG_BIN_TAG_MASK       0xf0
+#define MLOG_BIN_LEVEL_MASK     0x0f
+
+#define MLOG_BIN_VARINT_LEN     10
+
+/* an upper bound of the bytes a record head or a thread entry takes */
+#define MLOG_BIN_HEAD_LEN       (1 + 3 * MLOG_BIN_VARINT_LEN)
+
+
+typedef struct {
+    const char         *fmt;
+    const mlog_site_t  *desc;
+    unsigned int        id;
+} mlog_bin_site_t;
+
+
+/* what the writer already told the current file */
+typedef struct {
+    mlog_bin_site_t    *sites;      /* open addressing, fmt NULL if free */
+    unsigned int        cap;
+    unsigned int        nsites;
+    unsigned int        nthreads;
+    unsigned int        gen;        /* bumped by every reset */
+    unsigned long       last_msec;
+    unsigned int        header:1;   /* the file needs a header first */
+} mlog_bin_dict_t;
+
+
+int mlog_bin_dict_init(mlog_bin_dict_t *dict);
+void mlog_bin_dict_free(mlog_bin_dict_t *dict);
+void mlog_bin_dict_reset(mlog_bin_dict_t *dict);
+int mlog_bin_intern(mlog_bin_dict_t *dict, const mlog_fmt_site_t *site,
+    unsigned int *id);
+unsigned int mlog_bin_site_len(const mlog_fmt_site_t *site);
+
+unsigned char *mlog_bin_put_varint(unsigned char *p, unsigned long long v);
+int mlog_bin_get_varint(const unsigned char **p, const unsigned char *last,
+    unsigned long long *v);
+unsigned char *mlog_bin_put_site(unsigned char *p, unsigned int id,
+    const mlog_fmt_site_t *site);
+unsigned char *mlog_bin_put_head(unsigned char *p, int tag, int level,
+    long delta, unsigned int thread, unsigned int n);
+
+int mlog_bin_encode_args(unsigned char *buf, unsigned int size,
+    const char *fmt, const unsigned char *args, unsigned int len);
+int mlog_bin_decode_args(unsigned char *buf, unsigned int size,
+    const char *fmt, const unsigned char **p, const unsigned char *last);
+
+
+#define mlog_bin_zigzag(v)      (((unsigned long long) (v) << 1)              \
+                                 ^ (unsigned long long) ((long long) (v) >> 63))
+#define mlog_bin_unzigzag(v)    ((long long) ((v) >> 1) ^ -(long long) ((v) & 1))
+
+
+#endif /* __M_LOG_BIN_H__ */
@@ -0,0 +1,831 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "mlog.h"
+#include "mlog_fmt.h"
+
+
+static const char *err_levels[] = {
+    "error",
+    "warn",
+    "info",
+    "debug"
+};
+
+
+/*
+ * Finds the next conversion in *fmt and classifies the argument it takes.
+ * Returns 0 at the end of the string, the text before spec->start is
+ * literal.
+ */
+
+int
+mlog_fmt_next(const char **fmt, mlog_fmt_spec_t *spec)
+{
+    int          lmod = 0;
+    const char  *p;
+
+    p = strchr(*fmt, '%');
+    if (p == NULL) {
+        *fmt += strlen(*fmt);
+        return 0;
+    }
+
+    spec->start = p++;
+    spec->type = MLOG_ARG_BAD;
+    spec->star_width = 0;
+    spec->star_prec = 0;
+    spec->prec = -1;
+
+    if (*p == '%') {
+        spec->type = MLOG_ARG_NONE;
+        goto done;
+    }
+
+    while (*p && strchr("-+ #0'I", *p)) {
+        p++;
+    }
+
+    if (*p == '*') {
+        spec->star_width = 1;
+        p++;
+
+    } else {
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+
+    if (*p == '$') {
+        goto bad;
+    }
+
+    if (*p == '.') {
+        p++;
+
+        if (*p == '*') {
+            spec->star_prec = 1;
+            p++;
+
+        } else {
+            spec->prec = 0;
+
+            while (*p >= '0' && *p <= '9') {
+                spec->prec = spec->prec * 10 + *p++ - '0';
+            }
+        }
+    }
+
+    /* 'h' and "hh" promote to int, 'L' and 'q' on integers mean "ll" */
+
+    switch (*p) {
+    case 'h':
+        p += p[1] == 'h' ? 2 : 1;
+        break;
+    case 'l':
+        lmod = p[1] == 'l' ? MLOG_ARG_LLONG : MLOG_ARG_LONG;
+        p += p[1] == 'l' ? 2 : 1;
+        break;
+    case 'L':
+    case 'q':
+        lmod = MLOG_ARG_LLONG;
+        p++;
+        break;
+    case 'j':
+        lmod = MLOG_ARG_INTMAX;
+        p++;
+        break;
+    case 'z':
+    case 'Z':
+        lmod = MLOG_ARG_SIZE;
+        p++;
+        break;
+    case 't':
+        lmod = MLOG_ARG_PTRDIFF;
+        p++;
+        break;
+    }
+
+    switch (*p) {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+        spec->type = lmod ? lmod : MLOG_ARG_INT;
+        break;
+
+    case 'c':
+        if (lmod == 0) {
+            spec->type = MLOG_ARG_INT;
+        }
+        break;
+
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        spec->type = lmod == MLOG_ARG_LLONG ? MLOG_ARG_LDOUBLE
+                                            : MLOG_ARG_DOUBLE;
+        break;
+
+    case 's':
+        if (lmod == 0) {
+            spec->type = MLOG_ARG_STR;
+        }
+        break;
+
+    case 'p':
+        spec->type = MLOG_ARG_PTR;
+        break;
+
+    default:
+        /* %n, %m, %C, %S and whatever glibc learns next */
+        break;
+    }
+
+    if (*p == '\0') {
+        goto bad;
+    }
+
+done:
+
+    p++;
+    spec->len = p - spec->start;
+    *fmt = p;
+
+    return 1;
+
+bad:
+
+    spec->type = MLOG_ARG_BAD;
+    spec->len = p - spec->start;
+    *fmt = p;
+
+    return 1;
+}
+
+
+static inline int
+mlog_fmt_put(unsigned char **p, unsigned char *last, const void *v, size_t n)
+{
+    if ((size_t) (last - *p) < MLOG_FMT_ALIGN(n)) {
+        return -1;
+    }
+
+    memcpy(*p, v, n);
+    *p += MLOG_FMT_ALIGN(n);
+
+    return 0;
+}
+
+
+/*
+ * Copies the raw arguments "fmt" refers to into buf, %s strings by value.
+ * Returns the bytes used, or -1 if the format can not be deferred or the
+ * arguments do not fit.
+ */
+
+int
+mlog_fmt_capture(unsigned char *buf, unsigned int size, const char *fmt,
+    va_list args)
+{
+    int               iv, prec;
+    long              lv;
+    size_t            zv;
+    double            dv;
+    intmax_t          jv;
+    ptrdiff_t         tv;
+    long double       ldv;
+    long long         llv, slen;
+    const char       *s;
+    unsigned char    *p, *last;
+    mlog_fmt_spec_t   spec;
+
+    p = buf;
+    last = buf + size;
+
+    while (mlog_fmt_next(&fmt, &spec)) {
+
+        if (spec.type == MLOG_ARG_BAD) {
+            return -1;
+        }
+
+        if (spec.star_width) {
+            iv = va_arg(args, int);
+            if (mlog_fmt_put(&p, last, &iv, sizeof(int)) != 0) {
+                return -1;
+            }
+        }
+
+        prec = spec.prec;
+
+        if (spec.star_prec) {
+            prec = va_arg(args, int);
+            if (mlog_fmt_put(&p, last, &prec, sizeof(int)) != 0) {
+                return -1;
+            }
+        }
+
+        switch (spec.type) {
+
+        case MLOG_ARG_NONE:
+            continue;
+
+        case MLOG_ARG_INT:
+            iv = va_arg(args, int);
+            if (mlog_fmt_put(&p, last, &iv, sizeof(iv)) != 0) {
+                return -1;
+            }
+            break;
+
+        case MLOG_ARG_LONG:
+            lv = va_arg(args, long);
+            if (mlog_fmt_put(&p, last, &lv, sizeof(lv)) != 0) {
+                return -1;
+            }
+            break;
+
+        case MLOG_ARG_LLONG:
+            llv = va_arg(args, long long);
+            if (mlog_fmt_put(&p, last, &llv, sizeof(llv)) != 0) {
+                return -1;
+            }
+            break;
+
+        case MLOG_ARG_SIZE:
+            zv = va_arg(args, size_t);
+            if (mlog_fmt_put(&p, last, &zv, sizeof(zv)) != 0) {
+                return -1;
+            }
+            break;
+
+        case MLOG_ARG_INTMAX:
+            jv = va_arg(args, intmax_t);
+            if (mlog_fmt_put(&p, last, &jv, sizeof(jv)) != 0) {
+                return -1;
+            }
+            break;
+
+        case MLOG_ARG_PTRDIFF:
+            tv = va_arg(args, ptrdiff_t);
+            if (mlog_fmt_put(&p, last, &tv, sizeof(tv)) != 0) {
+                return -1;
+            }
+            break;
+
+        case MLOG_ARG_DOUBLE:
+            dv = va_arg(args, double);
+            if (mlog_fmt_put(&p, last, &dv, sizeof(dv)) != 0) {
+                return -1;
+            }
+            break;
+
+        case MLOG_ARG_LDOUBLE:
+            ldv = va_arg(args, long double);
+            if (mlog_fmt_put(&p, last, &ldv, sizeof(ldv)) != 0) {
+                return -1;
+            }
+            break;
+
+        case MLOG_ARG_PTR:
+            s = va_arg(args, void *);
+            if (mlog_fmt_put(&p, last, &s, sizeof(s)) != 0) {
+                return -1;
+            }
+            break;
+
+        case MLOG_ARG_STR:
+            s = va_arg(args, const char *);
+
+            /* the caller may free or reuse the string right after the call */
+
+            if (s == NULL) {
+                slen = -1;
+
+            } else if (prec >= 0) {
+                slen = strnlen(s, prec);
+
+            } else {
+                slen = strlen(s);
+            }
+
+            if (mlog_fmt_put(&p, last, &slen, sizeof(slen)) != 0) {
+                return -1;
+            }
+
+            if (slen < 0) {
+                break;
+            }
+
+            if (last - p < MLOG_FMT_ALIGN(slen + 1)) {
+                return -1;
+            }
+
+            memcpy(p, s, slen);
+            p[slen] = '\0';
+            p += MLOG_FMT_ALIGN(slen + 1);
+            break;
+        }
+    }
+
+    return p - buf;
+}
+
+
+#define mlog_fmt_get(p, v)                                                    \
+    memcpy(&(v), p, sizeof(v));                                               \
+    p += MLOG_FMT_ALIGN(sizeof(v))
+
+#define mlog_fmt_print(buf, size, spec, w, pr, v)                             \
+    ((spec)->star_width && (spec)->star_prec                                  \
+     ? snprintf(buf, size, sbuf, w, pr, v)                                    \
+     : (spec)->star_width ? snprintf(buf, size, sbuf, w, v)                   \
+     : (spec)->star_prec ? snprintf(buf, size, sbuf, pr, v)                   \
+     : snprintf(buf, size, sbuf, v))
+
+
+/*
+ * The writer side of mlog_fmt_capture(): formats the captured arguments
+ * one conversion at a time. Returns the length written, at most size - 1
+ * like vsnprintf(), and leaves no '\0' in it.
+ */
+
+int
+mlog_fmt_render(char *buf, unsigned int size, const char *fmt,
+    const unsigned char *args, unsigned int len)
+{
+    int                   n, w = 0, pr = 0, iv;
+    long                  lv;
+    size_t                zv;
+    double                dv;
+    intmax_t              jv;
+    ptrdiff_t             tv;
+    long double           ldv;
+    long long             llv, slen;
+    const char           *lit;
+    char                 *p, *last, sbuf[MLOG_FMT_SPEC_LEN];
+    void                 *pv;
+    const unsigned char  *a, *alast;
+    mlog_fmt_spec_t       spec;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    /* room for the '\0' of snprintf(), cut where vsnprintf() would */
+
+    p = buf;
+    last = buf + size - 1;
+    a = args;
+    alast = args + len;
+
+    for ( ;; ) {
+        lit = fmt;
+
+        if (!mlog_fmt_next(&fmt, &spec)) {
+            spec.start = fmt;
+        }
+
+        n = spec.start - lit;
+        if (n > last - p) {
+            n = last - p;
+        }
+
+        memcpy(p, lit, n);
+        p += n;
+
+        if (*spec.start == '\0' || p == last) {
+            break;
+        }
+
+        if (spec.type == MLOG_ARG_NONE) {
+            *p++ = '%';
+            continue;
+        }
+
+        if (spec.type == MLOG_ARG_BAD || spec.len >= MLOG_FMT_SPEC_LEN
+            || a >= alast)
+        {
+            break;
+        }
+
+        memcpy(sbuf, spec.start, spec.len);
+        sbuf[spec.len] = '\0';
+
+        if (spec.star_width) {
+            mlog_fmt_get(a, w);
+        }
+
+        if (spec.star_prec) {
+            mlog_fmt_get(a, pr);
+        }
+
+        switch (spec.type) {
+
+        case MLOG_ARG_INT:
+            mlog_fmt_get(a, iv);
+            n = mlog_fmt_print(p, last - p + 1, &spec, w, pr, iv);
+            break;
+
+        case MLOG_ARG_LONG:
+            mlog_fmt_get(a, lv);
+            n = mlog_fmt_print(p, last - p + 1, &spec, w, pr, lv);
+            break;
+
+        case MLOG_ARG_LLONG:
+            mlog_fmt_get(a, llv);
+            n = mlog_fmt_print(p, last - p + 1, &spec, w, pr, llv);
+            break;
+
+        case MLOG_ARG_SIZE:
+            mlog_fmt_get(a, zv);
+            n = mlog_fmt_print(p, last - p + 1, &spec, w, pr, zv);
+            break;
+
+        case MLOG_ARG_INTMAX:
+            mlog_fmt_get(a, jv);
+            n = mlog_fmt_print(p, last - p + 1, &spec, w, pr, jv);
+            break;
+
+        case MLOG_ARG_PTRDIFF:
+            mlog_fmt_get(a, tv);
+            n = mlog_fmt_print(p, last - p + 1, &spec, w, pr, tv);
+            break;
+
+        case MLOG_ARG_DOUBLE:
+            mlog_fmt_get(a, dv);
+            n = mlog_fmt_print(p, last - p + 1, &spec, w, pr, dv);
+            break;
+
+        case MLOG_ARG_LDOUBLE:
+            mlog_fmt_get(a, ldv);
+            n = mlog_fmt_print(p, last - p + 1, &spec, w, pr, ldv);
+            break;
+
+        case MLOG_ARG_PTR:
+            mlog_fmt_get(a, pv);
+            n = mlog_fmt_print(p, last - p + 1, &spec, w, pr, pv);
+            break;
+
+        case MLOG_ARG_STR:
+        default:
+            mlog_fmt_get(a, slen);
+
+            if (slen < 0) {
+                n = mlog_fmt_print(p, last - p + 1, &spec, w, pr,
+                                   (const char *) NULL);
+                break;
+            }
+
+            n = mlog_fmt_print(p, last - p + 1, &spec, w, pr,
+                               (const char *) a);
+            a += MLOG_FMT_ALIGN(slen + 1);
+            break;
+        }
+
+        if (n < 0) {
+            break;
+        }
+
+        p += n < last - p ? n : last - p;
+
+        if (p == last) {
+            break;
+        }
+    }
+
+    return p - buf;
+}
+
+
+/* "YYYY/MM/DD HH:MM:SS [level] pid#tid func#line: " */
+
+int
+mlog_fmt_prefix(char *buf, unsigned int size, mlog_time_cache_t *cache,
+    time_t sec, int level, pid_t pid, pid_t tid, const char *func, long line)
+{
+    int  len;
+
+    if (size <= MLOG_TIME_LEN) {
+        return -1;
+    }
+
+    mlog_time_format(cache, sec, buf);
+
+    len = snprintf(buf + MLOG_TIME_LEN, size - MLOG_TIME_LEN,
+                   " [%s] %d#%d %s#%ld: ",
+                   err_levels[level], pid, tid, func, line);
+    if (len <= 0 || (unsigned int) len >= size - MLOG_TIME_LEN) {
+        return -1;
+    }
+
+    return MLOG_TIME_LEN + len;
+}
+
+
+/*
+ * The crash handler's mlog_fmt_render() and mlog_fmt_prefix(): no stdio,
+ * no locale, no tz lock, only what is async-signal-safe. Integers and
+ * strings take the flags '-' and '0' and a width, a string had its
+ * precision applied at capture; a floating point argument prints as '?'.
+ */
+
+static char *
+mlog_fmt_put_sigsafe(char *p, char *last, const char *s, size_t n)
+{
+    if (n > (size_t) (last - p)) {
+        n = last - p;
+    }
+
+    memcpy(p, s, n);
+
+    return p + n;
+}
+
+
+static char *
+mlog_fmt_pad_sigsafe(char *p, char *last, const char *s, size_t n,
+    int width, int left, int zero)
+{
+    if (zero && !left && n && (*s == '-' || *s == '0') && p < last) {
+
+        /* the sign or the "0x" goes in front of the zeros */
+
+        if (*s == '0' && n > 1 && s[1] == 'x') {
+            p = mlog_fmt_put_sigsafe(p, last, s, 2);
+            s += 2;
+            n -= 2;
+            width -= 2;
+
+        } else if (*s == '-') {
+            *p++ = *s++;
+            n--;
+            width--;
+        }
+    }
+
+    if (!left) {
+        for ( ; width > (int) n && p < last; width--) {
+            *p++ = zero ? '0' : ' ';
+        }
+    }
+
+    p = mlog_fmt_put_sigsafe(p, last, s, n);
+
+    for ( ; left && width > (int) n && p < last; width--) {
+        *p++ = ' ';
+    }
+
+    return p;
+}
+
+
+static char *
+mlog_fmt_num_sigsafe(char *p, char *last, unsigned long long v, int neg,
+    int conv, int width, int left, int zero)
+{
+    char          tmp[32], *t;
+    const char   *digits;
+    unsigned int  base;
+
+    base = conv == 'o' ? 8 : (conv == 'x' || conv == 'X' || conv == 'p')
+                             ? 16 : 10;
+    digits = conv == 'X' ? "0123456789ABCDEF" : "0123456789abcdef";
+
+    t = tmp + sizeof(tmp);
+
+    do {
+        *--t = digits[v % base];
+        v /= base;
+    } while (v);
+
+    if (conv == 'p') {
+        *--t = 'x';
+        *--t = '0';
+
+    } else if (neg) {
+        *--t = '-';
+    }
+
+    return mlog_fmt_pad_sigsafe(p, last, t, tmp + sizeof(tmp) - t, width,
+                                left, zero);
+}
+
+
+int
+mlog_fmt_render_sigsafe(char *buf, unsigned int size, const char *fmt,
+    const unsigned char *args, unsigned int len)
+{
+    int                   w, pr, iv, left, zero, conv;
+    char                  c;
+    long                  lv;
+    size_t                zv;
+    intmax_t              jv;
+    ptrdiff_t             tv;
+    long long             llv, slen;
+    unsigned long long    uv;
+    const char           *lit, *f;
+    char                 *p, *last;
+    void                 *pv;
+    const unsigned char  *a, *alast;
+    mlog_fmt_spec_t       spec;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    /* cut where mlog_fmt_render() cuts */
+
+    p = buf;
+    last = buf + size - 1;
+    a = args;
+    alast = args + len;
+
+    for ( ;; ) {
+        lit = fmt;
+
+        if (!mlog_fmt_next(&fmt, &spec)) {
+            spec.start = fmt;
+        }
+
+        p = mlog_fmt_put_sigsafe(p, last, lit, spec.start - lit);
+
+        if (*spec.start == '\0' || p == last) {
+            break;
+        }
+
+        if (spec.type == MLOG_ARG_NONE) {
+            *p++ = '%';
+            continue;
+        }
+
+        if (spec.type == MLOG_ARG_BAD || a >= alast) {
+            break;
+        }
+
+        left = 0;
+        zero = 0;
+        w = 0;
+
+        for (f = spec.start + 1; *f && strchr("-+ #0'I", *f); f++) {
+            left |= *f == '-';
+            zero |= *f == '0';
+        }
+
+        for ( ; *f >= '0' && *f <= '9'; f++) {
+            w = w * 10 + *f - '0';
+        }
+
+        if (spec.star_width) {
+            mlog_fmt_get(a, w);
+
+            if (w < 0) {
+                left = 1;
+                w = -w;
+            }
+        }
+
+        if (spec.star_prec) {
+            mlog_fmt_get(a, pr);
+            (void) pr;
+        }
+
+        conv = spec.start[spec.len - 1];
+        llv = 0;
+        uv = 0;
+
+        switch (spec.type) {
+
+        case MLOG_ARG_INT:
+            mlog_fmt_get(a, iv);
+            llv = iv;
+            uv = (unsigned int) iv;
+            break;
+
+        case MLOG_ARG_LONG:
+            mlog_fmt_get(a, lv);
+            llv = lv;
+            uv = (unsigned long) lv;
+            break;
+
+        case MLOG_ARG_LLONG:
+            mlog_fmt_get(a, llv);
+            uv = (unsigned long long) llv;
+            break;
+
+        case MLOG_ARG_SIZE:
+            mlog_fmt_get(a, zv);
+            llv = (ssize_t) zv;
+            uv = zv;
+            break;
+
+        case MLOG_ARG_INTMAX:
+            mlog_fmt_get(a, jv);
+            llv = jv;
+            uv = (uintmax_t) jv;
+            break;
+
+        case MLOG_ARG_PTRDIFF:
+            mlog_fmt_get(a, tv);
+            llv = tv;
+            uv = (size_t) tv;
+            break;
+
+        case MLOG_ARG_DOUBLE:
+            a += MLOG_FMT_ALIGN(sizeof(double));
+            p = mlog_fmt_pad_sigsafe(p, last, "?", 1, w, left, 0);
+            continue;
+
+        case MLOG_ARG_LDOUBLE:
+            a += MLOG_FMT_ALIGN(sizeof(long double));
+            p = mlog_fmt_pad_sigsafe(p, last, "?", 1, w, left, 0);
+            continue;
+
+        case MLOG_ARG_PTR:
+            mlog_fmt_get(a, pv);
+
+            if (pv == NULL) {
+                p = mlog_fmt_pad_sigsafe(p, last, "(nil)", 5, w, left, 0);
+
+            } else {
+                p = mlog_fmt_num_sigsafe(p, last, (uintptr_t) pv, 0, 'p', w,
+                                         left, zero);
+            }
+
+            continue;
+
+        case MLOG_ARG_STR:
+        default:
+            mlog_fmt_get(a, slen);
+
+            if (slen < 0) {
+                p = mlog_fmt_pad_sigsafe(p, last, "(null)", 6, w, left, 0);
+                continue;
+            }
+
+            p = mlog_fmt_pad_sigsafe(p, last, (const char *) a, slen, w,
+                                     left, 0);
+            a += MLOG_FMT_ALIGN(slen + 1);
+            continue;
+        }
+
+        if (conv == 'c') {
+            c = (char) uv;
+            p = mlog_fmt_pad_sigsafe(p, last, &c, 1, w, left, 0);
+
+        } else if (conv == 'd' || conv == 'i') {
+            p = mlog_fmt_num_sigsafe(p, last,
+                                     llv < 0 ? 0ULL - (unsigned long long) llv
+                                             : (unsigned long long) llv,
+                                     llv < 0, conv, w, left, zero);
+
+        } else {
+            p = mlog_fmt_num_sigsafe(p, last, uv, 0, conv, w, left, zero);
+        }
+    }
+
+    return p - buf;
+}
+
+
+int
+mlog_fmt_prefix_sigsafe(char *buf, unsigned int size, long gmtoff,
+    time_t sec, int level, pid_t pid, pid_t tid, const char *func, long line)
+{
+    char  *p, *last;
+
+    if (size <= MLOG_TIME_LEN) {
+        return -1;
+    }
+
+    mlog_time_format_sigsafe(sec, gmtoff, buf);
+
+    p = buf + MLOG_TIME_LEN;
+    last = buf + size;
+
+    p = mlog_fmt_put_sigsafe(p, last, " [", 2);
+    p = mlog_fmt_put_sigsafe(p, last, err_levels[level],
+                             strlen(err_levels[level]));
+    p = mlog_fmt_put_sigsafe(p, last, "] ", 2);
+    p = mlog_fmt_num_sigsafe(p, last, pid, 0, 'u', 0, 0, 0);
+    p = mlog_fmt_put_sigsafe(p, last, "#", 1);
+    p = mlog_fmt_num_sigsafe(p, last, tid, 0, 'u', 0, 0, 0);
+    p = mlog_fmt_put_sigsafe(p, last, " ", 1);
+    p = mlog_fmt_put_sigsafe(p, last, func, strlen(func));
+    p = mlog_fmt_put_sigsafe(p, last, "#", 1);
+    p = mlog_fmt_num_sigsafe(p, last, (unsigned long) line, 0, 'u', 0, 0, 0);
+    p = mlog_fmt_put_sigsafe(p, last, ": ", 2);
+
+    if (p == last) {
+        return -1;
+    }
+
+    return p - buf;
+}
@@ -0,0 +1,61 @@
+#ifndef __M_LOG_FMT_H__
+#define __M_LOG_FMT_H__
+
+#include <stdarg.h>
+#include <sys/types.h>
+#include "mlog.h"
+#include "mlog_time.h"
+
+
+/* what a conversion takes from the argument list */
+#define MLOG_ARG_NONE       0   /* "%%" */
+#define MLOG_ARG_INT        1
+#define MLOG_ARG_LONG       2
+#define MLOG_ARG_LLONG      3
+#define MLOG_ARG_SIZE       4
+#define MLOG_ARG_INTMAX     5
+#define MLOG_ARG_PTRDIFF    6
+#define MLOG_ARG_DOUBLE     7
+#define MLOG_ARG_LDOUBLE    8
+#define MLOG_ARG_STR        9
+#define MLOG_ARG_PTR        10
+#define MLOG_ARG_BAD        -1  /* %n, %m, wide chars, positional args */
+
+#define MLOG_FMT_SPEC_LEN   32
+
+/* captured arguments take whole slots */
+#define MLOG_FMT_SLOT       8
+#define MLOG_FMT_ALIGN(n)   (((n) + MLOG_FMT_SLOT - 1) & ~(MLOG_FMT_SLOT - 1))
+
+
+typedef struct {
+    const char         *start;      /* the '%' */
+    unsigned int        len;        /* up to and including the conversion */
+    int                 type;       /* MLOG_ARG_* */
+    unsigned int        star_width:1;
+    unsigned int        star_prec:1;
+    int                 prec;       /* -1 when not given inline */
+} mlog_fmt_spec_t;
+
+
+/* what a deferred record holds in front of the captured arguments */
+typedef struct {
+    const char         *fmt;
+    const mlog_site_t  *desc;
+} mlog_fmt_site_t;
+
+
+int mlog_fmt_next(const char **fmt, mlog_fmt_spec_t *spec);
+int mlog_fmt_capture(unsigned char *buf, unsigned int size, const char *fmt,
+    va_list args);
+int mlog_fmt_render(char *buf, unsigned int size, const char *fmt,
+    const unsigned char *args, unsigned int len);
+int mlog_fmt_prefix(char *buf, unsigned int size, mlog_time_cache_t *cache,
+    time_t sec, int level, pid_t pid, pid_t tid, const char *func, long line);
+int mlog_fmt_render_sigsafe(char *buf, unsigned int size, const char *fmt,
+    const unsigned char *args, unsigned int len);
+int mlog_fmt_prefix_sigsafe(char *buf, unsigned int size, long gmtoff,
+    time_t sec, int level, pid_t pid, pid_t tid, const char *func, long line);
+
+
+#endif /* __M_LOG_FMT_H__ */
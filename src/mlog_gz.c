@@ -0,0 +1,183 @@
+#ifdef MLOG_WITH_ZLIB
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "mlog_gz.h"
+
+
+static inline unsigned char *
+mlog_gz_put32(unsigned char *p, uint32_t v)
+{
+    *p++ = v;
+    *p++ = v >> 8;
+    *p++ = v >> 16;
+    *p++ = v >> 24;
+
+    return p;
+}
+
+
+/* a member header for a member of size bytes */
+
+static void
+mlog_gz_header(unsigned char *p, size_t size)
+{
+    *p++ = 0x1f;
+    *p++ = 0x8b;
+    *p++ = Z_DEFLATED;
+    *p++ = 0x04;                        /* FEXTRA */
+    p = mlog_gz_put32(p, 0);            /* no mtime, lines have theirs */
+    *p++ = 0;
+    *p++ = 3;                           /* unix */
+    *p++ = 8;
+    *p++ = 0;
+    *p++ = 'M';
+    *p++ = 'L';
+    *p++ = 4;
+    *p++ = 0;
+    mlog_gz_put32(p, size);
+}
+
+
+/* max_in is the largest batch, the buffer holds its worst case member */
+
+int
+mlog_gz_init(mlog_gz_t *gz, int level, size_t max_in)
+{
+    memset(gz, 0, sizeof(mlog_gz_t));
+
+    if (deflateInit2(&gz->zs, level, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return -1;
+    }
+
+    gz->size = MLOG_GZ_HEADER_LEN + deflateBound(&gz->zs, max_in)
+               + MLOG_GZ_TRAILER_LEN;
+
+    gz->buf = malloc(gz->size);
+    if (gz->buf == NULL) {
+        deflateEnd(&gz->zs);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void
+mlog_gz_free(mlog_gz_t *gz)
+{
+    if (gz->buf == NULL) {
+        return;
+    }
+
+    deflateEnd(&gz->zs);
+    free(gz->buf);
+    gz->buf = NULL;
+}
+
+
+/* compresses the iovecs into one member in gz->buf, returns its size */
+
+ssize_t
+mlog_gz_member(mlog_gz_t *gz, const struct iovec *iov, int cnt)
+{
+    int             i, ret = Z_OK;
+    size_t          len;
+    uLong           crc;
+    uint32_t        isize = 0;
+    unsigned char  *p;
+
+    if (deflateReset(&gz->zs) != Z_OK) {
+        return -1;
+    }
+
+    crc = crc32(0, Z_NULL, 0);
+
+    gz->zs.next_out = gz->buf + MLOG_GZ_HEADER_LEN;
+    gz->zs.avail_out = gz->size - MLOG_GZ_HEADER_LEN - MLOG_GZ_TRAILER_LEN;
+
+    for (i = 0; i < cnt; i++) {
+        gz->zs.next_in = iov[i].iov_base;
+        gz->zs.avail_in = iov[i].iov_len;
+
+        crc = crc32(crc, iov[i].iov_base, iov[i].iov_len);
+        isize += iov[i].iov_len;
+
+        ret = deflate(&gz->zs, i == cnt - 1 ? Z_FINISH : Z_NO_FLUSH);
+
+        if (ret == Z_STREAM_ERROR || gz->zs.avail_in) {
+            return -1;
+        }
+    }
+
+    if (ret != Z_STREAM_END) {
+        return -1;
+    }
+
+    p = mlog_gz_put32(gz->zs.next_out, crc);
+    p = mlog_gz_put32(p, isize);
+
+    len = p - gz->buf;
+
+    mlog_gz_header(gz->buf, len);
+
+    return len;
+}
+
+
+/*
+ * The head and trailer of a member that keeps len bytes at p, up to
+ * MLOG_GZ_STORED_MAX, in one stored block: no deflate, no allocation and
+ * a crc32 of its own, so a crash handler may call it. head takes
+ * MLOG_GZ_STORED_LEN bytes, trailer MLOG_GZ_TRAILER_LEN.
+ */
+
+void
+mlog_gz_stored(unsigned char *head, unsigned char *trailer,
+    const unsigned char *p, size_t len)
+{
+    int       k;
+    size_t    i;
+    uint32_t  crc = 0xffffffff;
+
+    for (i = 0; i < len; i++) {
+        crc ^= p[i];
+
+        for (k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+
+    mlog_gz_header(head, MLOG_GZ_STORED_LEN + len + MLOG_GZ_TRAILER_LEN);
+
+    head += MLOG_GZ_HEADER_LEN;
+
+    *head++ = 0x01;                     /* BFINAL, stored */
+    *head++ = len;
+    *head++ = len >> 8;
+    *head++ = ~len;
+    *head++ = ~len >> 8;
+
+    trailer = mlog_gz_put32(trailer, ~crc);
+    mlog_gz_put32(trailer, len);
+}
+
+
+/* the size of the member at p from its header, 0 if it is not one of ours */
+
+size_t
+mlog_gz_member_size(const unsigned char *p, size_t len)
+{
+    if (len < MLOG_GZ_HEADER_LEN || p[0] != 0x1f || p[1] != 0x8b
+        || !(p[3] & 0x04) || p[12] != 'M' || p[13] != 'L')
+    {
+        return 0;
+    }
+
+    return p[16] | p[17] << 8 | p[18] << 16 | (size_t) p[19] << 24;
+}
+
+#endif /* MLOG_WITH_ZLIB */
@@ -0,0 +1,43 @@
+#ifndef __M_LOG_GZ_H__
+#define __M_LOG_GZ_H__
+
+#ifdef MLOG_WITH_ZLIB
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+
+/*
+ * Each batch becomes one gzip member (RFC 1952), so the file reads with
+ * zcat and inflating can start at any member. FEXTRA carries subfield
+ * "ML" with the member's own size, little endian, to hop from member to
+ * member without inflating, as BGZF does:
+ *
+ *   1f 8b 08 04  mtime(4)  00 03  xlen=8(2)  'M' 'L'  4 0  size(4)
+ *   raw deflate  crc32(4)  isize(4)
+ */
+
+#define MLOG_GZ_HEADER_LEN      20
+#define MLOG_GZ_TRAILER_LEN     8
+#define MLOG_GZ_STORED_LEN      (MLOG_GZ_HEADER_LEN + 5)
+#define MLOG_GZ_STORED_MAX      65535
+
+
+typedef struct {
+    z_stream            zs;
+    unsigned char      *buf;            /* the member being built */
+    size_t              size;
+} mlog_gz_t;
+
+
+int mlog_gz_init(mlog_gz_t *gz, int level, size_t max_in);
+void mlog_gz_free(mlog_gz_t *gz);
+ssize_t mlog_gz_member(mlog_gz_t *gz, const struct iovec *iov, int cnt);
+void mlog_gz_stored(unsigned char *head, unsigned char *trailer,
+    const unsigned char *p, size_t len);
+size_t mlog_gz_member_size(const unsigned char *p, size_t len);
+
+#endif /* MLOG_WITH_ZLIB */
+
+#endif /* __M_LOG_GZ_H__ */
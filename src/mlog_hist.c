@@ -0,0 +1,71 @@
+#include "mlog_hist.h"
+
+
+void
+mlog_hist_merge(mlog_hist_t *sum, const mlog_hist_t *h)
+{
+    unsigned int  i;
+
+    for (i = 0; i < MLOG_HIST_BUCKETS; i++) {
+        sum->buckets[i] += h->buckets[i];
+    }
+
+    sum->count += h->count;
+    sum->sum += h->sum;
+
+    if (h->max > sum->max) {
+        sum->max = h->max;
+    }
+}
+
+
+/* the largest value of a bucket */
+
+static unsigned long
+mlog_hist_high(unsigned int i)
+{
+    unsigned int  e, shift;
+
+    if (i < MLOG_HIST_SUB) {
+        return i;
+    }
+
+    e = i / MLOG_HIST_SUB + MLOG_HIST_SUB_BITS - 1;
+    shift = e - MLOG_HIST_SUB_BITS;
+
+    return (((unsigned long) (MLOG_HIST_SUB + i % MLOG_HIST_SUB) + 1) << shift)
+           - 1;
+}
+
+
+/*
+ * The value below which the fraction q of the samples lies, rounded up
+ * to the end of its bucket but never above the largest sample.
+ */
+
+unsigned long
+mlog_hist_value_at(const mlog_hist_t *h, double q)
+{
+    unsigned int   i;
+    unsigned long  rank, n = 0, v;
+
+    if (h->count == 0) {
+        return 0;
+    }
+
+    rank = (unsigned long) (q * h->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (i = 0; i < MLOG_HIST_BUCKETS; i++) {
+        n += h->buckets[i];
+
+        if (n >= rank) {
+            v = mlog_hist_high(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+
+    return h->max;
+}
@@ -0,0 +1,66 @@
+#ifndef __M_LOG_HIST_H__
+#define __M_LOG_HIST_H__
+
+
+/*
+ * A log-linear histogram of nsec values: below 2^MLOG_HIST_SUB_BITS each
+ * value has a bucket, above every power of two is split into
+ * 2^MLOG_HIST_SUB_BITS buckets, so a bucket is within 1/16 of its values.
+ * Values from 2^MLOG_HIST_MAX_EXP nsec (18 minutes) on share the last one.
+ */
+
+#define MLOG_HIST_SUB_BITS      4
+#define MLOG_HIST_SUB           (1 << MLOG_HIST_SUB_BITS)
+#define MLOG_HIST_MAX_EXP       40
+#define MLOG_HIST_BUCKETS                                                     \
+    ((MLOG_HIST_MAX_EXP - MLOG_HIST_SUB_BITS + 2) * MLOG_HIST_SUB)
+
+
+typedef struct {
+    unsigned long       count;
+    unsigned long       sum;
+    unsigned long       max;
+    unsigned long       buckets[MLOG_HIST_BUCKETS];
+} mlog_hist_t;
+
+
+static inline unsigned int
+mlog_hist_index(unsigned long v)
+{
+    unsigned int  e;
+
+    if (v < MLOG_HIST_SUB) {
+        return v;
+    }
+
+    e = 63 - __builtin_clzl(v);
+
+    if (e > MLOG_HIST_MAX_EXP) {
+        return MLOG_HIST_BUCKETS - 1;
+    }
+
+    return (e - MLOG_HIST_SUB_BITS + 1) * MLOG_HIST_SUB
+           + ((v >> (e - MLOG_HIST_SUB_BITS)) & (MLOG_HIST_SUB - 1));
+}
+
+
+/* only ever updated by one thread */
+
+static inline void
+mlog_hist_add(mlog_hist_t *h, unsigned long v)
+{
+    h->buckets[mlog_hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+
+void mlog_hist_merge(mlog_hist_t *sum, const mlog_hist_t *h);
+unsigned long mlog_hist_value_at(const mlog_hist_t *h, double q);
+
+
+#endif /* __M_LOG_HIST_H__ */
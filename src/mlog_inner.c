@@ -1,28 +1,154 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <fcntl.h>
 #include "util/hash.h"
 #include "util/kfifo.h"
-#include "util/ngx_queue.h"
 #include "mlog_inner.h"
+#include "mlog_time.h"
+#include "mlog_fmt.h"
+#include "mlog_bin.h"
+#include "mlog_hist.h"
+#include "mlog_gz.h"
+#include "mlog_uring.h"
+#include "mlog_sink.h"
 
 
-#define  MLOG_MAX_FREE_LIST_SIZE    1024
+#define  MLOG_RECORD_ALIGN          16
+#define  MLOG_RECORD_SIZE(len)                                                \
+    ((sizeof(mlog_record_t) + (len) + MLOG_RECORD_ALIGN - 1)                  \
+     & ~(MLOG_RECORD_ALIGN - 1))
+
+#ifndef IOV_MAX
+#define  IOV_MAX                    1024
+#endif
+
+#define  MLOG_REPORT_INTERVAL       1000    /* msec, rate limit summaries */
+
+#define  MLOG_BLOCK_SPINS           1000    /* before a blocked thread sleeps */
+#define  MLOG_BLOCK_PARK            10      /* msec, the longest single sleep */
+
+/* async_job.waiting, what wakes the sleeping writer */
+#define  MLOG_WAIT_ANY              1       /* any new line */
+#define  MLOG_WAIT_URGENT           2       /* a flush, it holds a batch */
+
+/* async_job.flush, asked for by producers */
+#define  MLOG_FLUSH_BATCH           1       /* write the held batch now */
+#define  MLOG_FLUSH_ALL             2       /* and what the window holds */
+
+#define  MLOG_CRASH_MAGIC           0x52434c4d  /* "MLCR" */
+#define  MLOG_CRASH_VERSION         2
+
+#define  MLOG_CRASH_WAIT            100     /* msec for the writer to stop */
+#define  MLOG_CRASH_RINGS           256     /* kfifos merged at once */
+#define  MLOG_CRASH_BUF             (64 * 1024)
+#define  MLOG_FATAL_SIGNALS         5
+
+#if defined(__x86_64__) || defined(__i386__)
+#define  mlog_cpu_relax()           __asm__ __volatile__("pause")
+#elif defined(__aarch64__)
+#define  mlog_cpu_relax()           __asm__ __volatile__("yield")
+#else
+#define  mlog_cpu_relax()
+#endif
 
 
 typedef unsigned long                  mlog_atomic_uint_t;
 typedef volatile mlog_atomic_uint_t    mlog_atomic_t;
 
 
+/*
+ * every line in a kfifo is preceded by this header; len and type come in
+ * the first MLOG_RECORD_ALIGN bytes, all a padding record may have room for
+ */
+typedef struct {
+    unsigned long              msec;
+    unsigned int               len;
+    unsigned char              type;        /* MLOG_RECORD_* */
+    unsigned char              level;
+#ifdef MLOG_LATENCY
+    unsigned long              stamp;       /* nsec, mlog_format() entered */
+#endif
+} mlog_record_t;
+
+
+/* the bytes of a record at pos, a padding record ends the buffer */
+
+static inline unsigned int
+mlog_record_size(struct kfifo *fifo, unsigned int pos, mlog_record_t *rec)
+{
+    if (rec->type == MLOG_RECORD_PAD) {
+        return fifo->size - (pos & (fifo->size - 1));
+    }
+
+    return MLOG_RECORD_SIZE(rec->len);
+}
+
+
+/*
+ * The crash file starts with a page of this, then each slot is a page of
+ * mlog_crash_slot_t followed by its kfifo buffer. A crashed run leaves
+ * the records between out and in of every slot behind.
+ */
+typedef struct {
+    unsigned int               magic;
+    unsigned int               version;
+    unsigned int               page;
+    unsigned int               nslots;
+    pid_t                      pid;
+    unsigned long              exe_ino;     /* deferred records point into */
+    unsigned long              exe_mtime;   /* the program, which must match */
+    unsigned long              sites;       /* __start_mlog_sites of the run */
+    unsigned long              nsites;
+} mlog_crash_head_t;
+
+
+typedef struct {
+    struct kfifo               fifo;        /* in and out of the kfifo */
+    pid_t                      pid;
+    pid_t                      tid;
+    int                        used;
+} mlog_crash_slot_t;
+
+
 typedef struct {
     hash_link                  hlnk;
     pid_t                      pid;
     pid_t                      tid;
     struct kfifo              *kfifo_buf;
-    mlog_atomic_t              refer;
+    unsigned int               rpos;        /* writer side read cursor */
+    unsigned int               end;         /* writer side snapshot of in */
+    mlog_atomic_t              refer;       /* owner thread and writer */
+    unsigned int               bin_id;      /* thread entry in the file */
+    unsigned int               bin_gen;
+    unsigned int               head;        /* oldest record nobody claimed */
+    unsigned int               claim;       /* the writer claimed up to it */
+    int                        parked;      /* owner sleeps on kfifo->out */
+    mlog_crash_slot_t         *slot;        /* in the crash file, or NULL */
+    int                        recovered;   /* of a crashed run */
+
+    /* owner thread only, away from what the writer writes */
+    mlog_counters_t            counters __attribute__((aligned(64)));
+    unsigned int               peak;        /* most kfifo bytes in use */
+#ifdef MLOG_LATENCY
+    mlog_hist_t                producer;    /* nsec spent in mlog_format() */
+#endif
 } mlog_thread_local_data_t;
 
 
@@ -30,35 +156,108 @@ typedef struct {
     hash_table                *table;
     pthread_mutex_t            mutex;
     unsigned int               kfifo_buf_size;
+    unsigned int               sig_buf_size; /* 0 for no signal kfifos */
+    mlog_atomic_t              generation;  /* bumped when table changes */
+    mlog_counters_t            exited;      /* of the kfifos freed */
+#ifdef MLOG_LATENCY
+    mlog_hist_t                exited_producer;
+#endif
 } mlog_thread_data_t;
 
 
-typedef struct {
-    ngx_queue_t                q;
-    unsigned long              msec;
-    unsigned int               msg_len;
-    mlog_thread_local_data_t  *data;
-} mlog_task_t;
-
-
 typedef struct {
     pthread_t                  tid;
     int                        fd;
     const char                *filename;
-    ngx_queue_t                task_list;
-    ngx_queue_t                free_list;
-    unsigned int               free_count;
-    pthread_cond_t             cond;
-    pthread_mutex_t            mutex;
+    unsigned long              file_bytes;
+    int                        io;          /* MLOG_IO_* */
+    unsigned char             *map;         /* MLOG_IO_MMAP window */
+    size_t                     map_size;
+    off_t                      map_off;
+    mlog_uring_t               uring;       /* MLOG_IO_URING */
+    int                        batch_fsync;
+    mlog_sink_t                sinks[MLOG_MAX_SINKS];
+    unsigned int               nsinks;
+    unsigned char             *levels;      /* of the lines in iov */
+    int                        next_fd;     /* the file rotation switches to */
+    char                       next_path[PATH_MAX];
+    unsigned long              rotate_size;
+    unsigned long              rotate_interval; /* sec */
+    unsigned long              rotate_sec;  /* when the next one is due */
+    unsigned int               rotate_keep;
+    int                        reopen;      /* asked for by mlog_reopen() */
+    int                        reopen_signal;
+    struct sigaction           reopen_sa;   /* what the signal did before */
+    struct iovec              *iov;
+    unsigned int               iov_count;
+    unsigned int               iov_bytes;
+    char                      *fmt_buf;     /* lines the writer formatted */
+    unsigned int               fmt_used;
+    mlog_time_cache_t          tcache;
+    int                        output;      /* MLOG_OUTPUT_* */
+    int                        compress;    /* MLOG_COMPRESS_* */
+#ifdef MLOG_WITH_ZLIB
+    mlog_gz_t                  gz;
+#endif
+    mlog_bin_dict_t            bin;
+    unsigned int               batch_bytes;
+    unsigned int               batch_count;
+    int                        order;
+    unsigned int               reorder_window;
+    mlog_thread_local_data_t **rings;       /* writer's view of the table */
+    unsigned int               nrings;
+    unsigned int               rings_cap;
+    mlog_atomic_uint_t         generation;
+    mlog_thread_local_data_t **heap;
+    unsigned int               nheap;
+    int                        wake_fd;     /* eventfd the writer sleeps on */
+    int                        idle;        /* MLOG_IDLE_* */
+    unsigned long              idle_spin;   /* nsec */
+    unsigned long              idle_park;   /* msec */
+    int                        waiting;     /* MLOG_WAIT_* */
+    int                        flush;       /* MLOG_FLUSH_* */
+    unsigned long              flush_nsec;  /* hold a batch this long */
+    unsigned int               flush_bytes;
+    int                        flush_level;
+    unsigned long              batch_nsec;  /* the held batch began */
+    int                        urgent;      /* it has a line not to hold */
     volatile int               active;
+    unsigned long              report_msec;
+    int                        overflow[MLOG_LEVEL_DEBUG + 1];
+    int                        overwrite;   /* the writer claims records */
+    unsigned int               watermark[MLOG_LEVEL_DEBUG + 1];   /* % */
+    int                        shedding;    /* any watermark below 100% */
+    mlog_thread_local_data_t  *spill;       /* shared arena, tid 0 */
+    pthread_mutex_t            spill_mutex;
+    unsigned long              batches;     /* written by the writer only */
+    unsigned long              batched_lines;
+    unsigned long              batched_bytes;
+    unsigned long              write_errors;
+    unsigned long              start_msec;
+    mlog_stats_t              *stats_map;   /* the stats file */
+    int                        crash_fd;
+    mlog_crash_head_t         *crash;       /* the whole crash file */
+    size_t                     crash_size;
+    mlog_crash_head_t         *crash_old;   /* of the run being recovered */
+    size_t                     crash_old_size;
+    unsigned int               recovering;  /* its kfifos not written yet */
+    int                        crashing;    /* mlog_crash_flush() drains */
+    int                        crash_parked; /* the writer keeps off */
+    long                       crash_gmtoff; /* UTC to local, for the drain */
+    int                        fatal_flush; /* the handlers are installed */
+    struct sigaction           fatal_sa[MLOG_FATAL_SIGNALS]; /* before */
+    unsigned long              stats_msec;
+#ifdef MLOG_LATENCY
+    unsigned long             *stamps;      /* of the records in iov */
+    mlog_hist_t                queue;       /* nsec from call to write */
+#endif
 } mlog_async_job_t;
 
 
 static void mlog_destroy_pkey();
+static mlog_thread_local_data_t *mlog_ring_create(pid_t pid, pid_t tid,
+    unsigned int size, int shared);
 static mlog_thread_local_data_t *mlog_get_thread_data();
-static inline void mlog_release_free_list();
-static void mlog_do_write_log(ngx_queue_t *task_list, int active);
-static inline mlog_atomic_t mlog_increase_refer(mlog_thread_local_data_t *data);
 static inline mlog_atomic_t mlog_decrease_refer(mlog_thread_local_data_t *data);
 static void mlog_decrease_refer_and_try_release(mlog_thread_local_data_t *data);
 
@@ -67,6 +266,32 @@ static pthread_key_t           mlog_pkey;
 static mlog_async_job_t        async_job;
 static mlog_thread_data_t      thread_data;
 
+/*
+ * kfifos not looked up by tid share the hash key of the spill arena, 0:
+ * those recovered from a crash and those of signal handlers
+ */
+static pid_t                   mlog_shared_tid;
+
+/* what conf->fatal_flush drains the kfifos on, see async_job.fatal_sa */
+static const int               mlog_fatal_signals[MLOG_FATAL_SIGNALS] = {
+    SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT
+};
+
+/* mlog_crash_flush() may not allocate */
+static mlog_thread_local_data_t *mlog_crash_rings[MLOG_CRASH_RINGS];
+static unsigned char mlog_crash_buf[MLOG_CRASH_BUF];
+
+/*
+ * the signal kfifo of the thread, a handler can not use pthread_getspecific();
+ * busy while a handler writes it, a nested one must not
+ */
+static __thread mlog_thread_local_data_t *mlog_sig_data;
+static __thread int            mlog_sig_busy;
+
+#ifdef MLOG_LATENCY
+static __thread unsigned long  mlog_latency_stamp;
+#endif
+
 
 static void __attribute__((constructor))
 mlog_constructor()
@@ -74,11 +299,13 @@ mlog_constructor()
     MLOG_DEBUG("constructor");
     pthread_key_create(&mlog_pkey, mlog_destroy_pkey);
     async_job.active = 0;
-    async_job.free_count = 0;
-    ngx_queue_init(&async_job.task_list);
-    ngx_queue_init(&async_job.free_list);
-    pthread_mutex_init(&async_job.mutex, NULL);
-    pthread_cond_init(&async_job.cond, NULL);
+    async_job.fd = -1;
+    async_job.next_fd = -1;
+    async_job.wake_fd = -1;
+    async_job.crash_fd = -1;
+    async_job.uring.fd = -1;
+    async_job.waiting = 0;
+    pthread_mutex_init(&async_job.spill_mutex, NULL);
     pthread_mutex_init(&thread_data.mutex, NULL);
 }
 
@@ -88,8 +315,7 @@ mlog_destructor()
 {
     MLOG_DEBUG("destructor");
     pthread_mutex_destroy(&thread_data.mutex);
-    pthread_cond_destroy(&async_job.cond);
-    pthread_mutex_destroy(&async_job.mutex);
+    pthread_mutex_destroy(&async_job.spill_mutex);
     pthread_key_delete(mlog_pkey);
 }
 
@@ -111,412 +337,3712 @@ mlog_get_pid_and_tid(pid_t *pid, pid_t *tid)
 }
 
 
-static int
-mlog_queue_cmp(const ngx_queue_t *a, const ngx_queue_t *b)
+static void
+mlog_wakeup_writer(mlog_thread_local_data_t *data, int urgent)
 {
-    mlog_task_t  *task_a = (mlog_task_t *) a;
-    mlog_task_t  *task_b = (mlog_task_t *) b;
+    int       waiting;
+    uint64_t  one = 1;
 
-    if (task_a->msec > task_b->msec) {
-        return 1;
+    /*
+     * pairs with the writer setting "waiting" before it scans the kfifos,
+     * so only a writer that may be asleep is woken, and only by the first
+     * thread that finds it so; the others see 0 until it sleeps again.
+     * A writer holding a batch only wants to hear about urgent lines.
+     */
 
-    } else if (task_a->msec < task_b->msec) {
-        return -1;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-    } else {
-        return 0;
+    waiting = __atomic_load_n(&async_job.waiting, __ATOMIC_RELAXED);
+
+    if (waiting == 0 || (waiting == MLOG_WAIT_URGENT && !urgent)
+        || !__atomic_exchange_n(&async_job.waiting, 0, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+
+    if (write(async_job.wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        MLOG_ERROR("wake writer failed errno=%d", errno);
     }
+
+    data->counters.wakeups++;
 }
 
 
-int
-mlog_post_log_task(unsigned long msec, unsigned char *buf, unsigned int len)
-{
-    int                          ret;
-    ngx_queue_t                 *q;
-    mlog_task_t                 *task;
-    unsigned int                 wlen, remain_len;
-    mlog_atomic_t                old_refer;
-    mlog_thread_local_data_t    *data;
+/* asks the writer to write what it holds, before the wakeup it checks */
 
-    data = mlog_get_thread_data();
-    if (data == NULL) {
-        return -1;
+static void
+mlog_urge_writer(mlog_thread_local_data_t *data, int what)
+{
+    if ((__atomic_load_n(&async_job.flush, __ATOMIC_RELAXED) & what) != what) {
+        __atomic_or_fetch(&async_job.flush, what, __ATOMIC_SEQ_CST);
     }
 
-    remain_len = thread_data.kfifo_buf_size - kfifo_len(data->kfifo_buf);
-    if (remain_len < len) {
-        MLOG_ERROR("fifo buf not enough, msg_len=%u remain=%u",
-                   len, remain_len);
-        return - 1;
-    }
+    mlog_wakeup_writer(data, 1);
+}
 
-    wlen = kfifo_put(data->kfifo_buf, buf, len);
 
-    old_refer = mlog_increase_refer(data);
+/*
+ * Records are read in place and never wrap. A kfifo that could not be
+ * mirrored only offers the space up to its end; when that is short of a
+ * whole line and there is more at the start, a padding record takes it.
+ */
 
-    MLOG_DEBUG("post task msg_len=%d refer=%lu old_refer=%lu",
-               len, data->refer, old_refer);
+static unsigned char *
+mlog_ring_reserve(mlog_thread_local_data_t *data, unsigned int *len)
+{
+    unsigned int     avail, tail;
+    unsigned char   *p;
+    mlog_record_t   *pad;
+    struct kfifo    *fifo = data->kfifo_buf;
 
-    pthread_mutex_lock(&async_job.mutex);
+    p = kfifo_reserve(fifo, &avail);
 
-    if (ngx_queue_empty(&async_job.free_list)) {
-        task = calloc(1, sizeof(mlog_task_t));
-        if (task == NULL) {
-            MLOG_ERROR("calloc mlog_task_t failed");
-            pthread_mutex_unlock(&async_job.mutex);
-            return -1;
-        }
+    /* out may have moved since, the pad must be all of the tail */
 
-    } else {
-        q = ngx_queue_head(&async_job.free_list);
-        ngx_queue_remove(q);
+    tail = fifo->size - (fifo->in & (fifo->size - 1));
 
-        task = ngx_queue_data(q, mlog_task_t, q);
+    if (!fifo->mirrored && avail == tail
+        && tail < MLOG_RECORD_SIZE(MLOG_MAX_LOG_LEN)
+        && fifo->size - fifo->in + fifo->out > tail)
+    {
+        pad = (mlog_record_t *) p;
+        pad->len = 0;
+        pad->type = MLOG_RECORD_PAD;
 
-        async_job.free_count--;
+        kfifo_commit(fifo, avail);
 
-        MLOG_DEBUG("remove node from free_list count=%d", async_job.free_count);
+        p = kfifo_reserve(fifo, &avail);
     }
 
-    task->msec = msec;
-    task->data = data;
-    task->msg_len = wlen;
+    /* leave room for the header and the alignment of the record */
 
-    ngx_queue_insert_in_ascending_order(&async_job.task_list, &task->q,
-                                        mlog_queue_cmp);
+    avail &= ~(MLOG_RECORD_ALIGN - 1);
 
-    ret = pthread_cond_signal(&async_job.cond);
-    if (ret != 0) {
-        MLOG_ERROR("pthread_cond_signal failed ret=%d", ret);
-    }
+    if (avail < sizeof(mlog_record_t)) {
+        *len = 0;
+
+    } else {
+        *len = avail - sizeof(mlog_record_t);
 
-    pthread_mutex_unlock(&async_job.mutex);
+        if (*len > MLOG_MAX_LOG_LEN) {
+            *len = MLOG_MAX_LOG_LEN;
+        }
+    }
 
-    return 0;
+    return p + sizeof(mlog_record_t);
 }
 
 
-static void *
-mlog_async_write_log(void *arg)
+static void
+mlog_ring_commit(mlog_thread_local_data_t *data, unsigned long msec,
+    int level, int type, unsigned int len)
 {
-    int              ret;
-    ngx_queue_t     *q, tasks;
-    mlog_task_t     *task;
-
-    MLOG_DEBUG("start async job ...");
-
-    for (;;) {
-        ngx_queue_init(&tasks);
+    unsigned int     avail, used;
+    mlog_record_t   *rec;
+    struct kfifo    *fifo = data->kfifo_buf;
 
-        pthread_mutex_lock(&async_job.mutex);
+    rec = (mlog_record_t *) kfifo_reserve(fifo, &avail);
 
-        while (ngx_queue_empty(&async_job.task_list) && async_job.active) {
-            MLOG_DEBUG("pthread_cond_wait");
-            ret = pthread_cond_wait(&async_job.cond, &async_job.mutex);
-            if (ret != 0) {
-                MLOG_ERROR("pthread_cond_wait failed ret=%d", ret);
-            }
-        }
+    rec->msec = msec;
+    rec->len = len;
+    rec->type = type;
+    rec->level = level;
+#ifdef MLOG_LATENCY
+    rec->stamp = mlog_latency_stamp;
+#endif
 
-        MLOG_DEBUG("recv cond signal");
+    kfifo_commit(fifo, MLOG_RECORD_SIZE(len));
 
-        if (!ngx_queue_empty(&async_job.task_list)) {
-            q = ngx_queue_head(&async_job.task_list);
-            ngx_queue_split(&async_job.task_list, q, &tasks);
-        }
+    data->counters.lines[level]++;
+    data->counters.bytes[level] += len;
 
-        pthread_mutex_unlock(&async_job.mutex);
+    used = fifo->in - __atomic_load_n(&fifo->out, __ATOMIC_RELAXED);
+    if (used > data->peak) {
+        data->peak = used;
+    }
 
-        if (!ngx_queue_empty(&tasks)) {
-            mlog_do_write_log(&tasks, async_job.active);
-        }
+    MLOG_DEBUG("commit record msg_len=%u", len);
 
-        if (!async_job.active) {
-            mlog_release_free_list();
-            break;
-        }
-    }
+    /* a writer holding batches must not sit on errors or a filling kfifo */
 
-    if (async_job.fd >= 0) {
-        close(async_job.fd);
-        async_job.fd = -1;
+    if (async_job.flush_nsec
+        && (level <= async_job.flush_level
+            || used > fifo->size / 2))
+    {
+        mlog_urge_writer(data, MLOG_FLUSH_BATCH);
+        return;
     }
 
-    MLOG_DEBUG("exit async job !!!");
+    mlog_wakeup_writer(data, 0);
 }
 
 
-static inline void
-mlog_release_free_list()
+/* moves kfifo->out forward to pos, never back; a producer may move it too */
+
+static void
+mlog_ring_release(struct kfifo *fifo, unsigned int pos)
 {
-    ngx_queue_t    *q, *next;
-    mlog_task_t    *task;
+    unsigned int  out;
 
-    MLOG_DEBUG("recv exit signal");
+    __sync_synchronize();
 
-    pthread_mutex_lock(&async_job.mutex);
+    out = __atomic_load_n(&fifo->out, __ATOMIC_RELAXED);
 
-    for (q = ngx_queue_head(&async_job.free_list);
-         q != ngx_queue_sentinel(&async_job.free_list);
-         q = next)
+    while ((int) (pos - out) > 0
+           && !__atomic_compare_exchange_n(&fifo->out, &out, pos, 1,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
     {
-        next = ngx_queue_next(q);
-        ngx_queue_remove(q);
+        /* void */
+    }
+}
+
 
-        task = ngx_queue_data(q, mlog_task_t, q);
-        free(task);
+/*
+ * MLOG_OVERFLOW_BLOCK: spin while the writer is busy draining, then sleep
+ * on kfifo->out until the writer consumed something. The writer itself
+ * and a logger being shut down would wait forever, they drop instead.
+ */
+
+static unsigned char *
+mlog_ring_wait(mlog_thread_local_data_t *data, unsigned int need,
+    unsigned int *len)
+{
+    unsigned int         i, out;
+    unsigned char       *p;
+    struct kfifo        *fifo = data->kfifo_buf;
+    struct timespec      ts;
 
-        MLOG_DEBUG("release free_list item");
+    if (!async_job.active || pthread_equal(pthread_self(), async_job.tid)) {
+        return NULL;
     }
 
-    async_job.free_count = 0;
+    data->counters.blocked++;
 
-    pthread_mutex_unlock(&async_job.mutex);
-}
+    mlog_urge_writer(data, MLOG_FLUSH_BATCH);
 
+    for (i = 0; async_job.active; i++) {
 
-static inline void
-mlog_try_reuse_and_check_release(ngx_queue_t *free_tasks)
-{
-    ngx_queue_t    *q, *next;
-    mlog_task_t    *task;
+        if (i < MLOG_BLOCK_SPINS) {
+            mlog_cpu_relax();
 
-    pthread_mutex_lock(&async_job.mutex);
+        } else {
+            out = __atomic_load_n(&fifo->out, __ATOMIC_RELAXED);
 
-    for (q = ngx_queue_head(free_tasks);
-         async_job.free_count < MLOG_MAX_FREE_LIST_SIZE
-         && q != ngx_queue_sentinel(free_tasks);
-         q = next)
-    {
-        next = ngx_queue_next(q);
-        ngx_queue_remove(q);
+            /* pairs with the fence in mlog_flush_batch() */
 
-        ngx_queue_insert_tail(&async_job.free_list, q);
-        async_job.free_count++;
+            __atomic_store_n(&data->parked, 1, __ATOMIC_SEQ_CST);
 
-        MLOG_DEBUG("add node to free_list count=%d", async_job.free_count);
-    }
+            p = mlog_ring_reserve(data, len);
 
-    pthread_mutex_unlock(&async_job.mutex);
+            if (*len < need) {
+                mlog_wakeup_writer(data, 1);
 
-    for (q = ngx_queue_head(free_tasks);
-         q != ngx_queue_sentinel(free_tasks);
-         q = next)
-    {
-        next = ngx_queue_next(q);
-        ngx_queue_remove(q);
+                ts.tv_sec = 0;
+                ts.tv_nsec = MLOG_BLOCK_PARK * 1000000;
 
-        task = ngx_queue_data(q, mlog_task_t, q);
-        free(task);
+                syscall(SYS_futex, &fifo->out, FUTEX_WAIT_PRIVATE, out, &ts,
+                        NULL, 0);
+            }
+
+            __atomic_store_n(&data->parked, 0, __ATOMIC_RELAXED);
+        }
 
-        MLOG_DEBUG("release redundant task");
+        p = mlog_ring_reserve(data, len);
+        if (*len >= need) {
+            return p;
+        }
     }
+
+    return NULL;
 }
 
 
-static void
-mlog_do_write_log(ngx_queue_t *task_list, int active)
+/*
+ * MLOG_OVERFLOW_OVERWRITE: claims the oldest records before the writer
+ * does and frees their space. Records the writer claimed, to merge or to
+ * hand to the kernel, can not go, so this only works while it holds none
+ * from this kfifo.
+ */
+
+static unsigned char *
+mlog_ring_overwrite(mlog_thread_local_data_t *data, unsigned int need,
+    unsigned int *len)
 {
-    pid_t                        tid;
-    ssize_t                      wlen;
-    mlog_task_t                 *task;
-    ngx_queue_t                 *q, *next, free_tasks;
-    unsigned int                 len;
-    unsigned char                buf[MLOG_MAX_LOG_LEN];
-    mlog_thread_local_data_t    *data;
+    unsigned int         head, size;
+    unsigned char       *p;
+    mlog_record_t       *rec;
+    struct kfifo        *fifo = data->kfifo_buf;
+
+    for ( ;; ) {
+        head = __atomic_load_n(&data->head, __ATOMIC_ACQUIRE);
+
+        if (head != __atomic_load_n(&fifo->out, __ATOMIC_ACQUIRE)
+            || head == fifo->in)
+        {
+            return NULL;
+        }
 
-    ngx_queue_init(&free_tasks);
+        rec = (mlog_record_t *) kfifo_peek(fifo, head);
+        size = mlog_record_size(fifo, head, rec);
 
-    for (q = ngx_queue_head(task_list);
-         q != ngx_queue_sentinel(task_list);
-         q = next)
-    {
-        next = ngx_queue_next(q);
+        if (!__atomic_compare_exchange_n(&data->head, &head, head + size, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            continue;
+        }
 
-        ngx_queue_remove(q);
-        task = ngx_queue_data(q, mlog_task_t, q);
+        mlog_ring_release(fifo, head + size);
 
-        data = task->data;
+        data->counters.overwritten += rec->type != MLOG_RECORD_PAD;
 
-        tid = data->tid;
+        p = mlog_ring_reserve(data, len);
+        if (*len >= need) {
+            return p;
+        }
+    }
+}
 
-        len = kfifo_get(data->kfifo_buf, buf, task->msg_len);
 
-        wlen = write(async_job.fd, buf, len);
+/* MLOG_OVERFLOW_SPILL: one arena shared by all threads, under a lock */
 
-        MLOG_DEBUG("task tid=%d msg_len=%d wlen=%ld",
-                   tid, task->msg_len, wlen);
+static int
+mlog_ring_spill(mlog_thread_local_data_t *data, unsigned long msec,
+    int level, unsigned char *buf, unsigned int len)
+{
+    unsigned int                 size;
+    unsigned char               *p;
+    mlog_thread_local_data_t    *spill = async_job.spill;
 
-        mlog_decrease_refer_and_try_release(data);
+    pthread_mutex_lock(&async_job.spill_mutex);
 
-        if (active) {
-            ngx_queue_insert_tail(&free_tasks, &task->q);
-        } else {
-            free(task);
-        }
+    p = mlog_ring_reserve(spill, &size);
 
-        if (wlen < 0 || wlen < len) {
-            /* TODO: save data to retry list if write failed */
-            MLOG_ERROR("task tid=%d write log failed len=%d wlen=%ld",
-                       tid, len, wlen);
-            break;
-        }
+    if (size < len) {
+        pthread_mutex_unlock(&async_job.spill_mutex);
+        return -1;
     }
 
-    if (!ngx_queue_empty(&free_tasks)) {
-        mlog_try_reuse_and_check_release(&free_tasks);
-    }
+    memcpy(p, buf, len);
+    mlog_ring_commit(spill, msec, level, MLOG_RECORD_TEXT, len);
+
+    pthread_mutex_unlock(&async_job.spill_mutex);
+
+    data->counters.spilled++;
+
+    return 0;
 }
 
 
-static mlog_thread_local_data_t *
-mlog_get_thread_data()
+/*
+ * Returns 1 if a line of this level must be dropped because the thread's
+ * kfifo is filled above the level's watermark. What lies above the
+ * watermarks of the other levels is kept for ERROR. The watermark is of
+ * the kfifo's own size, kfifo_alloc() rounds buf_size up.
+ */
+
+int
+mlog_shed(int level)
 {
+    unsigned int                 fill;
     mlog_thread_local_data_t    *data;
 
-    data = pthread_getspecific(mlog_pkey);
-    if (data) {
-        return data;
+    if (!async_job.shedding) {
+        return 0;
     }
 
-    data = calloc(1, sizeof(mlog_thread_local_data_t));
+    data = mlog_get_thread_data();
     if (data == NULL) {
-        MLOG_ERROR("calloc mlog_thread_local_data_t failed");
-        return NULL;
+        return 0;
     }
 
-    data->kfifo_buf = kfifo_alloc(thread_data.kfifo_buf_size);
-    if (data->kfifo_buf == NULL) {
-        MLOG_ERROR("kfifo_alloc failed");
-        free(data);
-        return NULL;
+    fill = data->kfifo_buf->in
+           - __atomic_load_n(&data->kfifo_buf->out, __ATOMIC_RELAXED);
+
+    if ((unsigned long) fill * 100
+        <= (unsigned long) data->kfifo_buf->size * async_job.watermark[level])
+    {
+        return 0;
     }
 
-    data->pid = getpid();
-    data->tid = mlog_thread_tid();
+    data->counters.shed++;
 
-    data->hlnk.key = &data->tid;
+    return 1;
+}
 
-    data->refer = 1;
 
-    pthread_setspecific(mlog_pkey, data);
+/*
+ * Queues a line formatted outside the kfifo. If it does not fit, the
+ * overflow policy of its level decides, a line that still does not fit
+ * is only counted: reporting it would load the overloaded path further.
+ */
 
-    pthread_mutex_lock(&thread_data.mutex);
-    hash_join(thread_data.table, &data->hlnk);
-    pthread_mutex_unlock(&thread_data.mutex);
+int
+mlog_post_log_task(unsigned long msec, int level, unsigned char *buf,
+    unsigned int len)
+{
+    unsigned char               *p;
+    unsigned int                 size;
+    mlog_thread_local_data_t    *data;
 
-    MLOG_DEBUG("tid %d refer=%lu", data->tid, data->refer);
+    data = mlog_get_thread_data();
+    if (data == NULL) {
+        return -1;
+    }
 
-    return data;
-}
+    p = mlog_ring_reserve(data, &size);
 
+    if (size < len) {
 
-static inline mlog_atomic_t
-mlog_increase_refer(mlog_thread_local_data_t *data)
-{
-    return __sync_fetch_and_add(&data->refer, 1);
-}
+        switch (async_job.overflow[level]) {
 
-static inline mlog_atomic_t
-mlog_decrease_refer(mlog_thread_local_data_t *data)
-{
-    return __sync_fetch_and_add(&data->refer, -1);
-}
+        case MLOG_OVERFLOW_BLOCK:
+            p = mlog_ring_wait(data, len, &size);
+            break;
 
+        case MLOG_OVERFLOW_OVERWRITE:
+            p = mlog_ring_overwrite(data, len, &size);
+            break;
 
-static void
-mlog_decrease_refer_and_try_release(mlog_thread_local_data_t *data)
-{
-    mlog_atomic_t  old_refer = mlog_decrease_refer(data);
+        case MLOG_OVERFLOW_SPILL:
+            if (mlog_ring_spill(data, msec, level, buf, len) == 0) {
+                return 0;
+            }
 
-    MLOG_DEBUG("tid=%d refer=%lu old_refer=%lu",
-               data->tid, data->refer, old_refer);
+            p = NULL;
+            break;
 
-    if (old_refer == 1) {
-        MLOG_DEBUG("clear thread %d data", data->tid);
-        pthread_mutex_lock(&thread_data.mutex);
-        hash_remove_link(thread_data.table, &data->hlnk);
-        kfifo_free(data->kfifo_buf);
-        free(data);
-        pthread_mutex_unlock(&thread_data.mutex);
+        default:
+            p = NULL;
+        }
+
+        if (p == NULL) {
+            data->counters.dropped++;
+            return -1;
+        }
     }
+
+    memcpy(p, buf, len);
+
+    mlog_ring_commit(data, msec, level, MLOG_RECORD_TEXT, len);
+
+    return 0;
 }
 
 
-/* execute after thread func exit */
-static void
-mlog_destroy_pkey()
+unsigned char *
+mlog_reserve_log_buf(unsigned int *len)
 {
-    pid_t                        tid = mlog_thread_tid();
-    mlog_atomic_t                old_refer;
     mlog_thread_local_data_t    *data;
 
-    if (thread_data.table == NULL) {
-        return;
-    }
-
-    pthread_mutex_lock(&thread_data.mutex);
-
-    data = hash_lookup(thread_data.table, &tid);
+    data = mlog_get_thread_data();
     if (data == NULL) {
-        pthread_mutex_unlock(&thread_data.mutex);
-        return;
+        return NULL;
     }
 
-    old_refer = mlog_decrease_refer(data);
+    return mlog_ring_reserve(data, len);
+}
 
-    MLOG_DEBUG("tid %d refer=%lu old_refer=%lu",
-               data->tid, data->refer, old_refer);
 
-    if (old_refer == 1) {
-        MLOG_DEBUG("clear thread %d data", data->tid);
-        hash_remove_link(thread_data.table, &data->hlnk);
-        kfifo_free(data->kfifo_buf);
-        free(data);
+int
+mlog_commit_log_buf(unsigned long msec, int level, int type, unsigned int len)
+{
+    mlog_thread_local_data_t    *data;
+
+    data = mlog_get_thread_data();
+    if (data == NULL) {
+        return -1;
     }
 
-    pthread_mutex_unlock(&thread_data.mutex);
+    mlog_ring_commit(data, msec, level, type, len);
+
+    return 0;
 }
 
 
-static unsigned int
-mlog_tid_hash(const void *key, unsigned int size)
+/*
+ * From a signal handler: captures the arguments as MLOG_FORMAT_DEFERRED
+ * does into the thread's signal kfifo, which only handlers write. A line
+ * that can not be captured or does not fit is dropped, as is one of a
+ * handler interrupting another in this thread. Nothing here locks or
+ * allocates, the clock is the vDSO's.
+ */
+
+int
+mlog_inner_sig_log(const mlog_site_t *desc, const char *fmt, va_list args)
 {
-    pid_t  tid = *(pid_t *) key;
+    int                          len, ret = -1, err = errno;
+    unsigned int                 size;
+    unsigned char               *p;
+    struct timespec              ts;
+    mlog_fmt_site_t             *site;
+    mlog_thread_local_data_t    *data;
+#ifdef MLOG_LATENCY
+    unsigned long                stamp = mlog_latency_stamp;
+#endif
 
-    return tid % size;
-}
+    data = __atomic_load_n(&mlog_sig_data, __ATOMIC_RELAXED);
+    if (data == NULL) {
+        return -1;
+    }
 
+    if (__atomic_exchange_n(&mlog_sig_busy, 1, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&data->counters.dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
 
-static int
-mlog_tid_hash_cmp(const void *a, const void *b)
-{
-    pid_t  tid_a = *(pid_t *) a;
-    pid_t  tid_b = *(pid_t *) b;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+#ifdef MLOG_LATENCY
+    (void) mlog_latency_begin();
+#endif
+
+    p = mlog_ring_reserve(data, &size);
+
+    if (size >= sizeof(mlog_fmt_site_t)) {
+        len = mlog_fmt_capture(p + sizeof(mlog_fmt_site_t),
+                               size - sizeof(mlog_fmt_site_t), fmt, args);
+
+        if (len >= 0) {
+            site = (mlog_fmt_site_t *) p;
+            site->fmt = fmt;
+            site->desc = desc;
+
+            mlog_time_now(&ts);
+
+            mlog_ring_commit(data, ts.tv_sec * 1000 + ts.tv_nsec / 1000000,
+                             desc->level, MLOG_RECORD_DEFERRED,
+                             sizeof(mlog_fmt_site_t) + len);
+            ret = 0;
+        }
+    }
+
+    if (ret != 0) {
+        __atomic_add_fetch(&data->counters.dropped, 1, __ATOMIC_RELAXED);
+    }
+
+#ifdef MLOG_LATENCY
+    mlog_latency_stamp = stamp;
+#endif
+
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    __atomic_store_n(&mlog_sig_busy, 0, __ATOMIC_RELAXED);
+
+    errno = err;
+
+    return ret;
+}
+
+
+/* creates the kfifos of the thread before a handler needs them */
+
+int
+mlog_inner_sig_register()
+{
+    if (mlog_get_thread_data() == NULL || mlog_sig_data == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* sleeps on kfifo->out until the writer released everything before pos */
+
+static int
+mlog_ring_flushed(mlog_thread_local_data_t *data, unsigned int pos)
+{
+    unsigned int      out;
+    struct kfifo     *fifo = data->kfifo_buf;
+    struct timespec   ts;
+
+    for ( ;; ) {
+        out = __atomic_load_n(&fifo->out, __ATOMIC_ACQUIRE);
+
+        if ((int) (out - pos) >= 0) {
+            return 0;
+        }
+
+        if (!async_job.active) {
+            return -1;
+        }
+
+        /* pairs with the fence in mlog_flush_batch() */
+
+        __atomic_store_n(&data->parked, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&fifo->out, __ATOMIC_RELAXED) == out) {
+            ts.tv_sec = 0;
+            ts.tv_nsec = MLOG_BLOCK_PARK * 1000000;
+
+            syscall(SYS_futex, &fifo->out, FUTEX_WAIT_PRIVATE, out, &ts,
+                    NULL, 0);
+        }
+
+        __atomic_store_n(&data->parked, 0, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * MLOG_IO_URING gives the kfifos back once a batch is queued, the write
+ * of the batch may still be in flight then: waits until "done" passes
+ * what was queued.
+ */
+
+static int
+mlog_uring_flushed(mlog_thread_local_data_t *data)
+{
+    unsigned int      sent, done;
+    struct timespec   ts;
+
+    if (async_job.uring.fd < 0) {
+        return 0;
+    }
+
+    sent = __atomic_load_n(&async_job.uring.sent, __ATOMIC_ACQUIRE);
+
+    for ( ;; ) {
+        done = __atomic_load_n(&async_job.uring.done, __ATOMIC_ACQUIRE);
+
+        if ((int) (done - sent) >= 0) {
+            return 0;
+        }
+
+        if (!async_job.active) {
+            return -1;
+        }
+
+        /* the writer only waits for completions when asked to */
+
+        mlog_urge_writer(data, MLOG_FLUSH_ALL);
+
+        ts.tv_sec = 0;
+        ts.tv_nsec = MLOG_BLOCK_PARK * 1000000;
+
+        syscall(SYS_futex, &async_job.uring.done, FUTEX_WAIT_PRIVATE, done,
+                &ts, NULL, 0);
+    }
+}
+
+
+/*
+ * Waits until the writer wrote all lines this thread queued so far, the
+ * ones it spilled too. The kfifo positions are the watermark: once out
+ * passed the in of the call, the lines before are in the file.
+ */
+
+int
+mlog_inner_flush()
+{
+    unsigned int                 in, spill_in = 0;
+    mlog_thread_local_data_t    *data;
+
+    if (async_job.wake_fd < 0 || pthread_equal(pthread_self(), async_job.tid))
+    {
+        return -1;
+    }
+
+    data = pthread_getspecific(mlog_pkey);
+    if (data == NULL) {
+        return 0;
+    }
+
+    in = __atomic_load_n(&data->kfifo_buf->in, __ATOMIC_RELAXED);
+
+    if (data->counters.spilled) {
+        spill_in = __atomic_load_n(&async_job.spill->kfifo_buf->in,
+                                   __ATOMIC_ACQUIRE);
+    }
+
+    mlog_urge_writer(data, MLOG_FLUSH_ALL);
+
+    if (mlog_ring_flushed(data, in) != 0) {
+        return -1;
+    }
+
+    if (data->counters.spilled
+        && mlog_ring_flushed(async_job.spill, spill_in) != 0)
+    {
+        return -1;
+    }
+
+    return mlog_uring_flushed(data);
+}
+
+
+static ssize_t
+mlog_writev_full(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t  n, wlen = 0;
+
+    while (cnt > 0) {
+        n = writev(fd, iov, cnt > IOV_MAX ? IOV_MAX : cnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return wlen > 0 ? wlen : -1;
+        }
+
+        wlen += n;
+
+        /* skip what the kernel took, then retry the rest */
+
+        while (cnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+
+        if (cnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return wlen;
+}
+
+
+static inline unsigned long
+mlog_mono_nsec()
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+
+#ifdef MLOG_LATENCY
+
+
+unsigned long
+mlog_latency_begin()
+{
+    mlog_latency_stamp = mlog_mono_nsec();
+
+    return mlog_latency_stamp;
+}
+
+
+void
+mlog_latency_end(unsigned long start)
+{
+    mlog_thread_local_data_t    *data;
+
+    data = pthread_getspecific(mlog_pkey);
+    if (data) {
+        mlog_hist_add(&data->producer, mlog_mono_nsec() - start);
+    }
+}
+
+
+/* the batch just left write(), one clock read for all of its records */
+
+static void
+mlog_latency_written()
+{
+    unsigned int   i;
+    unsigned long  now;
+
+    now = mlog_mono_nsec();
+
+    for (i = 0; i < async_job.iov_count; i++) {
+        mlog_hist_add(&async_job.queue, now - async_job.stamps[i]);
+    }
+}
+
+#endif
+
+
+/*
+ * MLOG_IO_MMAP maps the file, which takes O_RDWR; MLOG_IO_URING writes
+ * at offsets of its own, which O_APPEND would ignore
+ */
+
+static int
+mlog_open_file(const char *path, int flags)
+{
+    flags |= async_job.io == MLOG_IO_MMAP ? O_RDWR : O_WRONLY;
+    flags |= async_job.io == MLOG_IO_URING ? 0 : O_APPEND;
+
+    return open(path, flags|O_CREAT, 0644);
+}
+
+
+static ssize_t
+mlog_pwrite_full(int fd, const struct iovec *iov, int cnt, off_t off)
+{
+    int      i;
+    size_t   done;
+    ssize_t  n, wlen = 0;
+
+    for (i = 0; i < cnt; i++) {
+        for (done = 0; done < iov[i].iov_len; done += n) {
+            n = pwrite(fd, (char *) iov[i].iov_base + done,
+                       iov[i].iov_len - done, off + wlen);
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+
+            if (n <= 0) {
+                return wlen > 0 ? wlen : -1;
+            }
+
+            wlen += n;
+        }
+    }
+
+    return wlen;
+}
+
+
+/*
+ * MLOG_IO_URING: takes the completions, waits for them as asked. The
+ * writes that failed are counted here, and mlog_flush() callers are woken
+ * once nothing is in flight.
+ */
+
+static void
+mlog_uring_settle(int wait)
+{
+    mlog_uring_t  *ur = &async_job.uring;
+
+    if (ur->fd < 0) {
+        return;
+    }
+
+    mlog_uring_reap(ur, wait);
+
+    if (ur->errors) {
+        MLOG_ERROR("io_uring writes failed count=%u", ur->errors);
+        async_job.write_errors += ur->errors;
+        ur->errors = 0;
+    }
+
+    if (wait == MLOG_URING_ALL) {
+        syscall(SYS_futex, &ur->done, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+                NULL, 0);
+    }
+}
+
+
+/*
+ * MLOG_IO_URING: copies the batch into a free registered buffer and
+ * queues its write at the end of the file, so the kfifos are given back
+ * at once and the writer goes on while the kernel writes. Errors show up
+ * with the completion, the bytes are taken as written here.
+ */
+
+static ssize_t
+mlog_uring_batch(const struct iovec *iov, int cnt, size_t bytes)
+{
+    int             i;
+    unsigned int    id;
+    unsigned char  *buf, *p;
+
+    mlog_uring_settle(MLOG_URING_NOWAIT);
+
+    if (bytes > async_job.uring.buf_size) {
+        mlog_uring_settle(MLOG_URING_ALL);
+        return mlog_pwrite_full(async_job.fd, iov, cnt, async_job.file_bytes);
+    }
+
+    buf = mlog_uring_get(&async_job.uring, &id);
+
+    for (p = buf, i = 0; i < cnt; i++) {
+        p = mempcpy(p, iov[i].iov_base, iov[i].iov_len);
+    }
+
+    if (mlog_uring_write(&async_job.uring, id, async_job.fd,
+                         async_job.file_bytes, bytes) != 0)
+    {
+        return -1;
+    }
+
+    return bytes;
+}
+
+
+/*
+ * MLOG_IO_MMAP: the next window starts at the page of the end of the
+ * file. fallocate() extends the file over it first: a store past the
+ * end would be SIGBUS, and a full disk is better told here.
+ */
+
+static int
+mlog_mmap_window(unsigned long end)
+{
+    int             ret;
+    off_t           off;
+    unsigned char  *map;
+
+    if (async_job.map) {
+        munmap(async_job.map, async_job.map_size);
+        async_job.map = NULL;
+    }
+
+    off = end & ~((unsigned long) getpagesize() - 1);
+
+    ret = fallocate(async_job.fd, 0, off, async_job.map_size);
+
+    if (ret != 0 && errno == EOPNOTSUPP) {
+        ret = ftruncate(async_job.fd, off + async_job.map_size);
+    }
+
+    if (ret != 0) {
+        MLOG_ERROR("extend file %s failed errno=%d", async_job.filename, errno);
+        return -1;
+    }
+
+    map = mmap(NULL, async_job.map_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+               async_job.fd, off);
+    if (map == MAP_FAILED) {
+        MLOG_ERROR("mmap file %s failed errno=%d", async_job.filename, errno);
+        return -1;
+    }
+
+    async_job.map = map;
+    async_job.map_off = off;
+
+    return 0;
+}
+
+
+/* the lines are in the page cache once copied, a crash does not lose them */
+
+static ssize_t
+mlog_mmap_write(const struct iovec *iov, int cnt)
+{
+    int              i;
+    size_t           n, len, pos, done = 0;
+    unsigned char   *p;
+
+    for (i = 0; i < cnt; i++) {
+        p = iov[i].iov_base;
+        len = iov[i].iov_len;
+
+        while (len) {
+            pos = async_job.file_bytes + done - async_job.map_off;
+
+            if (async_job.map == NULL || pos >= async_job.map_size) {
+                if (mlog_mmap_window(async_job.file_bytes + done) != 0) {
+                    return done ? (ssize_t) done : -1;
+                }
+
+                pos = async_job.file_bytes + done - async_job.map_off;
+            }
+
+            n = async_job.map_size - pos;
+            if (n > len) {
+                n = len;
+            }
+
+            memcpy(async_job.map + pos, p, n);
+
+            p += n;
+            len -= n;
+            done += n;
+        }
+    }
+
+    return done;
+}
+
+
+/* drops the window and the part of it past the lines */
+
+static void
+mlog_mmap_close()
+{
+    if (async_job.map == NULL) {
+        return;
+    }
+
+    munmap(async_job.map, async_job.map_size);
+    async_job.map = NULL;
+
+    if (ftruncate(async_job.fd, async_job.file_bytes) != 0) {
+        MLOG_ERROR("ftruncate %s failed errno=%d", async_job.filename, errno);
+    }
+}
+
+
+/*
+ * A process that died in MLOG_IO_MMAP left zeros after its last line, up
+ * to the end of its window. Only text can tell them from the lines.
+ */
+
+static off_t
+mlog_mmap_trim(int fd, off_t size)
+{
+    char     buf[4096];
+    off_t    pos, stop;
+    ssize_t  n;
+
+    stop = size > (off_t) async_job.map_size ? size - async_job.map_size : 0;
+
+    for (pos = size; pos > stop; pos -= n) {
+        n = pos - stop < (off_t) sizeof(buf) ? pos - stop : (off_t) sizeof(buf);
+
+        if (pread(fd, buf, n, pos - n) != n) {
+            return size;
+        }
+
+        while (n > 0 && buf[n - 1] == '\0') {
+            n--;
+            pos--;
+        }
+
+        if (n > 0) {
+            return pos;
+        }
+
+        n = 0;
+    }
+
+    return pos;
+}
+
+
+/* the file rotation switches to, its blocks allocated up front */
+
+static void
+mlog_prepare_next()
+{
+    int  fd;
+
+    fd = mlog_open_file(async_job.next_path, O_TRUNC);
+    if (fd < 0) {
+        MLOG_ERROR("open file %s failed errno=%d", async_job.next_path, errno);
+        return;
+    }
+
+    if (async_job.rotate_size
+        && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, async_job.rotate_size) != 0
+        && errno != EOPNOTSUPP)
+    {
+        MLOG_ERROR("fallocate %s failed errno=%d", async_job.next_path, errno);
+    }
+
+    async_job.next_fd = fd;
+}
+
+
+/* a new file under async_job.fd, binary output starts it with a header */
+
+static void
+mlog_switch_file(int fd)
+{
+    off_t  size;
+
+    if (async_job.fd >= 0 && async_job.fd != fd) {
+        mlog_uring_settle(MLOG_URING_ALL);
+        mlog_mmap_close();
+        close(async_job.fd);
+    }
+
+    async_job.fd = fd;
+
+    size = lseek(fd, 0, SEEK_END);
+
+    if (size > 0 && async_job.io == MLOG_IO_MMAP
+        && async_job.output == MLOG_OUTPUT_TEXT
+        && async_job.compress == MLOG_COMPRESS_NONE)
+    {
+        size = mlog_mmap_trim(fd, size);
+    }
+
+    async_job.file_bytes = size > 0 ? size : 0;
+
+    if (async_job.output == MLOG_OUTPUT_BINARY) {
+        mlog_bin_dict_reset(&async_job.bin);
+    }
+}
+
+
+static int
+mlog_rotate_due()
+{
+    struct timespec  ts;
+
+    if (async_job.rotate_size && async_job.file_bytes >= async_job.rotate_size)
+    {
+        return 1;
+    }
+
+    if (async_job.rotate_interval == 0) {
+        return 0;
+    }
+
+    mlog_time_now(&ts);
+
+    return (unsigned long) ts.tv_sec >= async_job.rotate_sec;
+}
+
+
+/*
+ * filename.N-1 becomes .N and so on down to filename becoming .1, which
+ * drops the oldest; then the prepared file takes the name. Only renames
+ * and an fd swap, between two batches.
+ */
+
+static void
+mlog_rotate()
+{
+    unsigned int     i;
+    char             from[PATH_MAX], to[PATH_MAX];
+    struct timespec  ts;
+
+    if (async_job.rotate_interval) {
+        mlog_time_now(&ts);
+        async_job.rotate_sec = (ts.tv_sec / async_job.rotate_interval + 1)
+                               * async_job.rotate_interval;
+    }
+
+    if (async_job.next_fd < 0) {
+        mlog_prepare_next();
+
+        if (async_job.next_fd < 0) {
+            return;
+        }
+    }
+
+    for (i = async_job.rotate_keep; i > 1; i--) {
+        snprintf(from, sizeof(from), "%s.%u", async_job.filename, i - 1);
+        snprintf(to, sizeof(to), "%s.%u", async_job.filename, i);
+
+        if (rename(from, to) != 0 && errno != ENOENT) {
+            MLOG_ERROR("rename %s failed errno=%d", from, errno);
+        }
+    }
+
+    snprintf(to, sizeof(to), "%s.1", async_job.filename);
+
+    if (rename(async_job.filename, to) != 0 && errno != ENOENT) {
+        MLOG_ERROR("rename %s failed errno=%d", async_job.filename, errno);
+    }
+
+    if (rename(async_job.next_path, async_job.filename) != 0) {
+        MLOG_ERROR("rename %s failed errno=%d", async_job.next_path, errno);
+        return;
+    }
+
+    /* hands back what was preallocated past the end */
+
+    mlog_uring_settle(MLOG_URING_ALL);
+
+    if (ftruncate(async_job.fd, async_job.file_bytes) != 0) {
+        MLOG_ERROR("ftruncate %s failed errno=%d", to, errno);
+    }
+
+    mlog_switch_file(async_job.next_fd);
+    async_job.next_fd = -1;
+
+    MLOG_DEBUG("rotated %s", async_job.filename);
+
+    mlog_prepare_next();
+}
+
+
+/* after mlog_reopen(), e.g. once logrotate moved the file away */
+
+static void
+mlog_reopen_file()
+{
+    int           fd;
+    unsigned int  i;
+
+    for (i = 0; i < async_job.nsinks; i++) {
+        mlog_sink_reopen(&async_job.sinks[i]);
+    }
+
+    fd = mlog_open_file(async_job.filename, 0);
+    if (fd < 0) {
+        MLOG_ERROR("reopen file %s failed errno=%d", async_job.filename, errno);
+        return;
+    }
+
+    mlog_switch_file(fd);
+}
+
+
+/* gives back what the writer read of a kfifo up to rpos */
+
+static void
+mlog_ring_written(mlog_thread_local_data_t *data)
+{
+    struct kfifo  *fifo = data->kfifo_buf;
+
+    if (data->rpos == fifo->out) {
+        return;
+    }
+
+    mlog_ring_release(fifo, data->rpos);
+
+    /* pairs with the owner setting "parked" in mlog_ring_wait() */
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&data->parked, __ATOMIC_RELAXED)) {
+        syscall(SYS_futex, &fifo->out, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+                NULL, 0);
+    }
+}
+
+
+static void
+mlog_flush_batch()
+{
+    int                          cnt;
+    size_t                       bytes;
+    ssize_t                      wlen;
+    unsigned int                 i;
+    struct iovec                *iov;
+#ifdef MLOG_WITH_ZLIB
+    struct iovec                 member;
+#endif
+
+    if (async_job.iov_count == 0) {
+        return;
+    }
+
+    iov = async_job.iov;
+    cnt = async_job.iov_count;
+    bytes = async_job.iov_bytes;
+
+    /* a copy for each sink, they write it out on their own */
+
+    for (i = 0; i < async_job.nsinks; i++) {
+        mlog_sink_put(&async_job.sinks[i], iov, async_job.levels, cnt);
+    }
+
+#ifdef MLOG_WITH_ZLIB
+
+    /* the whole batch goes out as one member instead */
+
+    if (async_job.compress == MLOG_COMPRESS_GZIP) {
+        wlen = mlog_gz_member(&async_job.gz, iov, cnt);
+        if (wlen < 0) {
+            MLOG_ERROR("compress batch count=%d len=%zu failed", cnt, bytes);
+        }
+
+        member.iov_base = async_job.gz.buf;
+        member.iov_len = wlen > 0 ? wlen : 0;
+
+        iov = &member;
+        cnt = wlen > 0;
+        bytes = member.iov_len;
+    }
+
+#endif
+
+    if (cnt == 0) {
+        wlen = -1;
+
+    } else if (async_job.io == MLOG_IO_MMAP) {
+        wlen = mlog_mmap_write(iov, cnt);
+
+    } else if (async_job.io == MLOG_IO_URING) {
+        wlen = mlog_uring_batch(iov, cnt, bytes);
+
+    } else {
+        wlen = mlog_writev_full(async_job.fd, iov, cnt);
+    }
+
+    /* io_uring links its own fsync to the write */
+
+    if (async_job.batch_fsync && wlen > 0 && async_job.io != MLOG_IO_URING
+        && fdatasync(async_job.fd) != 0)
+    {
+        MLOG_ERROR("fdatasync %s failed errno=%d", async_job.filename, errno);
+        async_job.write_errors++;
+    }
+
+    MLOG_DEBUG("flush batch count=%u len=%u wlen=%ld",
+               async_job.iov_count, async_job.iov_bytes, wlen);
+
+#ifdef MLOG_LATENCY
+    mlog_latency_written();
+#endif
+
+    async_job.batches++;
+    async_job.batched_lines += async_job.iov_count;
+    async_job.batched_bytes += async_job.iov_bytes;
+
+    if (wlen > 0) {
+        async_job.file_bytes += wlen;
+    }
+
+    if (wlen < 0 || (size_t) wlen < bytes) {
+        async_job.write_errors++;
+
+        /* TODO: save data to retry list if write failed */
+        MLOG_ERROR("write log batch failed count=%u len=%zu wlen=%ld errno=%d",
+                   async_job.iov_count, bytes, wlen, errno);
+    }
+
+    /* the kernel is done with the ring memory, give it back */
+
+    for (i = 0; i < async_job.nrings; i++) {
+        mlog_ring_written(async_job.rings[i]);
+    }
+
+    async_job.iov_count = 0;
+    async_job.iov_bytes = 0;
+    async_job.fmt_used = 0;
+    async_job.urgent = 0;
+
+    /* the batch is out and the binary dictionary may start over */
+
+    if ((async_job.rotate_size || async_job.rotate_interval)
+        && mlog_rotate_due())
+    {
+        mlog_rotate();
+    }
+}
+
+
+/* when the batch began and whether it has a line that must not wait */
+
+static inline void
+mlog_batch_note(mlog_record_t *rec)
+{
+    if (async_job.iov_count == 0 && async_job.flush_nsec) {
+        async_job.batch_nsec = mlog_mono_nsec();
+    }
+
+    if (rec->level <= async_job.flush_level) {
+        async_job.urgent = 1;
+    }
+
+    if (async_job.nsinks) {
+        async_job.levels[async_job.iov_count] = rec->level;
+    }
+}
+
+
+/*
+ * With flush_usec the writer holds a batch until it has flush_bytes, turns
+ * flush_usec old or takes a line of flush_level. Returns the nsec left to
+ * hold it, 0 to write it now.
+ */
+
+static unsigned long
+mlog_batch_hold(int flush)
+{
+    unsigned long  age;
+
+    if (async_job.flush_nsec == 0 || async_job.iov_count == 0 || flush
+        || async_job.urgent || !async_job.active
+        || async_job.iov_bytes >= async_job.flush_bytes)
+    {
+        return 0;
+    }
+
+    age = mlog_mono_nsec() - async_job.batch_nsec;
+
+    return age < async_job.flush_nsec ? async_job.flush_nsec - age : 0;
+}
+
+
+/*
+ * With MLOG_OVERFLOW_OVERWRITE the record is claimed from producers before
+ * anything reads its msec, so one in the merge heap stays put. The len
+ * read ahead of the CAS only counts if the CAS finds head unmoved; if a
+ * producer was faster, its records are skipped. Padding records are
+ * stepped over.
+ */
+
+static inline mlog_record_t *
+mlog_ring_head(mlog_thread_local_data_t *data)
+{
+    unsigned int     pos, size;
+    mlog_record_t   *rec;
+
+    for ( ;; ) {
+        if ((int) (data->end - data->rpos) <= 0) {
+            return NULL;
+        }
+
+        pos = data->rpos;
+        rec = (mlog_record_t *) kfifo_peek(data->kfifo_buf, pos);
+        size = mlog_record_size(data->kfifo_buf, pos, rec);
+
+        if (async_job.overwrite && (int) (data->claim - pos) <= 0) {
+
+            if (!__atomic_compare_exchange_n(&data->head, &pos, pos + size, 0,
+                                             __ATOMIC_SEQ_CST,
+                                             __ATOMIC_ACQUIRE))
+            {
+                data->rpos = pos;
+                continue;
+            }
+
+            data->claim = pos + size;
+        }
+
+        if (rec->type != MLOG_RECORD_PAD) {
+            return rec;
+        }
+
+        data->rpos += size;
+
+        /* with nothing held before it, a batch may never come to free it */
+
+        if (pos == __atomic_load_n(&data->kfifo_buf->out, __ATOMIC_RELAXED)) {
+            mlog_ring_written(data);
+        }
+    }
+}
+
+
+/* format a deferred record into the writer's own buffer */
+
+static unsigned int
+mlog_render_record(mlog_thread_local_data_t *data, mlog_record_t *rec,
+    char *buf)
+{
+    int                  len;
+    char                *p, *last;
+    mlog_fmt_site_t     *site;
+
+    site = (mlog_fmt_site_t *) ((unsigned char *) rec + sizeof(mlog_record_t));
+
+    p = buf;
+    last = buf + MLOG_MAX_LOG_LEN - 1;      /* keep room for the '\n' */
+
+    len = mlog_fmt_prefix(p, last - p, &async_job.tcache, rec->msec / 1000,
+                          rec->level, data->pid, data->tid, site->desc->func,
+                          site->desc->line);
+    if (len > 0) {
+        p += len;
+        p += mlog_fmt_render(p, last - p, site->fmt,
+                             (unsigned char *) site + sizeof(mlog_fmt_site_t),
+                             rec->len - sizeof(mlog_fmt_site_t));
+    }
+
+    *p++ = '\n';
+
+    return p - buf;
+}
+
+
+/* mlog_render_record() for a crash handler, see mlog_fmt_render_sigsafe() */
+
+static unsigned int
+mlog_crash_render(mlog_thread_local_data_t *data, mlog_record_t *rec,
+    char *buf)
+{
+    int                  len;
+    char                *p, *last;
+    mlog_fmt_site_t     *site;
+
+    site = (mlog_fmt_site_t *) ((unsigned char *) rec + sizeof(mlog_record_t));
+
+    p = buf;
+    last = buf + MLOG_MAX_LOG_LEN - 1;      /* keep room for the '\n' */
+
+    len = mlog_fmt_prefix_sigsafe(p, last - p,
+                                  __atomic_load_n(&async_job.crash_gmtoff,
+                                                  __ATOMIC_RELAXED),
+                                  rec->msec / 1000, rec->level, data->pid,
+                                  data->tid, site->desc->func,
+                                  site->desc->line);
+    if (len > 0) {
+        p += len;
+        p += mlog_fmt_render_sigsafe(p, last - p, site->fmt,
+                                     (unsigned char *) site
+                                     + sizeof(mlog_fmt_site_t),
+                                     rec->len - sizeof(mlog_fmt_site_t));
+    }
+
+    *p++ = '\n';
+
+    return p - buf;
+}
+
+
+/* encode the record into the writer's buffer, dictionary entries first */
+
+static void
+mlog_emit_binary(mlog_thread_local_data_t *data, mlog_record_t *rec)
+{
+    int                  ret, len;
+    char                 line[MLOG_MAX_LOG_LEN];
+    unsigned int         id, need;
+    unsigned char       *p, *start, *last, *args;
+    const char          *text = NULL;
+    struct iovec        *iov;
+    mlog_fmt_site_t     *site = NULL;
+    mlog_bin_dict_t     *dict = &async_job.bin;
+
+    len = rec->len;
+    need = 0;
+
+    if (rec->type == MLOG_RECORD_DEFERRED) {
+        site = (mlog_fmt_site_t *) ((unsigned char *) rec
+                                    + sizeof(mlog_record_t));
+
+        /* a slot grows by 2 bytes at most, a string by 2 plus its bytes */
+
+        need = MLOG_BIN_MAGIC_LEN + 2 * MLOG_BIN_HEAD_LEN
+               + mlog_bin_site_len(site) + len + len / 4;
+
+        if (need > async_job.batch_bytes) {
+            len = mlog_render_record(data, rec, line);
+            site = NULL;
+        }
+
+    } else {
+        text = (char *) rec + sizeof(mlog_record_t);
+    }
+
+    if (site == NULL) {
+        need = MLOG_BIN_MAGIC_LEN + 2 * MLOG_BIN_HEAD_LEN + len;
+        text = text ? text : line;
+    }
+
+    if (async_job.iov_count == async_job.batch_count
+        || async_job.batch_bytes - async_job.fmt_used < need)
+    {
+        mlog_flush_batch();
+    }
+
+    data->rpos += MLOG_RECORD_SIZE(rec->len);
+
+    start = (unsigned char *) async_job.fmt_buf + async_job.fmt_used;
+    last = start + need;
+    p = start;
+
+    if (dict->header) {
+        memcpy(p, MLOG_BIN_MAGIC, MLOG_BIN_MAGIC_LEN);
+        p += MLOG_BIN_MAGIC_LEN;
+        dict->header = 0;
+    }
+
+    if (data->bin_gen != dict->gen) {
+        data->bin_gen = dict->gen;
+        data->bin_id = dict->nthreads++;
+
+        *p++ = MLOG_BIN_THREAD;
+        p = mlog_bin_put_varint(p, data->bin_id);
+        p = mlog_bin_put_varint(p, data->pid);
+        p = mlog_bin_put_varint(p, data->tid);
+    }
+
+    if (site) {
+        ret = mlog_bin_intern(dict, site, &id);
+        if (ret < 0) {
+            MLOG_ERROR("intern call site %s#%ld failed", site->desc->func,
+                       site->desc->line);
+            goto done;
+        }
+
+        if (ret == 1) {
+            p = mlog_bin_put_site(p, id, site);
+        }
+
+        args = mlog_bin_put_head(p, MLOG_BIN_RECORD, rec->level,
+                                 rec->msec - dict->last_msec, data->bin_id,
+                                 id);
+
+        ret = mlog_bin_encode_args(args, last - args, site->fmt,
+                                   (unsigned char *) site
+                                   + sizeof(mlog_fmt_site_t),
+                                   rec->len - sizeof(mlog_fmt_site_t));
+        if (ret < 0) {
+            /* keep the entries written so far, they are in the dictionary */
+            MLOG_ERROR("encode record of %s#%ld failed", site->desc->func,
+                       site->desc->line);
+            goto done;
+        }
+
+        p = args + ret;
+
+    } else {
+        p = mlog_bin_put_head(p, MLOG_BIN_TEXT, rec->level,
+                              rec->msec - dict->last_msec, data->bin_id, len);
+        memcpy(p, text, len);
+        p += len;
+    }
+
+    dict->last_msec = rec->msec;
+
+done:
+
+    if (p == start) {
+        return;
+    }
+
+    mlog_batch_note(rec);
+
+#ifdef MLOG_LATENCY
+    async_job.stamps[async_job.iov_count] = rec->stamp;
+#endif
+
+    iov = &async_job.iov[async_job.iov_count++];
+    iov->iov_base = start;
+    iov->iov_len = p - start;
+
+    async_job.fmt_used += iov->iov_len;
+    async_job.iov_bytes += iov->iov_len;
+}
+
+
+/* hand the ring memory itself to the kernel */
+
+static void
+mlog_emit_record(mlog_thread_local_data_t *data, mlog_record_t *rec)
+{
+    unsigned int   len;
+    struct iovec  *iov;
+
+    if (async_job.output == MLOG_OUTPUT_BINARY) {
+        mlog_emit_binary(data, rec);
+        return;
+    }
+
+    len = rec->len;
+
+    if (rec->type == MLOG_RECORD_DEFERRED) {
+        len = MLOG_MAX_LOG_LEN;
+    }
+
+    if (async_job.iov_count == async_job.batch_count
+        || async_job.batch_bytes - async_job.iov_bytes < len
+        || (rec->type == MLOG_RECORD_DEFERRED
+            && async_job.batch_bytes - async_job.fmt_used < len))
+    {
+        mlog_flush_batch();
+    }
+
+    mlog_batch_note(rec);
+
+#ifdef MLOG_LATENCY
+    async_job.stamps[async_job.iov_count] = rec->stamp;
+#endif
+
+    iov = &async_job.iov[async_job.iov_count++];
+
+    if (rec->type == MLOG_RECORD_DEFERRED) {
+        iov->iov_base = async_job.fmt_buf + async_job.fmt_used;
+        iov->iov_len = mlog_render_record(data, rec, iov->iov_base);
+        async_job.fmt_used += iov->iov_len;
+
+    } else {
+        iov->iov_base = (unsigned char *) rec + sizeof(mlog_record_t);
+        iov->iov_len = rec->len;
+    }
+
+    async_job.iov_bytes += iov->iov_len;
+
+    data->rpos += MLOG_RECORD_SIZE(rec->len);
+
+    MLOG_DEBUG("record tid=%d msg_len=%u", data->tid, rec->len);
+}
+
+
+/* in the msec a new run began in, a crashed run's lines go first */
+
+static inline int
+mlog_heap_less(mlog_thread_local_data_t *a, mlog_thread_local_data_t *b)
+{
+    unsigned long  ma, mb;
+
+    ma = mlog_ring_head(a)->msec;
+    mb = mlog_ring_head(b)->msec;
+
+    return ma < mb || (ma == mb && a->recovered > b->recovered);
+}
+
+
+static void
+mlog_heap_sift_down(unsigned int i)
+{
+    unsigned int                  l, min;
+    mlog_thread_local_data_t    **heap = async_job.heap, *tmp;
+
+    for ( ;; ) {
+        l = 2 * i + 1;
+        min = i;
+
+        if (l < async_job.nheap && mlog_heap_less(heap[l], heap[min])) {
+            min = l;
+        }
+
+        if (l + 1 < async_job.nheap && mlog_heap_less(heap[l + 1], heap[min]))
+        {
+            min = l + 1;
+        }
+
+        if (min == i) {
+            return;
+        }
+
+        tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+
+        i = min;
+    }
+}
+
+
+/*
+ * k-way merge of the kfifo heads; each kfifo is already in time order.
+ * Records newer than "limit" stay queued for the next round.
+ */
+
+static void
+mlog_merge_rings(unsigned long limit)
+{
+    unsigned int                 i;
+    mlog_record_t               *rec;
+    mlog_thread_local_data_t    *data;
+
+    async_job.nheap = 0;
+
+    for (i = 0; i < async_job.nrings; i++) {
+        if (mlog_ring_head(async_job.rings[i])) {
+            async_job.heap[async_job.nheap++] = async_job.rings[i];
+        }
+    }
+
+    for (i = async_job.nheap / 2; i-- > 0; /* void */) {
+        mlog_heap_sift_down(i);
+    }
+
+    while (async_job.nheap > 0) {
+        data = async_job.heap[0];
+        rec = mlog_ring_head(data);
+
+        if (rec->msec > limit) {
+            break;
+        }
+
+        mlog_emit_record(data, rec);
+
+        if (mlog_ring_head(data) == NULL) {
+            async_job.heap[0] = async_job.heap[--async_job.nheap];
+        }
+
+        mlog_heap_sift_down(0);
+    }
+}
+
+
+static void
+mlog_drain_rings()
+{
+    unsigned int                 i;
+    mlog_record_t               *rec;
+    mlog_thread_local_data_t    *data;
+
+    for (i = 0; i < async_job.nrings; i++) {
+        data = async_job.rings[i];
+
+        while ((rec = mlog_ring_head(data)) != NULL) {
+            mlog_emit_record(data, rec);
+        }
+    }
+}
+
+
+static unsigned long
+mlog_now_msec()
+{
+    struct timespec  ts;
+
+    mlog_time_now(&ts);
+
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* pick up threads that started or exited since the last round */
+
+static void
+mlog_refresh_rings()
+{
+    unsigned int                 n;
+    mlog_atomic_uint_t           gen;
+    mlog_thread_local_data_t    *data, **rings;
+
+    gen = __atomic_load_n(&thread_data.generation, __ATOMIC_ACQUIRE);
+    if (gen == async_job.generation) {
+        return;
+    }
+
+    pthread_mutex_lock(&thread_data.mutex);
+
+    n = thread_data.table->count;
+
+    if (n > async_job.rings_cap) {
+        rings = realloc(async_job.rings, n * 2 * sizeof(*rings));
+        if (rings == NULL) {
+            MLOG_ERROR("realloc rings %u failed", n);
+            pthread_mutex_unlock(&thread_data.mutex);
+            return;
+        }
+
+        async_job.rings = rings;
+
+        rings = realloc(async_job.heap, n * 2 * sizeof(*rings));
+        if (rings == NULL) {
+            MLOG_ERROR("realloc heap %u failed", n);
+            pthread_mutex_unlock(&thread_data.mutex);
+            return;
+        }
+
+        async_job.heap = rings;
+        async_job.rings_cap = n * 2;
+    }
+
+    async_job.nrings = 0;
+
+    hash_first(thread_data.table);
+
+    while ((data = hash_next(thread_data.table)) != NULL) {
+        async_job.rings[async_job.nrings++] = data;
+    }
+
+    hash_last(thread_data.table);
+
+    async_job.generation = gen;
+
+    pthread_mutex_unlock(&thread_data.mutex);
+}
+
+
+/* returns 1 if any kfifo got records since the last snapshot */
+
+static int
+mlog_snapshot_rings()
+{
+    int                          pending = 0;
+    unsigned int                 i, end;
+    mlog_thread_local_data_t    *data;
+
+    mlog_refresh_rings();
+
+    for (i = 0; i < async_job.nrings; i++) {
+        data = async_job.rings[i];
+
+        end = __atomic_load_n(&data->kfifo_buf->in, __ATOMIC_ACQUIRE);
+
+        if (end != data->end) {
+            data->end = end;
+            pending = 1;
+        }
+    }
+
+    return pending;
+}
+
+
+/*
+ * drop the writer's refer on kfifos whose thread exited and that are
+ * written out, a held batch may still point into them
+ */
+
+static void
+mlog_release_rings()
+{
+    unsigned int                 i;
+    mlog_thread_local_data_t    *data;
+
+    for (i = 0; i < async_job.nrings; i++) {
+        data = async_job.rings[i];
+
+        if (data->refer == 1 && data->kfifo_buf->out == data->kfifo_buf->in)
+        {
+            mlog_decrease_refer_and_try_release(data);
+            async_job.rings[i--] = async_job.rings[--async_job.nrings];
+        }
+    }
+}
+
+
+/* timeout in usec, 0 for none; "hold" sleeps through lines that can wait */
+
+static void
+mlog_wait_records(unsigned long timeout, int hold)
+{
+    int              ret;
+    uint64_t         n;
+    struct pollfd    pfd;
+    struct timespec  ts;
+
+    __atomic_store_n(&async_job.waiting, hold ? MLOG_WAIT_URGENT : MLOG_WAIT_ANY,
+                     __ATOMIC_SEQ_CST);
+
+    if (!async_job.active || __atomic_load_n(&async_job.flush, __ATOMIC_RELAXED)
+        || (!hold && mlog_snapshot_rings()))
+    {
+        __atomic_store_n(&async_job.waiting, 0, __ATOMIC_RELAXED);
+        return;
+    }
+
+    MLOG_DEBUG("poll wake_fd");
+
+    pfd.fd = async_job.wake_fd;
+    pfd.events = POLLIN;
+
+    ts.tv_sec = timeout / 1000000;
+    ts.tv_nsec = timeout % 1000000 * 1000;
+
+    ret = ppoll(&pfd, 1, timeout ? &ts : NULL, NULL);
+
+    if (ret < 0 && errno != EINTR) {
+        MLOG_ERROR("poll wake_fd failed errno=%d", errno);
+    }
+
+    __atomic_store_n(&async_job.waiting, 0, __ATOMIC_RELAXED);
+
+    /*
+     * one read takes all wakeups so far; a wakeup that raced with the
+     * snapshot above just makes the next poll() return at once
+     */
+
+    if (ret > 0 && read(async_job.wake_fd, &n, sizeof(n)) < 0
+        && errno != EAGAIN)
+    {
+        MLOG_ERROR("read wake_fd failed errno=%d", errno);
+    }
+}
+
+
+static void
+mlog_counters_add(mlog_counters_t *sum, const mlog_counters_t *c)
+{
+    int  i;
+
+    for (i = MLOG_LEVEL_ERROR; i <= MLOG_LEVEL_DEBUG; i++) {
+        sum->lines[i] += c->lines[i];
+        sum->bytes[i] += c->bytes[i];
+    }
+
+    sum->dropped += c->dropped;
+    sum->shed += c->shed;
+    sum->overwritten += c->overwritten;
+    sum->spilled += c->spilled;
+    sum->blocked += c->blocked;
+    sum->wakeups += c->wakeups;
+}
+
+
+/* what a freed kfifo's thread did stays in the totals */
+
+static void
+mlog_ring_fold(mlog_thread_local_data_t *data)
+{
+    mlog_counters_add(&thread_data.exited, &data->counters);
+
+#ifdef MLOG_LATENCY
+    mlog_hist_merge(&thread_data.exited_producer, &data->producer);
+#endif
+}
+
+
+/*
+ * Counters are read while their threads update them, each number is
+ * current on its own but the sums are not one atomic snapshot.
+ */
+
+int
+mlog_inner_stats(mlog_stats_t *stats)
+{
+    clockid_t                    cid;
+    unsigned int                 i;
+    struct kfifo                *fifo;
+    struct timespec              ts;
+    mlog_thread_stats_t         *ts_data;
+    mlog_thread_local_data_t    *data;
+
+    memset(stats, 0, sizeof(mlog_stats_t));
+
+    stats->magic = MLOG_STATS_MAGIC;
+    stats->msec = mlog_now_msec();
+    stats->start_msec = async_job.start_msec;
+    stats->pid = getpid();
+
+    pthread_mutex_lock(&thread_data.mutex);
+
+    if (thread_data.table == NULL) {
+        pthread_mutex_unlock(&thread_data.mutex);
+        return -1;
+    }
+
+    stats->total = thread_data.exited;
+
+    hash_first(thread_data.table);
+
+    while ((data = hash_next(thread_data.table)) != NULL) {
+        mlog_counters_add(&stats->total, &data->counters);
+
+        if (stats->nthreads < MLOG_STATS_THREADS) {
+            fifo = data->kfifo_buf;
+            ts_data = &stats->threads[stats->nthreads];
+
+            ts_data->tid = data->tid;
+            ts_data->size = fifo->size;
+            ts_data->used = fifo->in
+                            - __atomic_load_n(&fifo->out, __ATOMIC_RELAXED);
+            ts_data->peak = data->peak;
+            ts_data->counters = data->counters;
+        }
+
+        stats->nthreads++;
+    }
+
+    hash_last(thread_data.table);
+
+    pthread_mutex_unlock(&thread_data.mutex);
+
+    stats->batches = async_job.batches;
+    stats->batch_lines = async_job.batched_lines;
+    stats->batch_bytes = async_job.batched_bytes;
+    stats->write_errors = async_job.write_errors;
+
+    for (i = 0; i < async_job.nsinks; i++) {
+        stats->sink_lines += async_job.sinks[i].lines;
+        stats->sink_dropped += async_job.sinks[i].dropped;
+        stats->sink_errors += async_job.sinks[i].errors;
+    }
+
+    /* the writer is joined after it cleared "active" */
+
+    if (pthread_equal(pthread_self(), async_job.tid)) {
+        cid = CLOCK_THREAD_CPUTIME_ID;
+
+    } else if (!async_job.active
+               || pthread_getcpuclockid(async_job.tid, &cid) != 0)
+    {
+        return 0;
+    }
+
+    if (clock_gettime(cid, &ts) == 0) {
+        stats->writer_cpu_usec = ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    return 0;
+}
+
+
+#ifdef MLOG_LATENCY
+
+static void
+mlog_latency_summary(const mlog_hist_t *h, mlog_latency_t *lat)
+{
+    lat->count = h->count;
+    lat->mean = h->count ? h->sum / h->count : 0;
+    lat->p50 = mlog_hist_value_at(h, 0.5);
+    lat->p99 = mlog_hist_value_at(h, 0.99);
+    lat->p999 = mlog_hist_value_at(h, 0.999);
+    lat->max = h->max;
+}
+
+#endif
+
+
+int
+mlog_inner_latency(mlog_latency_t *queue, mlog_latency_t *producer)
+{
+#ifdef MLOG_LATENCY
+    mlog_hist_t                 *sum;
+    mlog_thread_local_data_t    *data;
+
+    sum = malloc(sizeof(mlog_hist_t));
+    if (sum == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&thread_data.mutex);
+
+    if (thread_data.table == NULL) {
+        pthread_mutex_unlock(&thread_data.mutex);
+        free(sum);
+        return -1;
+    }
+
+    *sum = thread_data.exited_producer;
+
+    hash_first(thread_data.table);
+
+    while ((data = hash_next(thread_data.table)) != NULL) {
+        mlog_hist_merge(sum, &data->producer);
+    }
+
+    hash_last(thread_data.table);
+
+    pthread_mutex_unlock(&thread_data.mutex);
+
+    mlog_latency_summary(sum, producer);
+    mlog_latency_summary(&async_job.queue, queue);
+
+    free(sum);
+
+    return 0;
+
+#else
+
+    memset(queue, 0, sizeof(mlog_latency_t));
+    memset(producer, 0, sizeof(mlog_latency_t));
+
+    return -1;
+
+#endif
+}
+
+
+/* a seqlock: readers retry while seq is odd or changed under them */
+
+static void
+mlog_publish_stats()
+{
+    unsigned long  seq;
+    mlog_stats_t   stats, *map = async_job.stats_map;
+
+    if (mlog_inner_stats(&stats) != 0) {
+        return;
+    }
+
+    seq = map->seq;
+
+    __atomic_store_n(&map->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    stats.seq = seq + 1;
+    memcpy(map, &stats, sizeof(mlog_stats_t));
+
+    __atomic_store_n(&map->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Waits for records the way conf->idle says. Returns when there are some,
+ * after "timeout" usec (0 for none), or when the logger stops. A writer
+ * that holds a batch only returns early for a flush.
+ */
+
+static void
+mlog_idle(unsigned long timeout, int hold)
+{
+    unsigned long  start, spent, left;
+
+    if (async_job.idle == MLOG_IDLE_BLOCK) {
+        mlog_wait_records(timeout, hold);
+        return;
+    }
+
+    start = mlog_mono_nsec();
+
+    while (async_job.active
+           && !__atomic_load_n(&async_job.flush, __ATOMIC_RELAXED)
+           && (hold || !mlog_snapshot_rings()))
+    {
+        spent = mlog_mono_nsec() - start;
+
+        if (timeout && spent >= timeout * 1000) {
+            return;
+        }
+
+        if (async_job.idle == MLOG_IDLE_SPIN || spent < async_job.idle_spin) {
+            mlog_cpu_relax();
+            continue;
+        }
+
+        if (async_job.idle == MLOG_IDLE_YIELD) {
+            sched_yield();
+            continue;
+        }
+
+        /* MLOG_IDLE_PARK, producers wake it up as for MLOG_IDLE_BLOCK */
+
+        left = async_job.idle_park * 1000;
+
+        if (timeout && timeout - spent / 1000 < left) {
+            left = timeout - spent / 1000;
+        }
+
+        mlog_wait_records(left ? left : 1, hold);
+
+        return;
+    }
+}
+
+
+/* a crash handler may not call localtime_r(), it adds this to UTC */
+
+static void
+mlog_crash_tz()
+{
+    time_t     now = time(NULL);
+    struct tm  tm;
+
+    if (localtime_r(&now, &tm) != NULL) {
+        __atomic_store_n(&async_job.crash_gmtoff, tm.tm_gmtoff,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+
+/* the writer keeps off the kfifos while mlog_crash_flush() drains them */
+
+static void
+mlog_crash_park()
+{
+    struct timespec  ts;
+
+    mlog_flush_batch();
+    mlog_uring_settle(MLOG_URING_ALL);
+
+    __atomic_store_n(&async_job.crash_parked, 1, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&async_job.crashing, __ATOMIC_ACQUIRE)) {
+        ts.tv_sec = 0;
+        ts.tv_nsec = MLOG_BLOCK_PARK * 1000000;
+
+        syscall(SYS_futex, &async_job.crashing, FUTEX_WAIT_PRIVATE, 1, &ts,
+                NULL, 0);
+    }
+
+    __atomic_store_n(&async_job.crash_parked, 0, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * MLOG_IO_MMAP from a crash handler: copies into the window mapped now,
+ * moving it takes fallocate() and mmap(), what lies past it goes through
+ * pwrite()
+ */
+
+static ssize_t
+mlog_crash_mmap(const struct iovec *iov, int cnt)
+{
+    int              i;
+    size_t           n, len, pos, done = 0;
+    ssize_t          w;
+    struct iovec     rest;
+    unsigned char   *p;
+
+    for (i = 0; i < cnt; i++) {
+        p = iov[i].iov_base;
+        len = iov[i].iov_len;
+
+        pos = async_job.file_bytes + done - async_job.map_off;
+
+        if (async_job.map && pos < async_job.map_size) {
+            n = async_job.map_size - pos;
+            if (n > len) {
+                n = len;
+            }
+
+            memcpy(async_job.map + pos, p, n);
+
+            p += n;
+            len -= n;
+            done += n;
+        }
+
+        if (len == 0) {
+            continue;
+        }
+
+        rest.iov_base = p;
+        rest.iov_len = len;
+
+        w = mlog_pwrite_full(async_job.fd, &rest, 1,
+                             async_job.file_bytes + done);
+        if (w < 0) {
+            return done ? (ssize_t) done : -1;
+        }
+
+        done += w;
+
+        if ((size_t) w < len) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+
+static ssize_t
+mlog_crash_writev(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t  n;
+
+    if (fd != async_job.fd) {
+        return mlog_writev_full(fd, iov, cnt);
+    }
+
+    if (async_job.io == MLOG_IO_MMAP) {
+        n = mlog_crash_mmap(iov, cnt);
+
+    } else if (async_job.io == MLOG_IO_URING) {
+        n = mlog_pwrite_full(fd, iov, cnt, async_job.file_bytes);
+
+    } else {
+        n = mlog_writev_full(fd, iov, cnt);
+    }
+
+    if (n > 0) {
+        async_job.file_bytes += n;
+    }
+
+    return n;
+}
+
+
+/*
+ * A crash write. Deflate may allocate and the mmap window is not moved,
+ * see above; a gzip file gets members of stored blocks, which zcat and
+ * mlog_decode read as any other.
+ */
+
+static ssize_t
+mlog_crash_write(int fd, unsigned char *buf, size_t len)
+{
+    struct iovec   iov[3];
+#ifdef MLOG_WITH_ZLIB
+    size_t         n, done;
+    ssize_t        wlen;
+    unsigned char  head[MLOG_GZ_STORED_LEN], trailer[MLOG_GZ_TRAILER_LEN];
+
+    if (fd == async_job.fd && async_job.compress == MLOG_COMPRESS_GZIP) {
+
+        for (done = 0; done < len; done += n) {
+            n = len - done;
+            if (n > MLOG_GZ_STORED_MAX) {
+                n = MLOG_GZ_STORED_MAX;
+            }
+
+            mlog_gz_stored(head, trailer, buf + done, n);
+
+            iov[0].iov_base = head;
+            iov[0].iov_len = sizeof(head);
+            iov[1].iov_base = buf + done;
+            iov[1].iov_len = n;
+            iov[2].iov_base = trailer;
+            iov[2].iov_len = sizeof(trailer);
+
+            wlen = mlog_crash_writev(fd, iov, 3);
+            if (wlen != (ssize_t) (sizeof(head) + n + sizeof(trailer))) {
+                return -1;
+            }
+        }
+
+        return len;
+    }
+#endif
+
+    iov[0].iov_base = buf;
+    iov[0].iov_len = len;
+
+    return mlog_crash_writev(fd, iov, 1);
+}
+
+
+/*
+ * Merges the kfifos by time into a buffer of its own, writing it out
+ * whenever it fills up; the writer's format buffer may still back the
+ * iovecs of a batch. Walks the table without its mutex, which a crashed
+ * thread may hold, and takes MLOG_CRASH_RINGS at a time. The writer is
+ * parked or is the caller, so the read positions are the drain's.
+ * Returns the number of lines written.
+ */
+
+static unsigned long
+mlog_crash_drain(int fd)
+{
+    unsigned int                 i, n, bucket = 0, used = 0;
+    unsigned long                lines = 0;
+    hash_link                   *link = NULL;
+    mlog_record_t               *rec, *min;
+    mlog_thread_local_data_t    *data, *from;
+    unsigned char               *buf = mlog_crash_buf;
+
+    for ( ;; ) {
+        n = 0;
+
+        while (n < MLOG_CRASH_RINGS) {
+            if (link == NULL) {
+                if (bucket == thread_data.table->size) {
+                    break;
+                }
+
+                link = thread_data.table->buckets[bucket++];
+                continue;
+            }
+
+            data = (mlog_thread_local_data_t *) link;
+            link = link->next;
+
+            /* what the writer read but did not write goes again */
+
+            data->rpos = __atomic_load_n(&data->kfifo_buf->out,
+                                         __ATOMIC_ACQUIRE);
+            data->end = __atomic_load_n(&data->kfifo_buf->in,
+                                        __ATOMIC_ACQUIRE);
+
+            mlog_crash_rings[n++] = data;
+        }
+
+        if (n == 0) {
+            return lines;
+        }
+
+        for ( ;; ) {
+            min = NULL;
+            from = NULL;
+
+            for (i = 0; i < n; i++) {
+                rec = mlog_ring_head(mlog_crash_rings[i]);
+
+                if (rec && (min == NULL || rec->msec < min->msec)) {
+                    min = rec;
+                    from = mlog_crash_rings[i];
+                }
+            }
+
+            if (min == NULL || MLOG_CRASH_BUF - used < MLOG_MAX_LOG_LEN) {
+                if (used && mlog_crash_write(fd, buf, used) < 0) {
+                    return lines;
+                }
+
+                used = 0;
+
+                for (i = 0; i < n; i++) {
+                    mlog_ring_written(mlog_crash_rings[i]);
+                }
+
+                if (min == NULL) {
+                    break;
+                }
+            }
+
+            if (min->type == MLOG_RECORD_DEFERRED) {
+                used += mlog_crash_render(from, min, (char *) buf + used);
+
+            } else {
+                memcpy(buf + used, (unsigned char *) min
+                                   + sizeof(mlog_record_t), min->len);
+                used += min->len;
+            }
+
+            from->rpos += MLOG_RECORD_SIZE(min->len);
+            lines++;
+        }
+    }
+}
+
+
+/*
+ * Writes what the kfifos hold right away in the calling thread, for a
+ * crash handler. Only a CAS, futex calls, and write(), pwrite() or
+ * memcpy() into the window mapped already; no lock, no malloc, no
+ * deflate and no stdio. A gzip file gets the lines in stored blocks.
+ * Deferred records and the time go through the async-signal-safe
+ * formatter, local time is UTC plus the offset the writer last took. The
+ * writer must park first, or be the caller; one that does not within
+ * MLOG_CRASH_WAIT, stuck in write() or on a lock the crashed thread
+ * holds, still owns the kfifos and nothing is drained. Binary output
+ * would grow its dictionary, the lines go to stderr as text then.
+ */
+
+int
+mlog_inner_crash_flush()
+{
+    int              err = errno, expected = 0, i;
+    unsigned long    lines;
+    uint64_t         one = 1;
+    struct timespec  ts;
+
+    if (async_job.wake_fd < 0 || async_job.fmt_buf == NULL) {
+        return -1;
+    }
+
+    /* one thread drains, a second crash finds it taken */
+
+    if (!__atomic_compare_exchange_n(&async_job.crashing, &expected, 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return -1;
+    }
+
+    /* a writer stuck in write() or crashed itself is not waited for */
+
+    if (!pthread_equal(pthread_self(), async_job.tid)) {
+        __atomic_or_fetch(&async_job.flush, MLOG_FLUSH_BATCH, __ATOMIC_SEQ_CST);
+
+        if (write(async_job.wake_fd, &one, sizeof(one)) < 0) {
+            /* void */
+        }
+
+        for (i = 0; i < MLOG_CRASH_WAIT; i++) {
+            if (__atomic_load_n(&async_job.crash_parked, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+
+            ts.tv_sec = 0;
+            ts.tv_nsec = 1000000;
+            nanosleep(&ts, NULL);
+        }
+
+        if (i == MLOG_CRASH_WAIT) {
+            lines = (unsigned long) -1;
+            goto done;
+        }
+    }
+
+    lines = mlog_crash_drain(async_job.output == MLOG_OUTPUT_BINARY
+                             ? STDERR_FILENO : async_job.fd);
+
+done:
+
+    __atomic_store_n(&async_job.crashing, 0, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &async_job.crashing, FUTEX_WAKE_PRIVATE, 1, NULL, NULL,
+            0);
+
+    errno = err;
+
+    return lines;
+}
+
+
+static void *
+mlog_async_write_log(void *arg)
+{
+    int                          active, flush;
+    unsigned int                 i;
+    unsigned long                now, timeout, hold;
+    mlog_record_t               *rec;
+
+    (void) arg;
+
+    MLOG_DEBUG("start async job ...");
+
+    for (;;) {
+
+        /* a crash handler drains the kfifos, stay off them meanwhile */
+
+        if (__atomic_load_n(&async_job.crashing, __ATOMIC_ACQUIRE)) {
+            mlog_crash_park();
+        }
+
+        active = async_job.active;
+        timeout = 0;
+
+        /* summaries go through the writer's own kfifo, picked up below */
+
+        now = mlog_now_msec();
+
+        if (now - async_job.report_msec >= MLOG_REPORT_INTERVAL || !active) {
+            mlog_site_report();
+            mlog_crash_tz();
+            async_job.report_msec = now;
+        }
+
+        if (async_job.stats_map
+            && now - async_job.stats_msec >= MLOG_REPORT_INTERVAL)
+        {
+            mlog_publish_stats();
+            async_job.stats_msec = now;
+        }
+
+        /* taken before the snapshot, so it covers the lines that asked */
+
+        flush = __atomic_exchange_n(&async_job.flush, 0, __ATOMIC_SEQ_CST);
+
+        /* lines queued after mlog_reopen() returned go to the new file */
+
+        if (__atomic_exchange_n(&async_job.reopen, 0, __ATOMIC_ACQUIRE)) {
+            mlog_flush_batch();
+            mlog_reopen_file();
+        }
+
+        mlog_snapshot_rings();
+
+        if (async_job.order == MLOG_ORDER_THREAD) {
+            mlog_drain_rings();
+
+        } else if (async_job.order == MLOG_ORDER_WINDOW && active
+                   && !(flush & MLOG_FLUSH_ALL))
+        {
+            now = mlog_now_msec();
+            mlog_merge_rings(now - async_job.reorder_window);
+
+            /* come back when the oldest held record leaves the window */
+
+            for (i = 0; i < async_job.nrings; i++) {
+                rec = mlog_ring_head(async_job.rings[i]);
+                if (rec) {
+                    timeout = async_job.reorder_window * 1000;
+                    break;
+                }
+            }
+
+        } else {
+            mlog_merge_rings(~0UL);
+        }
+
+        hold = mlog_batch_hold(flush);
+
+        if (hold == 0) {
+            mlog_flush_batch();
+        }
+
+        /* mlog_flush() also waits for the writes in flight */
+
+        if (flush & MLOG_FLUSH_ALL) {
+            mlog_uring_settle(MLOG_URING_ALL);
+        }
+
+        mlog_release_rings();
+
+        if (!active) {
+            MLOG_DEBUG("recv exit signal");
+            break;
+        }
+
+        if (hold == 0 && timeout == 0 && mlog_snapshot_rings()) {
+            continue;
+        }
+
+        if (hold && (timeout == 0 || hold / 1000 + 1 < timeout)) {
+            timeout = hold / 1000 + 1;
+        }
+
+        if (timeout == 0
+            && (mlog_site_reporting_count() || async_job.stats_map))
+        {
+            timeout = MLOG_REPORT_INTERVAL * 1000;
+        }
+
+        mlog_idle(timeout, hold != 0);
+    }
+
+    /* the final numbers, with everything written */
+
+    if (async_job.stats_map) {
+        mlog_publish_stats();
+        munmap(async_job.stats_map, sizeof(mlog_stats_t));
+        async_job.stats_map = NULL;
+    }
+
+    for (i = 0; i < async_job.nrings; i++) {
+        mlog_decrease_refer_and_try_release(async_job.rings[i]);
+    }
+
+    async_job.nrings = 0;
+
+    if (async_job.fd >= 0) {
+        mlog_uring_settle(MLOG_URING_ALL);
+        mlog_uring_free(&async_job.uring);
+        mlog_mmap_close();
+        close(async_job.fd);
+        async_job.fd = -1;
+    }
+
+    /* nothing was written to the prepared file */
+
+    if (async_job.next_fd >= 0) {
+        close(async_job.next_fd);
+        unlink(async_job.next_path);
+        async_job.next_fd = -1;
+    }
+
+    /* each writes out its queue first */
+
+    for (i = 0; i < async_job.nsinks; i++) {
+        mlog_sink_free(&async_job.sinks[i]);
+    }
+
+    async_job.nsinks = 0;
+
+    free(async_job.levels);
+    async_job.levels = NULL;
+    free(async_job.iov);
+    async_job.iov = NULL;
+    free(async_job.fmt_buf);
+    async_job.fmt_buf = NULL;
+#ifdef MLOG_LATENCY
+    free(async_job.stamps);
+    async_job.stamps = NULL;
+#endif
+    mlog_bin_dict_free(&async_job.bin);
+#ifdef MLOG_WITH_ZLIB
+    mlog_gz_free(&async_job.gz);
+#endif
+    free(async_job.rings);
+    async_job.rings = NULL;
+    free(async_job.heap);
+    async_job.heap = NULL;
+    async_job.rings_cap = 0;
+
+    MLOG_DEBUG("exit async job !!!");
+
+    return NULL;
+}
+
+
+/* steps *off over a slot and its buffer, NULL past the last one */
+
+static mlog_crash_slot_t *
+mlog_crash_next(mlog_crash_head_t *head, size_t size, size_t *off)
+{
+    unsigned int        len;
+    mlog_crash_slot_t  *slot;
+
+    if (*off + head->page > size) {
+        return NULL;
+    }
+
+    slot = (mlog_crash_slot_t *) ((unsigned char *) head + *off);
+    len = slot->fifo.size;
+
+    if (len < head->page || (len & (len - 1))
+        || *off + head->page + len > size)
+    {
+        return NULL;
+    }
+
+    *off += head->page + len;
+
+    return slot;
+}
+
+
+static inline off_t
+mlog_crash_buffer(mlog_crash_head_t *head, mlog_crash_slot_t *slot)
+{
+    return (unsigned char *) slot - (unsigned char *) head + head->page;
+}
+
+
+static void
+mlog_crash_exe(unsigned long *ino, unsigned long *mtime)
+{
+    struct stat  st;
+
+    if (stat("/proc/self/exe", &st) != 0) {
+        *ino = 0;
+        *mtime = 0;
+        return;
+    }
+
+    *ino = st.st_ino;
+    *mtime = st.st_mtime;
+}
+
+
+/*
+ * Lays out a new crash file next to the old one and renames it over, so
+ * the old one stays readable to the recovery through its mappings. The
+ * spill arena gets a slot of its own size.
+ */
+
+static int
+mlog_crash_create(const char *path, unsigned int nslots, unsigned int size,
+    unsigned int spill_size)
+{
+    int                  fd;
+    size_t               total, off;
+    unsigned int         i, page = getpagesize();
+    mlog_crash_head_t   *head;
+    mlog_crash_slot_t   *slot;
+    char                 tmp[PATH_MAX];
+
+    if ((size_t) snprintf(tmp, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+        MLOG_ERROR("crash file name %s too long", path);
+        return -1;
+    }
+
+    size = size < page ? page : size;
+    spill_size = spill_size && spill_size < page ? page : spill_size;
+
+    total = page + (size_t) nslots * (page + size)
+            + (spill_size ? page + spill_size : 0);
+
+    fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (fd < 0) {
+        MLOG_ERROR("open crash file %s failed errno=%d", tmp, errno);
+        return -1;
+    }
+
+    /* sparse, a buffer takes disk or memory as its thread fills it */
+
+    if (ftruncate(fd, total) != 0) {
+        MLOG_ERROR("size crash file %s failed errno=%d", tmp, errno);
+        goto _fail;
+    }
+
+    head = mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (head == MAP_FAILED) {
+        MLOG_ERROR("mmap crash file %s failed errno=%d", tmp, errno);
+        goto _fail;
+    }
+
+    off = page;
+
+    for (i = 0; i < nslots + (spill_size != 0); i++) {
+        slot = (mlog_crash_slot_t *) ((unsigned char *) head + off);
+        slot->fifo.size = i < nslots ? size : spill_size;
+        off += page + slot->fifo.size;
+    }
+
+    head->version = MLOG_CRASH_VERSION;
+    head->page = page;
+    head->nslots = i;
+    head->pid = getpid();
+    mlog_crash_exe(&head->exe_ino, &head->exe_mtime);
+    head->sites = (unsigned long) mlog_site_section(&head->nsites);
+    head->magic = MLOG_CRASH_MAGIC;
+
+    if (rename(tmp, path) != 0) {
+        MLOG_ERROR("rename crash file %s failed errno=%d", tmp, errno);
+        munmap(head, total);
+        goto _fail;
+    }
+
+    async_job.crash = head;
+    async_job.crash_size = total;
+    async_job.crash_fd = fd;
+
+    return 0;
+
+_fail:
+
+    close(fd);
+    unlink(tmp);
+
+    return -1;
+}
+
+
+/* a free slot of this size, NULL when all are taken */
+
+static mlog_crash_slot_t *
+mlog_crash_take(pid_t pid, pid_t tid, unsigned int size)
+{
+    size_t              off;
+    mlog_crash_head_t  *head = async_job.crash;
+    mlog_crash_slot_t  *slot;
+
+    if (async_job.crash_fd < 0) {
+        return NULL;
+    }
+
+    size = size < head->page ? head->page : size;
+    off = head->page;
+
+    pthread_mutex_lock(&thread_data.mutex);
+
+    while ((slot = mlog_crash_next(head, async_job.crash_size, &off))) {
+        if (!slot->used && slot->fifo.size == size) {
+            slot->used = 1;
+            slot->pid = pid;
+            slot->tid = tid;
+            slot->fifo.in = 0;
+            slot->fifo.out = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&thread_data.mutex);
+
+    if (slot == NULL) {
+        return NULL;
+    }
+
+    if (kfifo_map(&slot->fifo, async_job.crash_fd,
+                  mlog_crash_buffer(head, slot), size) != 0)
+    {
+        MLOG_ERROR("map crash slot failed errno=%d", errno);
+        __atomic_store_n(&slot->used, 0, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    return slot;
+}
+
+
+/*
+ * A deferred record points at its format and call site, which moved with
+ * the program's load address. Only the same program can render it.
+ */
+
+static int
+mlog_crash_relocate(mlog_record_t *rec, long delta, int same_exe)
+{
+    unsigned long       n, desc;
+    mlog_site_t        *sites;
+    mlog_fmt_site_t    *site;
+
+    if (!same_exe || rec->len < sizeof(mlog_fmt_site_t)) {
+        return -1;
+    }
+
+    site = (mlog_fmt_site_t *) ((unsigned char *) rec + sizeof(mlog_record_t));
+    sites = mlog_site_section(&n);
+
+    desc = (unsigned long) site->desc + delta;
+
+    if (desc < (unsigned long) sites || desc >= (unsigned long) (sites + n)
+        || (desc - (unsigned long) sites) % sizeof(mlog_site_t))
+    {
+        return -1;
+    }
+
+    site->desc = (const mlog_site_t *) desc;
+    site->fmt += delta;
+
+    return 0;
+}
+
+
+/* a deferred record nobody can render becomes a line saying so */
+
+static void
+mlog_crash_lost(mlog_record_t *rec)
+{
+    unsigned int         n;
+    unsigned char       *p;
+    static const char    lost[] = "[lost deferred line]";
+
+    p = (unsigned char *) rec + sizeof(mlog_record_t);
+    n = sizeof(lost) - 1 < rec->len - 1 ? sizeof(lost) - 1 : rec->len - 1;
+
+    memcpy(p, lost, n);
+    memset(p + n, ' ', rec->len - 1 - n);
+    p[rec->len - 1] = '\n';
+
+    rec->type = MLOG_RECORD_TEXT;
+}
+
+
+/*
+ * Checks the records a crashed run left in a kfifo and cuts it at the
+ * first one that is not whole; returns how many are left.
+ */
+
+static unsigned int
+mlog_crash_check(struct kfifo *fifo, long delta, int same_exe)
+{
+    unsigned int     pos, left, size, n = 0;
+    mlog_record_t   *rec;
+
+    if (fifo->in - fifo->out > fifo->size) {
+        fifo->in = fifo->out;
+    }
+
+    for (pos = fifo->out; pos != fifo->in; pos += size) {
+        left = fifo->in - pos;
+        rec = (mlog_record_t *) kfifo_peek(fifo, pos);
+
+        if (left < sizeof(mlog_record_t) || rec->len == 0
+            || rec->len > MLOG_MAX_LOG_LEN || rec->level > MLOG_LEVEL_DEBUG
+            || rec->type > MLOG_RECORD_DEFERRED
+            || MLOG_RECORD_SIZE(rec->len) > left)
+        {
+            fifo->in = pos;
+            break;
+        }
+
+        size = MLOG_RECORD_SIZE(rec->len);
+
+        if (rec->type == MLOG_RECORD_DEFERRED
+            && mlog_crash_relocate(rec, delta, same_exe) != 0)
+        {
+            mlog_crash_lost(rec);
+        }
+
+#ifdef MLOG_LATENCY
+        rec->stamp = mlog_mono_nsec();
+#endif
+
+        n++;
+    }
+
+    return n;
+}
+
+
+/* the kfifo of a crashed run, the writer takes it as one of an exited thread */
+
+static int
+mlog_crash_ring(int fd, mlog_crash_head_t *head, mlog_crash_slot_t *slot,
+    long delta, int same_exe)
+{
+    mlog_thread_local_data_t    *data;
+
+    if (posix_memalign((void **) &data, 64, sizeof(mlog_thread_local_data_t))
+        != 0)
+    {
+        MLOG_ERROR("alloc mlog_thread_local_data_t failed");
+        return -1;
+    }
+
+    memset(data, 0, sizeof(mlog_thread_local_data_t));
+
+    if (kfifo_map(&slot->fifo, fd, mlog_crash_buffer(head, slot),
+                  slot->fifo.size) != 0)
+    {
+        MLOG_ERROR("map crashed slot failed errno=%d", errno);
+        free(data);
+        return -1;
+    }
+
+    if (mlog_crash_check(&slot->fifo, delta, same_exe) == 0) {
+        kfifo_unmap(&slot->fifo);
+        free(data);
+        return 0;
+    }
+
+    data->kfifo_buf = &slot->fifo;
+    data->slot = slot;
+    data->recovered = 1;
+    data->pid = slot->pid;
+    data->tid = slot->tid;
+    data->rpos = slot->fifo.out;
+    data->end = slot->fifo.out;
+    data->head = slot->fifo.out;
+    data->claim = slot->fifo.out;
+
+    data->hlnk.key = &mlog_shared_tid;
+
+    data->refer = 1;
+
+    pthread_mutex_lock(&thread_data.mutex);
+    hash_join(thread_data.table, &data->hlnk);
+    async_job.recovering++;
+    __atomic_add_fetch(&thread_data.generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&thread_data.mutex);
+
+    return 0;
+}
+
+
+/*
+ * Hands what a crashed run left in its crash file to the writer, which
+ * merges it by time before the lines of this run. Records the crashed
+ * writer had in a batch but not released yet may be written twice.
+ */
+
+static void
+mlog_crash_recover(const char *path)
+{
+    int                  fd, same_exe;
+    long                 delta;
+    size_t               off;
+    struct stat          st;
+    unsigned long        ino, mtime, nsites;
+    mlog_site_t         *sites;
+    mlog_crash_head_t   *head;
+    mlog_crash_slot_t   *slot;
+
+    if (async_job.crash_old) {
+        return;
+    }
+
+    fd = open(path, O_RDWR|O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            MLOG_ERROR("open crash file %s failed errno=%d", path, errno);
+        }
+
+        return;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < getpagesize()) {
+        close(fd);
+        return;
+    }
+
+    head = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (head == MAP_FAILED) {
+        MLOG_ERROR("mmap crash file %s failed errno=%d", path, errno);
+        close(fd);
+        return;
+    }
+
+    /* a file this process still uses is not a crashed run's */
+
+    if (head->magic != MLOG_CRASH_MAGIC || head->version != MLOG_CRASH_VERSION
+        || head->page != (unsigned int) getpagesize() || head->pid == getpid())
+    {
+        munmap(head, st.st_size);
+        close(fd);
+        return;
+    }
+
+    mlog_crash_exe(&ino, &mtime);
+    sites = mlog_site_section(&nsites);
+
+    same_exe = ino && ino == head->exe_ino && mtime == head->exe_mtime
+               && nsites == head->nsites;
+    delta = (unsigned long) sites - head->sites;
+
+    async_job.crash_old = head;
+    async_job.crash_old_size = st.st_size;
+    async_job.recovering = 0;
+
+    off = head->page;
+
+    while ((slot = mlog_crash_next(head, st.st_size, &off))) {
+        if (slot->fifo.in != slot->fifo.out) {
+            (void) mlog_crash_ring(fd, head, slot, delta, same_exe);
+        }
+    }
+
+    close(fd);
+
+    pthread_mutex_lock(&thread_data.mutex);
+
+    if (async_job.recovering == 0) {
+        munmap(head, st.st_size);
+        async_job.crash_old = NULL;
+    }
+
+    pthread_mutex_unlock(&thread_data.mutex);
+}
+
+
+/* frees a kfifo nobody refers to, thread_data.mutex guards "recovering" */
+
+static void
+mlog_ring_free(mlog_thread_local_data_t *data)
+{
+    if (data->slot == NULL) {
+        kfifo_free(data->kfifo_buf);
+
+    } else if (!data->recovered) {
+        kfifo_unmap(data->kfifo_buf);
+        __atomic_store_n(&data->slot->used, 0, __ATOMIC_RELEASE);
+
+    } else {
+        kfifo_unmap(data->kfifo_buf);
+
+        if (--async_job.recovering == 0) {
+            munmap(async_job.crash_old, async_job.crash_old_size);
+            async_job.crash_old = NULL;
+        }
+    }
+
+    free(data);
+}
+
+
+/* init failed, the crashed run's kfifos go back unwritten */
+
+static void
+mlog_crash_forget()
+{
+    mlog_thread_local_data_t    *data;
+
+    pthread_mutex_lock(&thread_data.mutex);
+
+    while (async_job.recovering) {
+        hash_first(thread_data.table);
+
+        while ((data = hash_next(thread_data.table)) != NULL
+               && !data->recovered)
+        {
+            /* void */
+        }
+
+        hash_last(thread_data.table);
+
+        if (data == NULL) {
+            break;
+        }
+
+        hash_remove_link(thread_data.table, &data->hlnk);
+        mlog_ring_free(data);
+    }
+
+    pthread_mutex_unlock(&thread_data.mutex);
+}
+
+
+/*
+ * a kfifo the writer knows about, refer is for the owner and the writer;
+ * a shared one is not found by the tid
+ */
+
+static mlog_thread_local_data_t *
+mlog_ring_create(pid_t pid, pid_t tid, unsigned int size, int shared)
+{
+    mlog_thread_local_data_t    *data;
+
+    /* the counters get a cache line of their own */
+
+    if (posix_memalign((void **) &data, 64, sizeof(mlog_thread_local_data_t))
+        != 0)
+    {
+        MLOG_ERROR("alloc mlog_thread_local_data_t failed");
+        return NULL;
+    }
+
+    memset(data, 0, sizeof(mlog_thread_local_data_t));
+
+    /* in the crash file while it has a slot left, else in memory */
+
+    data->slot = mlog_crash_take(pid, tid, size);
+
+    if (data->slot) {
+        data->kfifo_buf = &data->slot->fifo;
+
+    } else {
+        data->kfifo_buf = kfifo_alloc(size);
+        if (data->kfifo_buf == NULL) {
+            MLOG_ERROR("kfifo_alloc failed");
+            free(data);
+            return NULL;
+        }
+    }
+
+    data->pid = pid;
+    data->tid = tid;
+
+    data->hlnk.key = shared ? &mlog_shared_tid : &data->tid;
+
+    data->refer = 2;
+
+    pthread_mutex_lock(&thread_data.mutex);
+    hash_join(thread_data.table, &data->hlnk);
+    __atomic_add_fetch(&thread_data.generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&thread_data.mutex);
+
+    MLOG_DEBUG("tid %d refer=%lu", data->tid, data->refer);
+
+    return data;
+}
+
+
+static mlog_thread_local_data_t *
+mlog_get_thread_data()
+{
+    mlog_thread_local_data_t    *data;
+
+    data = pthread_getspecific(mlog_pkey);
+    if (data) {
+        return data;
+    }
+
+    data = mlog_ring_create(getpid(), mlog_thread_tid(),
+                            thread_data.kfifo_buf_size, 0);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    /* a handler can not create it, it comes with the thread's kfifo */
+
+    if (thread_data.sig_buf_size) {
+        mlog_sig_data = mlog_ring_create(data->pid, data->tid,
+                                         thread_data.sig_buf_size, 1);
+    }
+
+    pthread_setspecific(mlog_pkey, data);
+
+    return data;
+}
+
+
+static inline mlog_atomic_t
+mlog_decrease_refer(mlog_thread_local_data_t *data)
+{
+    return __sync_fetch_and_add(&data->refer, -1);
+}
+
+
+static void
+mlog_decrease_refer_and_try_release(mlog_thread_local_data_t *data)
+{
+    mlog_atomic_t  old_refer = mlog_decrease_refer(data);
+
+    MLOG_DEBUG("tid=%d refer=%lu old_refer=%lu",
+               data->tid, data->refer, old_refer);
+
+    if (old_refer == 1) {
+        MLOG_DEBUG("clear thread %d data", data->tid);
+        pthread_mutex_lock(&thread_data.mutex);
+        hash_remove_link(thread_data.table, &data->hlnk);
+        __atomic_add_fetch(&thread_data.generation, 1, __ATOMIC_RELEASE);
+        mlog_ring_fold(data);
+        mlog_ring_free(data);
+        pthread_mutex_unlock(&thread_data.mutex);
+    }
+}
+
+
+/* drops the owner's refer, under thread_data.mutex */
+
+static void
+mlog_ring_disown(mlog_thread_local_data_t *data)
+{
+    mlog_atomic_t  old_refer;
+
+    old_refer = mlog_decrease_refer(data);
+
+    MLOG_DEBUG("tid %d refer=%lu old_refer=%lu",
+               data->tid, data->refer, old_refer);
+
+    if (old_refer == 1) {
+        MLOG_DEBUG("clear thread %d data", data->tid);
+        hash_remove_link(thread_data.table, &data->hlnk);
+        __atomic_add_fetch(&thread_data.generation, 1, __ATOMIC_RELEASE);
+        mlog_ring_fold(data);
+        mlog_ring_free(data);
+    }
+}
+
+
+/* execute after thread func exit */
+static void
+mlog_destroy_pkey()
+{
+    pid_t                        tid = mlog_thread_tid();
+    mlog_thread_local_data_t    *data, *sig;
+
+    if (thread_data.table == NULL) {
+        return;
+    }
+
+    /* a handler running from here on drops its line */
+
+    sig = mlog_sig_data;
+    __atomic_store_n(&mlog_sig_data, NULL, __ATOMIC_RELAXED);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&thread_data.mutex);
+
+    if (sig) {
+        mlog_ring_disown(sig);
+    }
+
+    data = hash_lookup(thread_data.table, &tid);
+    if (data) {
+        mlog_ring_disown(data);
+    }
+
+    pthread_mutex_unlock(&thread_data.mutex);
+}
+
+
+static unsigned int
+mlog_tid_hash(const void *key, unsigned int size)
+{
+    pid_t  tid = *(pid_t *) key;
+
+    return tid % size;
+}
+
+
+static int
+mlog_tid_hash_cmp(const void *a, const void *b)
+{
+    pid_t  tid_a = *(pid_t *) a;
+    pid_t  tid_b = *(pid_t *) b;
 
     if (tid_a > tid_b) {
         return 1;
 
-    } else if (tid_a < tid_b) {
-        return -1;
+    } else if (tid_a < tid_b) {
+        return -1;
+
+    } else {
+        return 0;
+    }
+}
+
+
+/* "0-3,8" as in /sys/devices/system/node/node0/cpulist */
+
+static int
+mlog_parse_cpus(const char *list, cpu_set_t *set)
+{
+    long   from, to;
+    char  *end;
+
+    for ( ;; ) {
+        from = strtol(list, &end, 10);
+        if (end == list || from < 0) {
+            return -1;
+        }
+
+        to = from;
+
+        if (*end == '-') {
+            list = end + 1;
+            to = strtol(list, &end, 10);
+
+            if (end == list || to < from) {
+                return -1;
+            }
+        }
+
+        if (to >= CPU_SETSIZE) {
+            return -1;
+        }
+
+        for ( /* void */ ; from <= to; from++) {
+            CPU_SET(from, set);
+        }
+
+        if (*end == '\0' || *end == '\n') {
+            return 0;
+        }
+
+        if (*end != ',') {
+            return -1;
+        }
+
+        list = end + 1;
+    }
+}
+
+
+/* writer_cpus wins over writer_node, neither leaves the writer free */
+
+static int
+mlog_writer_affinity(const mlog_conf_t *conf, pthread_attr_t *attr)
+{
+    int        fd;
+    char       path[64], buf[1024];
+    ssize_t    n;
+    cpu_set_t  set;
+
+    CPU_ZERO(&set);
+
+    if (conf->writer_cpus) {
+        if (mlog_parse_cpus(conf->writer_cpus, &set) != 0) {
+            MLOG_ERROR("writer_cpus \"%s\" invalid", conf->writer_cpus);
+            return -1;
+        }
+
+    } else if (conf->writer_node >= 0) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                 conf->writer_node);
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            MLOG_ERROR("open %s failed errno=%d", path, errno);
+            return -1;
+        }
+
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+
+        if (n <= 0) {
+            MLOG_ERROR("read %s failed errno=%d", path, errno);
+            return -1;
+        }
+
+        buf[n] = '\0';
+
+        if (mlog_parse_cpus(buf, &set) != 0) {
+            MLOG_ERROR("cpulist of node %d invalid", conf->writer_node);
+            return -1;
+        }
 
     } else {
         return 0;
     }
+
+    if (pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &set) != 0) {
+        MLOG_ERROR("set writer affinity failed");
+        return -1;
+    }
+
+    return 0;
 }
 
 
-int
-mlog_inner_init(const char *filename, unsigned int buf_size)
+static int
+mlog_open_stats(const char *filename)
+{
+    int    fd;
+    void  *map;
+
+    fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        MLOG_ERROR("open stats file %s failed errno=%d", filename, errno);
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(mlog_stats_t)) != 0) {
+        MLOG_ERROR("size stats file %s failed errno=%d", filename, errno);
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, sizeof(mlog_stats_t), PROT_READ|PROT_WRITE, MAP_SHARED,
+               fd, 0);
+
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        MLOG_ERROR("mmap stats file %s failed errno=%d", filename, errno);
+        return -1;
+    }
+
+    async_job.stats_map = map;
+    async_job.stats_msec = 0;
+
+    return 0;
+}
+
+
+/* only sets flags and writes the eventfd, so a signal handler may call it */
+
+void
+mlog_inner_reopen()
+{
+    int       err = errno;
+    uint64_t  one = 1;
+
+    if (async_job.wake_fd < 0) {
+        return;
+    }
+
+    __atomic_store_n(&async_job.reopen, 1, __ATOMIC_RELEASE);
+    __atomic_or_fetch(&async_job.flush, MLOG_FLUSH_BATCH, __ATOMIC_SEQ_CST);
+
+    if (write(async_job.wake_fd, &one, sizeof(one)) < 0) {
+        /* void */
+    }
+
+    errno = err;
+}
+
+
+static void
+mlog_reopen_handler(int signo)
+{
+    (void) signo;
+
+    mlog_inner_reopen();
+}
+
+
+/*
+ * The handler that was there before takes the signal raised again, and a
+ * fault in the drain too; a fault re-raises itself on return.
+ */
+
+static void
+mlog_fatal_handler(int signo)
+{
+    int  i;
+
+    for (i = 0; i < MLOG_FATAL_SIGNALS; i++) {
+        if (mlog_fatal_signals[i] == signo) {
+            sigaction(signo, &async_job.fatal_sa[i], NULL);
+        }
+    }
+
+    (void) mlog_inner_crash_flush();
+
+    raise(signo);
+}
+
+
+static void
+mlog_fatal_install()
 {
-    int ret;
+    int               i;
+    struct sigaction  sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = mlog_fatal_handler;
+    sa.sa_flags = SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+
+    for (i = 0; i < MLOG_FATAL_SIGNALS; i++) {
+        if (sigaction(mlog_fatal_signals[i], &sa, &async_job.fatal_sa[i])
+            != 0)
+        {
+            MLOG_ERROR("sigaction %d failed errno=%d", mlog_fatal_signals[i],
+                       errno);
+
+            while (i-- > 0) {
+                sigaction(mlog_fatal_signals[i], &async_job.fatal_sa[i], NULL);
+            }
+
+            return;
+        }
+    }
 
-    if (buf_size & (buf_size - 1)) {
+    async_job.fatal_flush = 1;
+}
+
+
+int
+mlog_inner_init(const mlog_conf_t *conf)
+{
+    int               ret, i, spill = 0;
+    size_t            size;
+    unsigned int      buf_size = conf->buf_size;
+    unsigned int      spill_size = conf->spill_size;
+    pthread_attr_t    attr;
+    struct sigaction  sa;
+
+    if (buf_size == 0 || (buf_size & (buf_size - 1))) {
         MLOG_ERROR("buf_size must be 2^n, invalid %d", buf_size);
         goto _fail;
     }
 
+    if (conf->batch_count == 0 || conf->batch_count > IOV_MAX
+        || conf->batch_bytes < MLOG_MAX_LOG_LEN)
+    {
+        MLOG_ERROR("batch_count %u or batch_bytes %u invalid",
+                   conf->batch_count, conf->batch_bytes);
+        goto _fail;
+    }
+
+    if (conf->order != MLOG_ORDER_GLOBAL && conf->order != MLOG_ORDER_THREAD
+        && conf->order != MLOG_ORDER_WINDOW)
+    {
+        MLOG_ERROR("order %d invalid", conf->order);
+        goto _fail;
+    }
+
+    /* a line the writer formats must fit next to its dictionary entries */
+
+    if (conf->output == MLOG_OUTPUT_BINARY
+        && conf->batch_bytes < 2 * MLOG_MAX_LOG_LEN)
+    {
+        MLOG_ERROR("binary output needs batch_bytes >= %u",
+                   2 * MLOG_MAX_LOG_LEN);
+        goto _fail;
+    }
+
+    if (conf->compress != MLOG_COMPRESS_NONE
+        && conf->compress != MLOG_COMPRESS_GZIP)
+    {
+        MLOG_ERROR("compress %d invalid", conf->compress);
+        goto _fail;
+    }
+
+#ifndef MLOG_WITH_ZLIB
+    if (conf->compress == MLOG_COMPRESS_GZIP) {
+        MLOG_ERROR("gzip output needs a build with MLOG_WITH_ZLIB");
+        goto _fail;
+    }
+#endif
+
+    if (conf->io != MLOG_IO_WRITE && conf->io != MLOG_IO_MMAP
+        && conf->io != MLOG_IO_URING)
+    {
+        MLOG_ERROR("io %d invalid", conf->io);
+        goto _fail;
+    }
+
+    if (conf->io == MLOG_IO_URING && conf->uring_depth == 0) {
+        MLOG_ERROR("uring_depth must not be 0");
+        goto _fail;
+    }
+
+    if (conf->io == MLOG_IO_MMAP && conf->mmap_window == 0) {
+        MLOG_ERROR("mmap_window must not be 0");
+        goto _fail;
+    }
+
+    async_job.io = conf->io;
+    async_job.map_size = (conf->mmap_window + getpagesize() - 1)
+                         & ~((size_t) getpagesize() - 1);
+
+    if (conf->idle < MLOG_IDLE_BLOCK || conf->idle > MLOG_IDLE_PARK) {
+        MLOG_ERROR("idle strategy %d invalid", conf->idle);
+        goto _fail;
+    }
+
+    async_job.idle = conf->idle;
+    async_job.idle_spin = conf->idle_spin * 1000UL;
+    async_job.idle_park = conf->idle_park;
+
+    if (conf->flush_level < MLOG_LEVEL_ERROR
+        || conf->flush_level > MLOG_LEVEL_DEBUG)
+    {
+        MLOG_ERROR("flush level %d invalid", conf->flush_level);
+        goto _fail;
+    }
+
+    async_job.flush_nsec = conf->flush_usec * 1000UL;
+    async_job.flush_level = conf->flush_level;
+    async_job.flush_bytes = conf->flush_bytes;
+
+    if (async_job.flush_bytes == 0
+        || async_job.flush_bytes > conf->batch_bytes)
+    {
+        async_job.flush_bytes = conf->batch_bytes;
+    }
+
+    async_job.flush = 0;
+    async_job.urgent = 0;
+
+    async_job.overwrite = 0;
+
+    for (i = MLOG_LEVEL_ERROR; i <= MLOG_LEVEL_DEBUG; i++) {
+        if (conf->overflow[i] < MLOG_OVERFLOW_DROP
+            || conf->overflow[i] > MLOG_OVERFLOW_SPILL)
+        {
+            MLOG_ERROR("overflow policy %d of level %d invalid",
+                       conf->overflow[i], i);
+            goto _fail;
+        }
+
+        async_job.overflow[i] = conf->overflow[i];
+        async_job.overwrite |= conf->overflow[i] == MLOG_OVERFLOW_OVERWRITE;
+        spill |= conf->overflow[i] == MLOG_OVERFLOW_SPILL;
+    }
+
+    async_job.shedding = 0;
+
+    for (i = MLOG_LEVEL_ERROR; i <= MLOG_LEVEL_DEBUG; i++) {
+        if (conf->watermark[i] == 0 || conf->watermark[i] > 100) {
+            MLOG_ERROR("watermark %u%% of level %d invalid",
+                       conf->watermark[i], i);
+            goto _fail;
+        }
+
+        async_job.watermark[i] = conf->watermark[i];
+        async_job.shedding |= conf->watermark[i] < 100;
+    }
+
+    if (spill_size == 0) {
+        spill_size = buf_size * 4;
+    }
+
+    if (spill && (spill_size & (spill_size - 1))) {
+        MLOG_ERROR("spill_size must be 2^n, invalid %u", spill_size);
+        goto _fail;
+    }
+
+    if (conf->sig_buf_size & (conf->sig_buf_size - 1)) {
+        MLOG_ERROR("sig_buf_size must be 2^n, invalid %u",
+                   conf->sig_buf_size);
+        goto _fail;
+    }
+
+    /* binary output only makes sense of a whole file */
+
+    if (conf->nsinks > MLOG_MAX_SINKS
+        || (conf->nsinks && conf->output != MLOG_OUTPUT_TEXT))
+    {
+        MLOG_ERROR("%u sinks invalid, at most %d and text output only",
+                   conf->nsinks, MLOG_MAX_SINKS);
+        goto _fail;
+    }
+
     thread_data.table = hash_create(mlog_tid_hash_cmp, 103, mlog_tid_hash);
     if (thread_data.table == NULL) {
         MLOG_ERROR("create thread_data failed");
@@ -524,35 +4050,263 @@ mlog_inner_init(const char *filename, unsigned int buf_size)
     }
 
     thread_data.kfifo_buf_size = buf_size;
+    thread_data.sig_buf_size = conf->sig_buf_size;
+
+    /* the crashed run's kfifos join the table before any of this run */
+
+    if (conf->crash_file) {
+        mlog_crash_recover(conf->crash_file);
+
+        if (mlog_crash_create(conf->crash_file, conf->crash_slots, buf_size,
+                              spill ? spill_size : 0) != 0)
+        {
+            goto _fail;
+        }
+    }
+
+    async_job.iov = calloc(conf->batch_count, sizeof(struct iovec));
+    async_job.fmt_buf = malloc(conf->batch_bytes);
+    if (async_job.iov == NULL || async_job.fmt_buf == NULL) {
+        MLOG_ERROR("alloc batch of %u/%u failed",
+                   conf->batch_count, conf->batch_bytes);
+        goto _fail;
+    }
 
-    async_job.fd = open(filename, O_WRONLY|O_APPEND|O_CREAT, 0644);
+#ifdef MLOG_LATENCY
+    async_job.stamps = calloc(conf->batch_count, sizeof(unsigned long));
+    if (async_job.stamps == NULL) {
+        MLOG_ERROR("alloc latency stamps failed");
+        goto _fail;
+    }
+#endif
+
+    if (conf->nsinks) {
+        async_job.levels = malloc(conf->batch_count);
+        if (async_job.levels == NULL) {
+            MLOG_ERROR("alloc sink levels failed");
+            goto _fail;
+        }
+    }
+
+    async_job.batch_bytes = conf->batch_bytes;
+    async_job.batch_count = conf->batch_count;
+    async_job.order = conf->order;
+    async_job.reorder_window = conf->reorder_window;
+    async_job.output = conf->output;
+
+    if (conf->output == MLOG_OUTPUT_BINARY
+        && mlog_bin_dict_init(&async_job.bin) != 0)
+    {
+        MLOG_ERROR("alloc binary dictionary failed");
+        goto _fail;
+    }
+
+    async_job.compress = conf->compress;
+
+#ifdef MLOG_WITH_ZLIB
+    if (conf->compress == MLOG_COMPRESS_GZIP
+        && mlog_gz_init(&async_job.gz, conf->compress_level,
+                        conf->batch_bytes) != 0)
+    {
+        MLOG_ERROR("init gzip level %d failed", conf->compress_level);
+        goto _fail;
+    }
+#endif
+
+    async_job.batch_fsync = conf->batch_fsync;
+
+    /* a buffer holds a batch, or the gzip member made of it */
+
+    if (async_job.io == MLOG_IO_URING) {
+        size = conf->batch_bytes;
+#ifdef MLOG_WITH_ZLIB
+        if (conf->compress == MLOG_COMPRESS_GZIP) {
+            size = async_job.gz.size;
+        }
+#endif
+
+        if (mlog_uring_init(&async_job.uring, conf->uring_depth, size,
+                            conf->batch_fsync) != 0)
+        {
+            MLOG_ERROR("io_uring unavailable errno=%d, using writev()",
+                       errno);
+            async_job.io = MLOG_IO_WRITE;
+        }
+    }
+
+    /* the writer merges the arena like any other kfifo */
+
+    if (spill) {
+        async_job.spill = mlog_ring_create(getpid(), 0, spill_size, 0);
+        if (async_job.spill == NULL) {
+            MLOG_ERROR("create spill arena of %u failed", spill_size);
+            goto _fail;
+        }
+    }
+
+    async_job.fd = mlog_open_file(conf->filename, 0);
     if (async_job.fd < 0) {
-        MLOG_ERROR("open file %s failed", filename);
+        MLOG_ERROR("open file %s failed", conf->filename);
+        goto _fail;
+    }
+
+    async_job.filename = conf->filename;
+    mlog_switch_file(async_job.fd);
+
+    async_job.rotate_size = conf->rotate_size;
+    async_job.rotate_interval = conf->rotate_interval;
+    async_job.rotate_keep = conf->rotate_keep;
+
+    if (conf->rotate_size || conf->rotate_interval) {
+        if (conf->rotate_keep == 0) {
+            MLOG_ERROR("rotate_keep must be 1 at least");
+            goto _fail;
+        }
+
+        if ((size_t) snprintf(async_job.next_path, PATH_MAX, "%s.next",
+                              conf->filename) >= PATH_MAX)
+        {
+            MLOG_ERROR("file name %s too long", conf->filename);
+            goto _fail;
+        }
+
+        mlog_prepare_next();
+
+        if (conf->rotate_interval) {
+            async_job.rotate_sec = (time(NULL) / conf->rotate_interval + 1)
+                                   * conf->rotate_interval;
+        }
+    }
+
+    if (conf->stats_file && mlog_open_stats(conf->stats_file) != 0) {
+        goto _fail;
+    }
+
+    async_job.wake_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (async_job.wake_fd < 0) {
+        MLOG_ERROR("eventfd failed errno=%d", errno);
         goto _fail;
     }
 
-    async_job.filename = filename;
+    for (async_job.nsinks = 0; async_job.nsinks < conf->nsinks;
+         async_job.nsinks++)
+    {
+        if (mlog_sink_init(&async_job.sinks[async_job.nsinks],
+                           &conf->sinks[async_job.nsinks]) != 0)
+        {
+            goto _fail;
+        }
+    }
+
+    async_job.start_msec = mlog_now_msec();
+    async_job.reopen = 0;
     async_job.active = 1;
 
-    ret = pthread_create(&async_job.tid, NULL, mlog_async_write_log, NULL);
+    mlog_crash_tz();
+
+    pthread_attr_init(&attr);
+
+    if (mlog_writer_affinity(conf, &attr) != 0) {
+        pthread_attr_destroy(&attr);
+        goto _fail;
+    }
+
+    ret = pthread_create(&async_job.tid, &attr, mlog_async_write_log, NULL);
+
+    pthread_attr_destroy(&attr);
+
     if (ret != 0) {
         MLOG_ERROR("create async job failed, ret=%d", ret);
         goto _fail;
     }
 
+    async_job.reopen_signal = conf->reopen_signal;
+
+    if (conf->reopen_signal) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = mlog_reopen_handler;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+
+        if (sigaction(conf->reopen_signal, &sa, &async_job.reopen_sa) != 0) {
+            MLOG_ERROR("sigaction %d failed errno=%d", conf->reopen_signal,
+                       errno);
+            async_job.reopen_signal = 0;
+        }
+    }
+
+    if (conf->fatal_flush) {
+        mlog_fatal_install();
+    }
+
     return 0;
 
 _fail:
 
+    mlog_uring_free(&async_job.uring);
+
+    while (async_job.nsinks) {
+        mlog_sink_free(&async_job.sinks[--async_job.nsinks]);
+    }
+
+    free(async_job.levels);
+    async_job.levels = NULL;
+
+    if (async_job.spill) {
+        pthread_mutex_lock(&thread_data.mutex);
+        hash_remove_link(thread_data.table, &async_job.spill->hlnk);
+        mlog_ring_free(async_job.spill);
+        pthread_mutex_unlock(&thread_data.mutex);
+        async_job.spill = NULL;
+    }
+
     if (thread_data.table) {
+        mlog_crash_forget();
         hashFreeMemory(thread_data.table);
+        thread_data.table = NULL;
     }
 
+    free(async_job.iov);
+    async_job.iov = NULL;
+    free(async_job.fmt_buf);
+    async_job.fmt_buf = NULL;
+#ifdef MLOG_LATENCY
+    free(async_job.stamps);
+    async_job.stamps = NULL;
+#endif
+    mlog_bin_dict_free(&async_job.bin);
+#ifdef MLOG_WITH_ZLIB
+    mlog_gz_free(&async_job.gz);
+#endif
+
     if (async_job.fd >= 0) {
         close(async_job.fd);
         async_job.fd = -1;
     }
 
+    if (async_job.next_fd >= 0) {
+        close(async_job.next_fd);
+        unlink(async_job.next_path);
+        async_job.next_fd = -1;
+    }
+
+    if (async_job.wake_fd >= 0) {
+        close(async_job.wake_fd);
+        async_job.wake_fd = -1;
+    }
+
+    if (async_job.stats_map) {
+        munmap(async_job.stats_map, sizeof(mlog_stats_t));
+        async_job.stats_map = NULL;
+    }
+
+    if (async_job.crash_fd >= 0) {
+        munmap(async_job.crash, async_job.crash_size);
+        close(async_job.crash_fd);
+        async_job.crash_fd = -1;
+        async_job.crash = NULL;
+    }
+
     async_job.active = 0;
 
     return -1;
@@ -562,15 +4316,50 @@ _fail:
 void
 mlog_inner_uinit()
 {
-    async_job.active = 0;
+    int       i;
+    uint64_t  one = 1;
 
-    __sync_synchronize();
+    if (async_job.wake_fd < 0) {
+        return;
+    }
+
+    if (async_job.reopen_signal) {
+        sigaction(async_job.reopen_signal, &async_job.reopen_sa, NULL);
+        async_job.reopen_signal = 0;
+    }
+
+    if (async_job.fatal_flush) {
+        for (i = 0; i < MLOG_FATAL_SIGNALS; i++) {
+            sigaction(mlog_fatal_signals[i], &async_job.fatal_sa[i], NULL);
+        }
+
+        async_job.fatal_flush = 0;
+    }
+
+    async_job.active = 0;
 
-    if (pthread_cond_signal(&async_job.cond) != 0) {
-        MLOG_ERROR("pthread_cond_signal failed");
+    if (write(async_job.wake_fd, &one, sizeof(one)) < 0) {
+        MLOG_ERROR("wake writer failed errno=%d", errno);
     }
 
     if (pthread_join(async_job.tid, NULL) != 0) {
         MLOG_ERROR("wait async job exit failed");
     }
+
+    close(async_job.wake_fd);
+    async_job.wake_fd = -1;
+
+    /* threads alive still own slots, the file stays mapped for them */
+
+    if (async_job.crash_fd >= 0) {
+        close(async_job.crash_fd);
+        async_job.crash_fd = -1;
+    }
+
+    /* the writer dropped its refer on the arena, this is the owner's */
+
+    if (async_job.spill) {
+        mlog_decrease_refer_and_try_release(async_job.spill);
+        async_job.spill = NULL;
+    }
 }
@@ -2,12 +2,19 @@
 #define __M_LOG_INNER_H__
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <sys/syscall.h>
+#include "mlog.h"
 
 
 #define MLOG_MAX_LOG_LEN    2048
 
+/* what a kfifo record holds */
+#define MLOG_RECORD_TEXT        0   /* a formatted line */
+#define MLOG_RECORD_DEFERRED    1   /* mlog_fmt_site_t and raw arguments */
+#define MLOG_RECORD_PAD         2   /* skipped, runs to the buffer end */
+
 #define MLOG_ERROR(fmt, args...) \
     do { \
         dprintf(2, "ERROR:tid[%d] %s#%d: " fmt "\n", mlog_thread_tid(), __func__, __LINE__, ## args); \
@@ -29,11 +36,30 @@ mlog_thread_tid()
     return syscall(SYS_gettid);
 }
 
-int mlog_inner_init(const char *filename, unsigned int buf_size);
+int mlog_inner_init(const mlog_conf_t *conf);
 void mlog_inner_uinit();
+int mlog_inner_stats(mlog_stats_t *stats);
+int mlog_inner_latency(mlog_latency_t *queue, mlog_latency_t *producer);
+int mlog_inner_flush();
+int mlog_inner_crash_flush();
+void mlog_inner_reopen();
 int mlog_get_pid_and_tid(pid_t *pid, pid_t *tid);
-int mlog_post_log_task(unsigned long msec, unsigned char *buf,
+int mlog_post_log_task(unsigned long msec, int level, unsigned char *buf,
+    unsigned int len);
+unsigned char *mlog_reserve_log_buf(unsigned int *len);
+int mlog_shed(int level);
+#ifdef MLOG_LATENCY
+unsigned long mlog_latency_begin();
+void mlog_latency_end(unsigned long start);
+#endif
+void mlog_site_report();
+mlog_site_t *mlog_site_section(unsigned long *n);
+unsigned int mlog_site_reporting_count();
+int mlog_commit_log_buf(unsigned long msec, int level, int type,
     unsigned int len);
+int mlog_inner_sig_log(const mlog_site_t *desc, const char *fmt,
+    va_list args);
+int mlog_inner_sig_register();
 
 
 #endif /* __M_LOG_INNER_H__ */
@@ -0,0 +1,474 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "mlog_inner.h"
+#include "mlog_sink.h"
+
+
+#define MLOG_SINK_RETRY         1000    /* msec between connects */
+#define MLOG_SINK_SEND_WAIT     100     /* msec a send may block at once */
+
+
+static unsigned long
+mlog_sink_msec()
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void
+mlog_sink_wake(mlog_sink_t *sink)
+{
+    __atomic_fetch_add(&sink->wake, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &sink->wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+
+/* msec 0 waits until woken */
+
+static void
+mlog_sink_sleep(mlog_sink_t *sink, int wake, unsigned long msec)
+{
+    struct timespec  ts, *tp = NULL;
+
+    if (msec) {
+        ts.tv_sec = msec / 1000;
+        ts.tv_nsec = msec % 1000 * 1000000;
+        tp = &ts;
+    }
+
+    syscall(SYS_futex, &sink->wake, FUTEX_WAIT_PRIVATE, wake, tp, NULL, 0);
+}
+
+
+static void
+mlog_sink_close(mlog_sink_t *sink)
+{
+    if (sink->fd >= 0 && sink->type != MLOG_SINK_STDERR) {
+        close(sink->fd);
+    }
+
+    sink->fd = -1;
+}
+
+
+/* opens the file or connects to the collector, -1 with errno if not now */
+
+static int
+mlog_sink_open(mlog_sink_t *sink)
+{
+    int                  fd, err, type;
+    struct timeval       tv;
+    struct sockaddr_un   addr;
+
+    if (sink->type == MLOG_SINK_STDERR) {
+        sink->fd = STDERR_FILENO;
+        return 0;
+    }
+
+    if (sink->type == MLOG_SINK_FILE) {
+        fd = open(sink->path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return -1;
+        }
+
+        sink->fd = fd;
+        return 0;
+    }
+
+    type = sink->type == MLOG_SINK_UNIX_DGRAM ? SOCK_DGRAM : SOCK_STREAM;
+
+    fd = socket(AF_UNIX, type|SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* a collector that stops reading must not hold mlog_uinit() forever */
+
+    tv.tv_sec = 0;
+    tv.tv_usec = MLOG_SINK_SEND_WAIT * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sink->path);
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    sink->fd = fd;
+
+    return 0;
+}
+
+
+/* the len bytes at pos of a kfifo, in two pieces if it is not mirrored */
+
+static int
+mlog_sink_span(struct kfifo *q, unsigned int pos, unsigned int len,
+    struct iovec *iov)
+{
+    unsigned int  off = pos & (q->size - 1);
+
+    iov[0].iov_base = q->buffer + off;
+    iov[0].iov_len = len;
+
+    if (q->mirrored || off + len <= q->size) {
+        return 1;
+    }
+
+    iov[0].iov_len = q->size - off;
+    iov[1].iov_base = q->buffer;
+    iov[1].iov_len = len - iov[0].iov_len;
+
+    return 2;
+}
+
+
+/*
+ * Writes a datagram or what is queued for the others, returns the bytes
+ * done with: the ones written, or all of them if they failed for good.
+ */
+
+static ssize_t
+mlog_sink_write(mlog_sink_t *sink, unsigned int len)
+{
+    int             cnt;
+    ssize_t         n;
+    uint32_t        dlen;
+    unsigned int    i, pos, total = len, frame = 0;
+    struct iovec    iov[2];
+    struct msghdr   msg;
+    struct kfifo   *q = sink->queue;
+
+    pos = q->out;
+
+    if (sink->type == MLOG_SINK_UNIX_DGRAM) {
+        cnt = mlog_sink_span(q, pos, sizeof(uint32_t), iov);
+
+        for (i = 0; i < (unsigned int) cnt; i++) {
+            memcpy((unsigned char *) &dlen + frame, iov[i].iov_base,
+                   iov[i].iov_len);
+            frame += iov[i].iov_len;
+        }
+
+        pos += frame;
+        len = dlen;
+    }
+
+    cnt = mlog_sink_span(q, pos, len, iov);
+
+    if (sink->type == MLOG_SINK_FILE || sink->type == MLOG_SINK_STDERR) {
+        n = writev(sink->fd, iov, cnt);
+
+    } else {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+
+        n = sendmsg(sink->fd, &msg, MSG_NOSIGNAL);
+    }
+
+    if (n >= 0) {
+        return frame + n;
+    }
+
+    if (errno == EINTR) {
+        return 0;
+    }
+
+    /* the collector is slow, try again unless mlog_uinit() waits */
+
+    if ((errno == EAGAIN || errno == EWOULDBLOCK)
+        && !__atomic_load_n(&sink->stop, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+
+    sink->errors++;
+
+    /* a socket connects again, the lost lines end at a line boundary */
+
+    if (sink->type == MLOG_SINK_UNIX_DGRAM
+        || sink->type == MLOG_SINK_UNIX_STREAM)
+    {
+        mlog_sink_close(sink);
+    }
+
+    /* stopping, the rest would only fail the same way one by one */
+
+    if (__atomic_load_n(&sink->stop, __ATOMIC_ACQUIRE)) {
+        return total;
+    }
+
+    return frame + len;
+}
+
+
+static void *
+mlog_sink_thread(void *arg)
+{
+    int             wake, stop;
+    ssize_t         n;
+    unsigned int    in;
+    unsigned long   now, retry = 0;
+    mlog_sink_t    *sink = arg;
+    struct kfifo   *q = sink->queue;
+
+    for ( ;; ) {
+        wake = __atomic_load_n(&sink->wake, __ATOMIC_ACQUIRE);
+        stop = __atomic_load_n(&sink->stop, __ATOMIC_ACQUIRE);
+
+        if (__atomic_exchange_n(&sink->reopen, 0, __ATOMIC_ACQUIRE)) {
+            mlog_sink_close(sink);
+            retry = 0;
+        }
+
+        in = __atomic_load_n(&q->in, __ATOMIC_ACQUIRE);
+
+        if (in == q->out) {
+            if (stop) {
+                break;
+            }
+
+            /* pairs with the writer reading "parked" in mlog_sink_put() */
+
+            __atomic_store_n(&sink->parked, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+            if (__atomic_load_n(&q->in, __ATOMIC_RELAXED) == in) {
+                mlog_sink_sleep(sink, wake, 0);
+            }
+
+            __atomic_store_n(&sink->parked, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (sink->fd < 0) {
+            now = mlog_sink_msec();
+
+            if ((now >= retry || stop) && mlog_sink_open(sink) != 0) {
+                retry = now + MLOG_SINK_RETRY;
+            }
+
+            /* the lines of a collector that never came up are lost */
+
+            if (sink->fd < 0 && stop) {
+                sink->errors++;
+                kfifo_consume(q, in - q->out);
+                break;
+            }
+
+            if (sink->fd < 0) {
+                mlog_sink_sleep(sink, wake, retry - now);
+                continue;
+            }
+        }
+
+        n = mlog_sink_write(sink, in - q->out);
+        if (n > 0) {
+            kfifo_consume(q, n);
+        }
+    }
+
+    return NULL;
+}
+
+
+int
+mlog_sink_init(mlog_sink_t *sink, const mlog_sink_conf_t *conf)
+{
+    int                  ret;
+    unsigned int         size = conf->buf_size;
+    struct sockaddr_un   addr;
+
+    memset(sink, 0, sizeof(mlog_sink_t));
+    sink->fd = -1;
+
+    if (conf->type < MLOG_SINK_FILE || conf->type > MLOG_SINK_UNIX_STREAM) {
+        MLOG_ERROR("sink type %d invalid", conf->type);
+        return -1;
+    }
+
+    if (conf->level < MLOG_LEVEL_ERROR || conf->level > MLOG_LEVEL_DEBUG) {
+        MLOG_ERROR("sink level %d invalid", conf->level);
+        return -1;
+    }
+
+    if (conf->type != MLOG_SINK_STDERR
+        && (conf->path == NULL
+            || (conf->type != MLOG_SINK_FILE
+                && strlen(conf->path) >= sizeof(addr.sun_path))))
+    {
+        MLOG_ERROR("sink path %s invalid", conf->path ? conf->path : "NULL");
+        return -1;
+    }
+
+    if (size == 0) {
+        size = MLOG_DEFAULT_SINK_BUF_SIZE;
+    }
+
+    if (size & (size - 1)) {
+        MLOG_ERROR("sink buf_size must be 2^n, invalid %u", size);
+        return -1;
+    }
+
+    sink->type = conf->type;
+    sink->path = conf->path;
+    sink->level = conf->level;
+
+    /* a socket may connect later, the collector need not be up yet */
+
+    if (mlog_sink_open(sink) != 0 && sink->type == MLOG_SINK_FILE) {
+        MLOG_ERROR("open sink file %s failed errno=%d", sink->path, errno);
+        return -1;
+    }
+
+    sink->queue = kfifo_alloc(size);
+    if (sink->queue == NULL) {
+        MLOG_ERROR("alloc sink queue of %u failed", size);
+        goto failed;
+    }
+
+    ret = pthread_create(&sink->tid, NULL, mlog_sink_thread, sink);
+    if (ret != 0) {
+        MLOG_ERROR("create sink thread failed, ret=%d", ret);
+        goto failed;
+    }
+
+    return 0;
+
+failed:
+
+    if (sink->queue) {
+        kfifo_free(sink->queue);
+        sink->queue = NULL;
+    }
+
+    mlog_sink_close(sink);
+
+    return -1;
+}
+
+
+/* writes out what is queued, as far as the sink takes it, and stops */
+
+void
+mlog_sink_free(mlog_sink_t *sink)
+{
+    if (sink->queue == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&sink->stop, 1, __ATOMIC_SEQ_CST);
+    mlog_sink_wake(sink);
+
+    pthread_join(sink->tid, NULL);
+
+    kfifo_free(sink->queue);
+    sink->queue = NULL;
+
+    mlog_sink_close(sink);
+}
+
+
+static inline void
+mlog_sink_copy(struct kfifo *q, unsigned int pos, const void *buf,
+    unsigned int len)
+{
+    unsigned int  off, l;
+
+    off = pos & (q->size - 1);
+    l = len < q->size - off ? len : q->size - off;
+
+    memcpy(q->buffer + off, buf, l);
+    memcpy(q->buffer, (const unsigned char *) buf + l, len - l);
+}
+
+
+/*
+ * Called by the writer with each batch, levels[] holds the level of each
+ * line. Never waits for the sink, what finds its queue full is dropped.
+ */
+
+void
+mlog_sink_put(mlog_sink_t *sink, const struct iovec *iov,
+    const unsigned char *levels, int cnt)
+{
+    int            i;
+    uint32_t       len;
+    unsigned int   room, need, used = 0, frame = 0;
+    struct kfifo  *q = sink->queue;
+
+    if (sink->type == MLOG_SINK_UNIX_DGRAM) {
+        frame = sizeof(uint32_t);
+    }
+
+    room = q->size - (q->in - __atomic_load_n(&q->out, __ATOMIC_ACQUIRE));
+
+    for (i = 0; i < cnt; i++) {
+        if (levels[i] > sink->level) {
+            continue;
+        }
+
+        need = frame + iov[i].iov_len;
+
+        if (room - used < need) {
+            sink->dropped++;
+            continue;
+        }
+
+        if (frame) {
+            len = iov[i].iov_len;
+            mlog_sink_copy(q, q->in + used, &len, frame);
+        }
+
+        mlog_sink_copy(q, q->in + used + frame, iov[i].iov_base,
+                       iov[i].iov_len);
+
+        used += need;
+        sink->lines++;
+    }
+
+    if (used == 0) {
+        return;
+    }
+
+    kfifo_commit(q, used);
+
+    /* pairs with the thread setting "parked" before it sleeps */
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&sink->parked, __ATOMIC_RELAXED)) {
+        mlog_sink_wake(sink);
+    }
+}
+
+
+/* after mlog_reopen(), the file is opened and a socket connected again */
+
+void
+mlog_sink_reopen(mlog_sink_t *sink)
+{
+    __atomic_store_n(&sink->reopen, 1, __ATOMIC_RELEASE);
+    mlog_sink_wake(sink);
+}
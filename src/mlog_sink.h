@@ -0,0 +1,43 @@
+#ifndef __M_LOG_SINK_H__
+#define __M_LOG_SINK_H__
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "util/kfifo.h"
+#include "mlog.h"
+
+
+/*
+ * A sink has a kfifo the writer copies the lines of each batch into and a
+ * thread of its own that writes them out, so a slow one never holds up
+ * the file or the other sinks: its kfifo fills and the writer drops what
+ * does not fit. A datagram sink queues each line behind its length, to
+ * send one line per datagram.
+ */
+
+typedef struct {
+    int                 type;           /* MLOG_SINK_* */
+    const char         *path;
+    int                 level;
+    int                 fd;             /* -1 while not connected */
+    struct kfifo       *queue;          /* the writer puts, the thread gets */
+    pthread_t           tid;
+    int                 parked;         /* the thread waits for lines */
+    int                 wake;           /* bumped to wake it, its futex */
+    int                 stop;
+    int                 reopen;
+    unsigned long       lines;          /* queued, by the writer */
+    unsigned long       dropped;        /* queue full, by the writer */
+    unsigned long       errors;         /* failed writes, by the thread */
+} mlog_sink_t;
+
+
+int mlog_sink_init(mlog_sink_t *sink, const mlog_sink_conf_t *conf);
+void mlog_sink_free(mlog_sink_t *sink);
+void mlog_sink_put(mlog_sink_t *sink, const struct iovec *iov,
+    const unsigned char *levels, int cnt);
+void mlog_sink_reopen(mlog_sink_t *sink);
+
+
+#endif /* __M_LOG_SINK_H__ */
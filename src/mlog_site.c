@@ -0,0 +1,274 @@
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "mlog.h"
+#include "mlog_inner.h"
+
+
+/* the linker bounds the section, weak so a program without calls links */
+extern mlog_site_t  __start_mlog_sites[] __attribute__((weak));
+extern mlog_site_t  __stop_mlog_sites[] __attribute__((weak));
+
+
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE  CLOCK_MONOTONIC
+#endif
+
+#define MLOG_SITE_NSEC          1000000000UL
+
+
+/* control calls are rare, producers only ever load site->enabled */
+static pthread_mutex_t  mlog_site_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* sites in MLOG_LIMIT_REPORT mode, the writer reports while there are any */
+static unsigned int     mlog_site_reporting;
+
+
+static inline int
+mlog_site_state(const mlog_site_t *site, int on)
+{
+    if (!on) {
+        return MLOG_SITE_OFF;
+    }
+
+    return site->interval ? MLOG_SITE_LIMITED : MLOG_SITE_ON;
+}
+
+
+/* "net.c" matches "src/net.c" but not "src/subnet.c" */
+
+static int
+mlog_site_file_match(const char *path, const char *file)
+{
+    size_t  plen, flen;
+
+    plen = strlen(path);
+    flen = strlen(file);
+
+    if (flen > plen || strcmp(path + plen - flen, file) != 0) {
+        return 0;
+    }
+
+    return flen == plen || path[plen - flen - 1] == '/';
+}
+
+
+/*
+ * The global level is the baseline: it enables every site at or below it
+ * and disables the rest, dropping what mlog_site_set() changed before.
+ */
+
+void
+mlog_set_log_level(int level)
+{
+    mlog_site_t  *site;
+
+    if (level < MLOG_LEVEL_ERROR || level > MLOG_LEVEL_DEBUG) {
+        return;
+    }
+
+    pthread_mutex_lock(&mlog_site_mutex);
+
+    for (site = __start_mlog_sites; site < __stop_mlog_sites; site++) {
+        __atomic_store_n(&site->enabled,
+                         mlog_site_state(site, site->level <= level),
+                         __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&mlog_site_mutex);
+}
+
+
+static int
+mlog_site_match(const mlog_site_t *site, const char *file, const char *func,
+    long line_from, long line_to, int level)
+{
+    return (file == NULL || mlog_site_file_match(site->file, file))
+           && (func == NULL || strcmp(site->func, func) == 0)
+           && (line_from == 0 || site->line >= line_from)
+           && (line_to == 0 || site->line <= line_to)
+           && (level == MLOG_LEVEL_ANY || site->level == level);
+}
+
+
+/*
+ * Enables or disables the call sites matching all given filters: file by
+ * path suffix, func by name, line in [line_from, line_to], level exactly.
+ * NULL, a 0 line bound and MLOG_LEVEL_ANY match everything. Returns the
+ * number of sites changed.
+ */
+
+int
+mlog_site_set(const char *file, const char *func, long line_from,
+    long line_to, int level, int enable)
+{
+    int           n = 0;
+    mlog_site_t  *site;
+
+    pthread_mutex_lock(&mlog_site_mutex);
+
+    for (site = __start_mlog_sites; site < __stop_mlog_sites; site++) {
+
+        if (!mlog_site_match(site, file, func, line_from, line_to, level)) {
+            continue;
+        }
+
+        __atomic_store_n(&site->enabled, mlog_site_state(site, enable),
+                         __ATOMIC_RELAXED);
+        n++;
+    }
+
+    pthread_mutex_unlock(&mlog_site_mutex);
+
+    MLOG_DEBUG("%s %d call sites", enable ? "enabled" : "disabled", n);
+
+    return n;
+}
+
+
+/*
+ * Lets the matching sites through at "rate" lines per second with bursts
+ * of "burst", rate 0 lifts the limit. Takes the same filters as
+ * mlog_site_set(), returns the number of sites changed.
+ */
+
+int
+mlog_site_limit(const char *file, const char *func, long line_from,
+    long line_to, int level, unsigned int rate, unsigned int burst, int mode)
+{
+    int           n = 0;
+    mlog_site_t  *site;
+
+    if (burst == 0) {
+        burst = 1;
+    }
+
+    pthread_mutex_lock(&mlog_site_mutex);
+
+    for (site = __start_mlog_sites; site < __stop_mlog_sites; site++) {
+
+        if (!mlog_site_match(site, file, func, line_from, line_to, level)) {
+            continue;
+        }
+
+        if (site->interval && site->limit_mode == MLOG_LIMIT_REPORT) {
+            __atomic_sub_fetch(&mlog_site_reporting, 1, __ATOMIC_RELAXED);
+        }
+
+        site->interval = rate ? MLOG_SITE_NSEC / rate : 0;
+        site->tolerance = site->interval * (burst - 1);
+        site->limit_mode = mode;
+        __atomic_store_n(&site->tat, 0, __ATOMIC_RELAXED);
+
+        if (site->interval && site->limit_mode == MLOG_LIMIT_REPORT) {
+            __atomic_add_fetch(&mlog_site_reporting, 1, __ATOMIC_RELAXED);
+        }
+
+        __atomic_store_n(&site->enabled,
+                         mlog_site_state(site, site->enabled != MLOG_SITE_OFF),
+                         __ATOMIC_RELAXED);
+        n++;
+    }
+
+    pthread_mutex_unlock(&mlog_site_mutex);
+
+    return n;
+}
+
+
+/*
+ * The token bucket as a virtual scheduling (GCRA) check: one CAS on the
+ * theoretical arrival time, no lock and no refill timer.
+ */
+
+int
+mlog_site_allow(mlog_site_t *site)
+{
+    unsigned long    now, tat, next, interval;
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    now = ts.tv_sec * MLOG_SITE_NSEC + ts.tv_nsec;
+
+    interval = site->interval;
+    tat = __atomic_load_n(&site->tat, __ATOMIC_RELAXED);
+
+    do {
+        if (tat > now + site->tolerance) {
+            __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+
+        next = (tat > now ? tat : now) + interval;
+
+    } while (!__atomic_compare_exchange_n(&site->tat, &tat, next, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return 1;
+}
+
+
+/* the writer wakes up for reports while this is not 0 */
+
+unsigned int
+mlog_site_reporting_count()
+{
+    return __atomic_load_n(&mlog_site_reporting, __ATOMIC_RELAXED);
+}
+
+
+/* called by the writer about once a second, logs through its own kfifo */
+
+void
+mlog_site_report()
+{
+    unsigned long   n;
+    mlog_site_t    *site;
+
+    if (__atomic_load_n(&mlog_site_reporting, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&mlog_site_mutex);
+
+    for (site = __start_mlog_sites; site < __stop_mlog_sites; site++) {
+
+        if (site->limit_mode != MLOG_LIMIT_REPORT || site->suppressed == 0) {
+            continue;
+        }
+
+        n = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+
+        if (n) {
+            mlog_format(site, "last message repeated %lu times", n);
+        }
+    }
+
+    pthread_mutex_unlock(&mlog_site_mutex);
+}
+
+
+/* where the sites are in this run, to tell a crashed run's records apart */
+
+mlog_site_t *
+mlog_site_section(unsigned long *n)
+{
+    *n = __stop_mlog_sites - __start_mlog_sites;
+
+    return __start_mlog_sites;
+}
+
+
+void
+mlog_site_walk(mlog_site_handler_pt handler, void *data)
+{
+    mlog_site_t  *site;
+
+    pthread_mutex_lock(&mlog_site_mutex);
+
+    for (site = __start_mlog_sites; site < __stop_mlog_sites; site++) {
+        handler(site, data);
+    }
+
+    pthread_mutex_unlock(&mlog_site_mutex);
+}
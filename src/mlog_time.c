@@ -0,0 +1,127 @@
+#include <string.h>
+#include <time.h>
+#include "mlog_time.h"
+
+
+#ifndef CLOCK_REALTIME_COARSE
+#define CLOCK_REALTIME_COARSE    CLOCK_REALTIME
+#endif
+
+
+static unsigned int      mlog_tz_gen = 1;
+
+
+/* vDSO only, no syscall and no tz lookup */
+
+void
+mlog_time_now(struct timespec *ts)
+{
+    clock_gettime(CLOCK_REALTIME_COARSE, ts);
+}
+
+
+/*
+ * localtime_r() takes the tz lock and may stat /etc/localtime, so it runs
+ * at most once per local minute and thread. Offset changes (DST) happen
+ * on a local minute boundary, which is where the cache expires anyway.
+ */
+
+void
+mlog_time_format(mlog_time_cache_t *cache, time_t sec, char *out)
+{
+    unsigned int  gen, s;
+    struct tm     tm;
+
+    gen = __atomic_load_n(&mlog_tz_gen, __ATOMIC_ACQUIRE);
+
+    if (cache->tz_gen != gen || sec < cache->sec
+        || sec - cache->sec >= cache->left)
+    {
+        localtime_r(&sec, &tm);
+
+        strftime(cache->buf, sizeof(cache->buf), "%Y/%m/%d %H:%M:%S", &tm);
+
+        /* tm_sec may be 60 on a leap second, keep that one uncached */
+
+        cache->sec = sec - tm.tm_sec;
+        cache->left = tm.tm_sec < 60 ? 60 : 0;
+        cache->tz_gen = gen;
+
+        memcpy(out, cache->buf, MLOG_TIME_LEN);
+        return;
+    }
+
+    s = sec - cache->sec;
+
+    memcpy(out, cache->buf, MLOG_TIME_LEN - 2);
+    out[MLOG_TIME_LEN - 2] = '0' + s / 10;
+    out[MLOG_TIME_LEN - 1] = '0' + s % 10;
+}
+
+
+static inline char *
+mlog_time_put2(char *p, unsigned int v)
+{
+    *p++ = '0' + v / 10 % 10;
+    *p++ = '0' + v % 10;
+
+    return p;
+}
+
+
+/*
+ * For a crash handler: no tz lock, no libc at all. The local time is sec
+ * plus gmtoff, which the caller took from localtime_r() beforehand; the
+ * date is the proleptic Gregorian one of the days since the epoch.
+ */
+
+void
+mlog_time_format_sigsafe(time_t sec, long gmtoff, char *out)
+{
+    long          days, secs, era, doe, yoe, doy, mp, y;
+    unsigned int  m, d;
+    char         *p = out;
+
+    sec += gmtoff;
+
+    days = sec / 86400;
+    secs = sec % 86400;
+
+    if (secs < 0) {
+        secs += 86400;
+        days--;
+    }
+
+    days += 719468;                     /* from 0000/03/01 */
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    doe = days - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = yoe + era * 400 + (m <= 2);
+
+    p = mlog_time_put2(p, y / 100);
+    p = mlog_time_put2(p, y);
+    *p++ = '/';
+    p = mlog_time_put2(p, m);
+    *p++ = '/';
+    p = mlog_time_put2(p, d);
+    *p++ = ' ';
+    p = mlog_time_put2(p, secs / 3600);
+    *p++ = ':';
+    p = mlog_time_put2(p, secs / 60 % 60);
+    *p++ = ':';
+    (void) mlog_time_put2(p, secs % 60);
+}
+
+
+/* call after changing TZ or /etc/localtime, every cache re-renders */
+
+void
+mlog_time_tz_reload()
+{
+    tzset();
+    __atomic_add_fetch(&mlog_tz_gen, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,28 @@
+#ifndef __M_LOG_TIME_H__
+#define __M_LOG_TIME_H__
+
+#include <time.h>
+
+
+#define MLOG_TIME_LEN    19     /* "YYYY/MM/DD HH:MM:SS" */
+
+
+/*
+ * One local minute rendered once, seconds are patched in. Valid for
+ * [sec, sec + left) under timezone generation "tz_gen".
+ */
+typedef struct {
+    time_t              sec;
+    unsigned int        left;
+    unsigned int        tz_gen;
+    char                buf[MLOG_TIME_LEN + 1];
+} mlog_time_cache_t;
+
+
+void mlog_time_now(struct timespec *ts);
+void mlog_time_format(mlog_time_cache_t *cache, time_t sec, char *out);
+void mlog_time_format_sigsafe(time_t sec, long gmtoff, char *out);
+void mlog_time_tz_reload();
+
+
+#endif /* __M_LOG_TIME_H__ */
@@ -0,0 +1,442 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include "mlog_uring.h"
+
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define MLOG_HAVE_URING     1
+#endif
+#endif
+
+
+#ifdef MLOG_HAVE_URING
+
+#include <linux/io_uring.h>
+
+
+/* user_data of the fsync linked to the write of a buffer */
+#define MLOG_URING_FSYNC    (1ULL << 32)
+
+
+static inline int
+mlog_uring_enter(int fd, unsigned int submit, unsigned int complete,
+    unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+
+static void
+mlog_uring_unmap(mlog_uring_t *ur)
+{
+    if (ur->sqes) {
+        munmap(ur->sqes, ur->sqes_size);
+        ur->sqes = NULL;
+    }
+
+    if (ur->cq_map) {
+        munmap(ur->cq_map, ur->cq_map_size);
+        ur->cq_map = NULL;
+    }
+
+    if (ur->sq_map) {
+        munmap(ur->sq_map, ur->sq_map_size);
+        ur->sq_map = NULL;
+    }
+}
+
+
+/*
+ * Returns -1 with errno when the kernel has no io_uring or refuses it,
+ * the caller writes the way it did before then. Buffers the kernel will
+ * not register, e.g. over RLIMIT_MEMLOCK, are written with plain
+ * IORING_OP_WRITE.
+ */
+
+int
+mlog_uring_init(mlog_uring_t *ur, unsigned int depth, size_t buf_size,
+    int fsync)
+{
+    int                      err;
+    unsigned int             i;
+    unsigned char           *p;
+    struct iovec            *iov;
+    struct io_uring_params   params;
+
+    memset(ur, 0, sizeof(mlog_uring_t));
+    ur->fd = -1;
+
+    /* a write and its fsync per buffer */
+
+    memset(&params, 0, sizeof(params));
+
+    ur->fd = syscall(__NR_io_uring_setup, depth * 2, &params);
+    if (ur->fd < 0) {
+        ur->fd = -1;
+        return -1;
+    }
+
+    ur->sq_map_size = params.sq_off.array
+                      + params.sq_entries * sizeof(unsigned int);
+    ur->cq_map_size = params.cq_off.cqes
+                      + params.cq_entries * sizeof(struct io_uring_cqe);
+    ur->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ur->sq_map = mmap(NULL, ur->sq_map_size, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    ur->cq_map = mmap(NULL, ur->cq_map_size, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+    ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+
+    if (ur->sq_map == MAP_FAILED || ur->cq_map == MAP_FAILED
+        || ur->sqes == MAP_FAILED)
+    {
+        err = errno;
+        ur->sq_map = ur->sq_map == MAP_FAILED ? NULL : ur->sq_map;
+        ur->cq_map = ur->cq_map == MAP_FAILED ? NULL : ur->cq_map;
+        ur->sqes = ur->sqes == MAP_FAILED ? NULL : ur->sqes;
+        goto failed;
+    }
+
+    p = ur->sq_map;
+    ur->sq_head = (unsigned int *) (p + params.sq_off.head);
+    ur->sq_tail = (unsigned int *) (p + params.sq_off.tail);
+    ur->sq_mask = *(unsigned int *) (p + params.sq_off.ring_mask);
+    ur->sq_array = (unsigned int *) (p + params.sq_off.array);
+
+    p = ur->cq_map;
+    ur->cq_head = (unsigned int *) (p + params.cq_off.head);
+    ur->cq_tail = (unsigned int *) (p + params.cq_off.tail);
+    ur->cq_mask = *(unsigned int *) (p + params.cq_off.ring_mask);
+    ur->cqes = p + params.cq_off.cqes;
+
+    /* page aligned, which registering wants */
+
+    buf_size = (buf_size + getpagesize() - 1) & ~((size_t) getpagesize() - 1);
+
+    ur->bufs = mmap(NULL, depth * buf_size, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    ur->reqs = calloc(depth, sizeof(mlog_uring_req_t));
+    iov = calloc(depth, sizeof(struct iovec));
+
+    if (ur->bufs == MAP_FAILED || ur->reqs == NULL || iov == NULL) {
+        err = ENOMEM;
+        ur->bufs = ur->bufs == MAP_FAILED ? NULL : ur->bufs;
+        free(iov);
+        goto failed;
+    }
+
+    for (i = 0; i < depth; i++) {
+        iov[i].iov_base = ur->bufs + i * buf_size;
+        iov[i].iov_len = buf_size;
+    }
+
+    ur->fixed = syscall(__NR_io_uring_register, ur->fd,
+                        IORING_REGISTER_BUFFERS, iov, depth) == 0;
+
+    free(iov);
+
+    ur->depth = depth;
+    ur->buf_size = buf_size;
+    ur->fsync = fsync;
+
+    return 0;
+
+failed:
+
+    mlog_uring_free(ur);
+    errno = err;
+
+    return -1;
+}
+
+
+/* waits for what is in flight, the file may be closed after */
+
+void
+mlog_uring_free(mlog_uring_t *ur)
+{
+    if (ur->fd < 0) {
+        return;
+    }
+
+    if (ur->reqs) {
+        mlog_uring_reap(ur, MLOG_URING_ALL);
+    }
+
+    mlog_uring_unmap(ur);
+
+    if (ur->bufs) {
+        munmap(ur->bufs, ur->depth * ur->buf_size);
+        ur->bufs = NULL;
+    }
+
+    free(ur->reqs);
+    ur->reqs = NULL;
+
+    close(ur->fd);
+    ur->fd = -1;
+}
+
+
+/* a free buffer, waits for one if all are in flight */
+
+unsigned char *
+mlog_uring_get(mlog_uring_t *ur, unsigned int *id)
+{
+    unsigned int  i;
+
+    for ( ;; ) {
+        for (i = 0; i < ur->depth; i++) {
+            if (ur->reqs[i].pending == 0) {
+                *id = i;
+                return ur->bufs + i * ur->buf_size;
+            }
+        }
+
+        mlog_uring_reap(ur, MLOG_URING_ONE);
+    }
+}
+
+
+static void
+mlog_uring_push(mlog_uring_t *ur, const struct io_uring_sqe *sqe)
+{
+    unsigned int  tail, idx;
+
+    tail = *ur->sq_tail;
+    idx = tail & ur->sq_mask;
+
+    ((struct io_uring_sqe *) ur->sqes)[idx] = *sqe;
+    ur->sq_array[idx] = idx;
+
+    /* the kernel reads the SQE once it sees the tail */
+
+    __atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/* queues len bytes of buffer id for fd at off */
+
+int
+mlog_uring_write(mlog_uring_t *ur, unsigned int id, int fd, off_t off,
+    size_t len)
+{
+    int                   n;
+    unsigned int          submit = 1;
+    mlog_uring_req_t     *req = &ur->reqs[id];
+    struct io_uring_sqe   sqe, fsqe;
+
+    memset(&sqe, 0, sizeof(sqe));
+
+    sqe.opcode = ur->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe.fd = fd;
+    sqe.off = off;
+    sqe.addr = (unsigned long) (ur->bufs + id * ur->buf_size);
+    sqe.len = len;
+    sqe.buf_index = id;
+    sqe.user_data = id;
+
+    if (ur->fsync) {
+        sqe.flags = IOSQE_IO_LINK;
+
+        memset(&fsqe, 0, sizeof(fsqe));
+        fsqe.opcode = IORING_OP_FSYNC;
+        fsqe.fd = fd;
+        fsqe.fsync_flags = IORING_FSYNC_DATASYNC;
+        fsqe.user_data = id | MLOG_URING_FSYNC;
+
+        submit = 2;
+    }
+
+    mlog_uring_push(ur, &sqe);
+
+    if (submit == 2) {
+        mlog_uring_push(ur, &fsqe);
+    }
+
+    do {
+        n = mlog_uring_enter(ur->fd, submit, 0, 0);
+    } while (n < 0 && errno == EINTR);
+
+    /* the SQEs the kernel did not take are dropped */
+
+    if (n != (int) submit) {
+        __atomic_store_n(ur->sq_tail, *ur->sq_head, __ATOMIC_RELEASE);
+    }
+
+    if (n <= 0) {
+        return -1;
+    }
+
+    req->pending = n;
+    req->fd = fd;
+    req->off = off;
+    req->len = len;
+    req->seq = ur->sent + 1;
+
+    ur->inflight++;
+
+    /* mlog_flush() waits for "done" to pass it */
+
+    __atomic_store_n(&ur->sent, req->seq, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+
+/* a short write gets its rest written here, its linked fsync was cut */
+
+static int
+mlog_uring_rest(mlog_uring_t *ur, mlog_uring_req_t *req, size_t done)
+{
+    ssize_t         n;
+    unsigned char  *p;
+
+    p = ur->bufs + (req - ur->reqs) * ur->buf_size;
+
+    while (done < req->len) {
+        n = pwrite(req->fd, p + done, req->len - done, req->off + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return -1;
+        }
+
+        done += n;
+    }
+
+    if (ur->fsync && fdatasync(req->fd) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void
+mlog_uring_complete(mlog_uring_t *ur, struct io_uring_cqe *cqe)
+{
+    unsigned int        id = cqe->user_data & 0xffffffff;
+    mlog_uring_req_t   *req = &ur->reqs[id];
+
+    if (cqe->user_data & MLOG_URING_FSYNC) {
+
+        /* -ECANCELED after a short write, settled with the write */
+
+        if (cqe->res < 0 && cqe->res != -ECANCELED) {
+            ur->errors++;
+        }
+
+    } else if (cqe->res < 0) {
+        ur->errors++;
+
+    } else if ((size_t) cqe->res < req->len
+               && mlog_uring_rest(ur, req, cqe->res) != 0)
+    {
+        ur->errors++;
+    }
+
+    if (--req->pending == 0) {
+        ur->inflight--;
+    }
+}
+
+
+/* takes the completions, waits as asked; "done" moves to the oldest left */
+
+void
+mlog_uring_reap(mlog_uring_t *ur, int wait)
+{
+    unsigned int          head, tail, i, oldest;
+    struct io_uring_cqe  *cqe;
+
+    for ( ;; ) {
+        head = *ur->cq_head;
+        tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+        for ( /* void */ ; head != tail; head++) {
+            cqe = (struct io_uring_cqe *) ur->cqes + (head & ur->cq_mask);
+            mlog_uring_complete(ur, cqe);
+        }
+
+        __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+        if (ur->inflight == 0
+            || wait == MLOG_URING_NOWAIT
+            || (wait == MLOG_URING_ONE && ur->inflight < ur->depth))
+        {
+            break;
+        }
+
+        if (mlog_uring_enter(ur->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0
+            && errno != EINTR)
+        {
+            break;
+        }
+    }
+
+    oldest = ur->sent;
+
+    for (i = 0; i < ur->depth; i++) {
+        if (ur->reqs[i].pending && (int) (ur->reqs[i].seq - 1 - oldest) < 0) {
+            oldest = ur->reqs[i].seq - 1;
+        }
+    }
+
+    __atomic_store_n(&ur->done, oldest, __ATOMIC_RELEASE);
+}
+
+
+#else
+
+
+int
+mlog_uring_init(mlog_uring_t *ur, unsigned int depth, size_t buf_size,
+    int fsync)
+{
+    memset(ur, 0, sizeof(mlog_uring_t));
+    ur->fd = -1;
+    errno = ENOSYS;
+
+    return -1;
+}
+
+
+void
+mlog_uring_free(mlog_uring_t *ur)
+{
+}
+
+
+unsigned char *
+mlog_uring_get(mlog_uring_t *ur, unsigned int *id)
+{
+    return NULL;
+}
+
+
+int
+mlog_uring_write(mlog_uring_t *ur, unsigned int id, int fd, off_t off,
+    size_t len)
+{
+    return -1;
+}
+
+
+void
+mlog_uring_reap(mlog_uring_t *ur, int wait)
+{
+}
+
+
+#endif /* MLOG_HAVE_URING */
@@ -0,0 +1,68 @@
+#ifndef __M_LOG_URING_H__
+#define __M_LOG_URING_H__
+
+#include <sys/types.h>
+
+
+/* what mlog_uring_reap() waits for */
+#define MLOG_URING_NOWAIT       0
+#define MLOG_URING_ONE          1   /* a free buffer */
+#define MLOG_URING_ALL          2   /* nothing in flight */
+
+
+/*
+ * A batch is copied into one of "depth" buffers registered with the ring
+ * and written from there at its own offset, with IORING_OP_WRITE_FIXED,
+ * linked to an IORING_OP_FSYNC if asked. Up to depth batches are in
+ * flight while the writer goes on draining. Raw syscalls, no liburing.
+ */
+
+typedef struct {
+    int                 pending;        /* CQEs to come, 0 when free */
+    int                 fd;
+    off_t               off;
+    size_t              len;
+    unsigned int        seq;
+} mlog_uring_req_t;
+
+
+typedef struct {
+    int                 fd;             /* of the ring, -1 for none */
+    unsigned int        depth;
+    size_t              buf_size;
+    unsigned char      *bufs;           /* depth * buf_size */
+    int                 fixed;          /* the buffers are registered */
+    int                 fsync;          /* an fdatasync after each write */
+    mlog_uring_req_t   *reqs;
+    unsigned int        inflight;
+    unsigned int        sent;           /* writes submitted so far */
+    unsigned int        done;           /* writes up to it completed */
+    unsigned int        errors;         /* failed since the last look */
+
+    void               *sq_map;
+    size_t              sq_map_size;
+    void               *cq_map;
+    size_t              cq_map_size;
+    void               *sqes;
+    size_t              sqes_size;
+    unsigned int       *sq_head;
+    unsigned int       *sq_tail;
+    unsigned int        sq_mask;
+    unsigned int       *sq_array;
+    unsigned int       *cq_head;
+    unsigned int       *cq_tail;
+    unsigned int        cq_mask;
+    void               *cqes;
+} mlog_uring_t;
+
+
+int mlog_uring_init(mlog_uring_t *ur, unsigned int depth, size_t buf_size,
+    int fsync);
+void mlog_uring_free(mlog_uring_t *ur);
+unsigned char *mlog_uring_get(mlog_uring_t *ur, unsigned int *id);
+int mlog_uring_write(mlog_uring_t *ur, unsigned int id, int fd, off_t off,
+    size_t len);
+void mlog_uring_reap(mlog_uring_t *ur, int wait);
+
+
+#endif /* __M_LOG_URING_H__ */
@@ -19,8 +19,11 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "kfifo.h"
 
 #define min(a,b) (((a) < (b)) ? (a) : (b))
@@ -48,10 +51,62 @@ struct kfifo *kfifo_init(unsigned char *buffer, unsigned int size)
 	fifo->buffer = buffer;
 	fifo->size = size;
 	fifo->in = fifo->out = 0;
+	fifo->mirrored = 0;
 
 	return fifo;
 }
 
+/*
+ * kfifo_map_mirror - maps @size bytes of @fd at @offset twice, back to
+ * back, so that any @size byte window of the result is contiguous.
+ * @size and @offset must be multiples of the page size.
+ */
+static unsigned char *kfifo_map_mirror(int fd, off_t offset, unsigned int size)
+{
+	unsigned char *base, *p;
+
+	base = mmap(NULL, 2 * (size_t) size, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	p = mmap(base, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, offset);
+	if (p != base)
+		goto fail_map;
+
+	p = mmap(base + size, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, offset);
+	if (p != base + size)
+		goto fail_map;
+
+	return base;
+
+fail_map:
+	munmap(base, 2 * (size_t) size);
+	return NULL;
+}
+
+/*
+ * kfifo_map_anon - a mirrored buffer of anonymous shared memory
+ */
+static unsigned char *kfifo_map_anon(unsigned int size)
+{
+	int fd;
+	unsigned char *base = NULL;
+
+	fd = memfd_create("kfifo", MFD_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, size) == 0)
+		base = kfifo_map_mirror(fd, 0, size);
+
+	close(fd);
+
+	return base;
+}
+
 /**
  * kfifo_alloc - allocates a new FIFO and its internal buffer
  * @size: the size of the internal buffer to be allocated.
@@ -65,11 +120,31 @@ struct kfifo *kfifo_alloc(unsigned int size)
 	unsigned char *buffer;
 	struct kfifo *ret;
 
+	unsigned int page = sysconf(_SC_PAGESIZE);
+
 	/*
 	 * round up to the next power of 2, since our 'let the indices
 	 * wrap' tachnique works only in this case.
+	 *
+	 * The buffer is mirrored when possible, which needs at least a page;
+	 * a page is a power of 2 as well.
 	 */
 
+	if (size < page)
+		size = page;
+
+	buffer = kfifo_map_anon(size);
+	if (buffer) {
+		ret = kfifo_init(buffer, size);
+		if (ret == NULL) {
+			munmap(buffer, 2 * (size_t) size);
+			return NULL;
+		}
+
+		ret->mirrored = 1;
+		return ret;
+	}
+
 	buffer = calloc(1, size);
 	if (!buffer)
 		return NULL;
@@ -88,10 +163,50 @@ struct kfifo *kfifo_alloc(unsigned int size)
  */
 void kfifo_free(struct kfifo *fifo)
 {
-	free(fifo->buffer);
+	if (fifo->mirrored)
+		munmap(fifo->buffer, 2 * (size_t) fifo->size);
+	else
+		free(fifo->buffer);
 	free(fifo);
 }
 
+/**
+ * kfifo_map - places a mirrored FIFO over a file
+ * @fifo: the fifo to be set up, owned by the caller.
+ * @fd: the file holding the buffer.
+ * @offset: where the buffer starts in @fd, a multiple of the page size.
+ * @size: the size of the buffer, a power of 2 and at least a page.
+ *
+ * The buffer is shared with the file, so whatever was put into it is
+ * still there for another process mapping the file after this one died.
+ * @fifo->in and @fifo->out are left alone, @fifo may live in the file
+ * too. Release with kfifo_unmap(), not kfifo_free().
+ */
+int kfifo_map(struct kfifo *fifo, int fd, off_t offset, unsigned int size)
+{
+	unsigned char *buffer;
+
+	buffer = kfifo_map_mirror(fd, offset, size);
+	if (!buffer)
+		return -1;
+
+	fifo->buffer = buffer;
+	fifo->size = size;
+	fifo->mirrored = 1;
+
+	return 0;
+}
+
+/**
+ * kfifo_unmap - unmaps the buffer of a FIFO set up by kfifo_map()
+ * @fifo: the fifo to be used.
+ */
+void kfifo_unmap(struct kfifo *fifo)
+{
+	munmap(fifo->buffer, 2 * (size_t) fifo->size);
+	fifo->buffer = NULL;
+}
+
 /**
  * __kfifo_put - puts some data into the FIFO, no locking version
  * @fifo: the fifo to be used.
@@ -187,3 +302,70 @@ unsigned int __kfifo_get(struct kfifo *fifo,
 
 	return len;
 }
+
+/**
+ * kfifo_reserve - reserves contiguous space for the producer
+ * @fifo: the fifo to be used.
+ * @len: returns the number of contiguous bytes that may be written.
+ *
+ * Returns the address where the next byte put into the FIFO goes. The
+ * bytes only become visible to the consumer after kfifo_commit(). A
+ * mirrored fifo can hand out all of its free space, a plain one only up
+ * to the end of the buffer.
+ */
+unsigned char *kfifo_reserve(struct kfifo *fifo, unsigned int *len)
+{
+	unsigned int off;
+
+	*len = fifo->size - fifo->in + fifo->out;
+
+	/*
+	 * Ensure that we sample the fifo->out index -before- we
+	 * start putting bytes into the kfifo.
+	 */
+
+	__sync_synchronize();
+
+	off = fifo->in & (fifo->size - 1);
+
+	if (!fifo->mirrored)
+		*len = min(*len, fifo->size - off);
+
+	return fifo->buffer + off;
+}
+
+/**
+ * kfifo_commit - publishes bytes written after kfifo_reserve()
+ * @fifo: the fifo to be used.
+ * @len: the number of bytes written, no more than the reserved length.
+ */
+void kfifo_commit(struct kfifo *fifo, unsigned int len)
+{
+	/*
+	 * Ensure that we add the bytes to the kfifo -before-
+	 * we update the fifo->in index.
+	 */
+
+	__sync_synchronize();
+
+	fifo->in += len;
+}
+
+/**
+ * kfifo_consume - releases bytes the consumer read in place
+ * @fifo: the fifo to be used.
+ * @len: the number of bytes to be released.
+ *
+ * Use with kfifo_peek() to read the FIFO without copying.
+ */
+void kfifo_consume(struct kfifo *fifo, unsigned int len)
+{
+	/*
+	 * Ensure that we are done with the bytes -before-
+	 * we update the fifo->out index.
+	 */
+
+	__sync_synchronize();
+
+	fifo->out += len;
+}
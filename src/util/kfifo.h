@@ -21,21 +21,29 @@
 #ifndef _KFIFO_H
 #define _KFIFO_H
 
+#include <sys/types.h>
 
 struct kfifo {
 	unsigned char *buffer;	/* the buffer holding the data */
 	unsigned int size;	/* the size of the allocated buffer */
 	unsigned int in;	/* data is added at offset (in % size) */
 	unsigned int out;	/* data is extracted from off. (out % size) */
+	unsigned int mirrored;	/* buffer is mapped twice back to back */
 };
 
 extern struct kfifo *kfifo_init(unsigned char *buffer, unsigned int size);
 extern struct kfifo *kfifo_alloc(unsigned int size);
 extern void kfifo_free(struct kfifo *fifo);
+extern int kfifo_map(struct kfifo *fifo, int fd, off_t offset,
+		     unsigned int size);
+extern void kfifo_unmap(struct kfifo *fifo);
 extern unsigned int __kfifo_put(struct kfifo *fifo,
 				unsigned char *buffer, unsigned int len);
 extern unsigned int __kfifo_get(struct kfifo *fifo,
 				unsigned char *buffer, unsigned int len);
+extern unsigned char *kfifo_reserve(struct kfifo *fifo, unsigned int *len);
+extern void kfifo_commit(struct kfifo *fifo, unsigned int len);
+extern void kfifo_consume(struct kfifo *fifo, unsigned int len);
 
 /**
  * __kfifo_reset - removes the entire FIFO contents, no locking version
@@ -123,4 +131,18 @@ static inline unsigned int kfifo_len(struct kfifo *fifo)
 	return ret;
 }
 
+/**
+ * kfifo_peek - returns the address of the byte at offset @pos
+ * @fifo: the fifo to be used.
+ * @pos: an absolute in/out style index.
+ *
+ * For a mirrored fifo the @fifo->size bytes starting at the returned
+ * address are always contiguous; otherwise the caller must handle the
+ * wrap at the end of the buffer itself.
+ */
+static inline unsigned char *kfifo_peek(struct kfifo *fifo, unsigned int pos)
+{
+	return fifo->buffer + (pos & (fifo->size - 1));
+}
+
 #endif /* _KFIFO_H */
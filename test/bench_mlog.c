@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef MLOG_WITH_ZLIB
+#include <zlib.h>
+#endif
+#include "../src/mlog.h"
+
+
+static int      g_msg_count = 100000;
+static double   g_produce_sec;      /* summed over the producer threads */
+static pthread_mutex_t  g_produce_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static unsigned long
+get_write_syscalls()
+{
+    char             line[128];
+    FILE            *fp;
+    unsigned long    syscw = 0;
+
+    fp = fopen("/proc/self/io", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "syscw: %lu", &syscw) == 1) {
+            break;
+        }
+    }
+
+    fclose(fp);
+
+    return syscw;
+}
+
+
+#ifdef MLOG_WITH_ZLIB
+
+/* reads plain files as they are */
+
+static unsigned long
+count_lines(const char *filename)
+{
+    int              i, n;
+    gzFile           gz;
+    unsigned long    lines = 0;
+    char             buf[65536];
+
+    gz = gzopen(filename, "r");
+    if (gz == NULL) {
+        return 0;
+    }
+
+    while ((n = gzread(gz, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i++) {
+            lines += buf[i] == '\n';
+        }
+    }
+
+    gzclose(gz);
+
+    return lines;
+}
+
+#else
+
+static unsigned long
+count_lines(const char *filename)
+{
+    int              c;
+    FILE            *fp;
+    unsigned long    n = 0;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    while ((c = getc_unlocked(fp)) != EOF) {
+        n += c == '\n';
+    }
+
+    fclose(fp);
+
+    return n;
+}
+
+#endif
+
+
+static double
+now_sec()
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+void *
+bench_thread(void *arg)
+{
+    int     i, id = (int) (long) arg;
+    double  start, elapsed;
+
+    start = now_sec();
+
+    for (i = 0; i < g_msg_count; i++) {
+        mlog_info("bench thread=%d seq=%d value=%s rate=%.3f",
+                  id, i, "payload", i * 0.5);
+    }
+
+    elapsed = now_sec() - start;
+
+    pthread_mutex_lock(&g_produce_lock);
+    g_produce_sec += elapsed;
+    pthread_mutex_unlock(&g_produce_lock);
+
+    return NULL;
+}
+
+
+static void
+usage(const char *prog)
+{
+    printf("usage: %s [-t threads] [-T max threads, sweep 1..max]"
+           " [-n msgs per thread] [-b batch_count] [-B batch_bytes]"
+           " [-s kfifo_size] [-o order 0|1|2] [-w reorder_window]"
+           " [-d deferred formatting] [-O binary output]"
+           " [-p overflow policy 0-3] [-S stats file]"
+           " [-I writer idle 0-3] [-C writer cpus]"
+           " [-F flush_usec] [-z flush_bytes] [-g gzip level] [-m mmap io]"
+           " [-r crash file] [-u io_uring depth] [-y fsync each batch]"
+           " [-l level, below 2 measures disabled calls] [-f file]\n",
+           prog);
+}
+
+
+static int
+run_bench(mlog_conf_t *conf, int threads)
+{
+    int                i;
+    double             start, elapsed;
+    pthread_t          t[256];
+    struct stat        st;
+    unsigned long      total, syscw, lines;
+    mlog_stats_t       stats;
+    mlog_latency_t     queue, producer;
+
+    unlink(conf->filename);
+
+    if (mlog_init_conf(conf)) {
+        return -1;
+    }
+
+    syscw = get_write_syscalls();
+    start = now_sec();
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&t[i], NULL, bench_thread, (void *) (long) i)
+            != 0)
+        {
+            printf("create thread %d failed\n", i);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < threads; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    mlog_get_stats(&stats);
+
+    mlog_uinit();
+
+    elapsed = now_sec() - start;
+    syscw = get_write_syscalls() - syscw;
+    total = (unsigned long) threads * g_msg_count;
+
+    printf("threads=%d msgs=%lu batch_count=%u batch_bytes=%u order=%d"
+           " format=%s\n",
+           threads, total, conf->batch_count, conf->batch_bytes, conf->order,
+           conf->format_mode == MLOG_FORMAT_DEFERRED
+           || conf->output == MLOG_OUTPUT_BINARY ? "deferred" : "eager");
+    printf("io=%s fsync=%d write_errors=%lu\n",
+           conf->io == MLOG_IO_URING ? "uring"
+           : conf->io == MLOG_IO_MMAP ? "mmap" : "write",
+           conf->batch_fsync, stats.write_errors);
+    printf("elapsed=%.3fs rate=%.0f msg/s write_syscalls=%lu"
+           " syscalls_per_msg=%.4f producer=%.1f ns/call\n",
+           elapsed, total / elapsed, syscw, (double) syscw / total,
+           g_produce_sec * 1e9 / total);
+
+    if (stat(conf->filename, &st) == 0) {
+        printf("output=%s bytes=%ld bytes_per_msg=%.1f",
+               conf->output == MLOG_OUTPUT_BINARY ? "binary" : "text",
+               (long) st.st_size, (double) st.st_size / total);
+
+        /* what the batches held against what went to disk */
+
+        if (conf->compress != MLOG_COMPRESS_NONE && st.st_size) {
+            printf(" gzip=%d ratio=%.2f", conf->compress_level,
+                   (double) stats.batch_bytes / st.st_size);
+        }
+
+        printf("\n");
+    }
+
+    printf("dropped=%lu shed=%lu overwritten=%lu spilled=%lu blocked=%lu"
+           " wakeups=%lu lines_per_batch=%.1f writer_cpu=%.3fs\n",
+           stats.total.dropped, stats.total.shed, stats.total.overwritten,
+           stats.total.spilled, stats.total.blocked, stats.total.wakeups,
+           stats.batches ? (double) stats.batch_lines / stats.batches : 0.0,
+           stats.writer_cpu_usec / 1e6);
+
+    /* only a build with -DMLOG_LATENCY has them */
+
+    if (mlog_get_latency(&queue, &producer) == 0) {
+        printf("queue    p50=%lu p99=%lu p999=%lu max=%lu ns\n",
+               queue.p50, queue.p99, queue.p999, queue.max);
+        printf("producer p50=%lu p99=%lu p999=%lu max=%lu ns\n",
+               producer.p50, producer.p99, producer.p999, producer.max);
+    }
+
+    if (conf->output == MLOG_OUTPUT_TEXT && conf->level >= MLOG_LEVEL_INFO) {
+        lines = count_lines(conf->filename);
+        printf("overflow=%d lines=%lu lost=%lu\n",
+               conf->overflow[MLOG_LEVEL_INFO], lines, total - lines);
+    }
+
+    return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    int                opt, status, threads = 1, max_threads = 0;
+    pid_t              pid;
+    mlog_conf_t        conf;
+
+    mlog_conf_default(&conf);
+
+    conf.level = MLOG_LEVEL_INFO;
+    conf.filename = "/tmp/mlog_bench.log";
+    conf.buf_size = 4 * 1024 * 1024;
+
+    while ((opt = getopt(argc, argv, "t:T:n:b:B:s:o:w:dOp:S:I:C:F:z:g:mr:u:yl:f:h")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'T':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            g_msg_count = atoi(optarg);
+            break;
+        case 'b':
+            conf.batch_count = atoi(optarg);
+            break;
+        case 'B':
+            conf.batch_bytes = atoi(optarg);
+            break;
+        case 's':
+            conf.buf_size = atoi(optarg);
+            break;
+        case 'o':
+            conf.order = atoi(optarg);
+            break;
+        case 'w':
+            conf.reorder_window = atoi(optarg);
+            break;
+        case 'd':
+            conf.format_mode = MLOG_FORMAT_DEFERRED;
+            break;
+        case 'O':
+            conf.output = MLOG_OUTPUT_BINARY;
+            break;
+        case 'p':
+            conf.overflow[MLOG_LEVEL_WARN] = atoi(optarg);
+            conf.overflow[MLOG_LEVEL_INFO] = atoi(optarg);
+            conf.overflow[MLOG_LEVEL_DEBUG] = atoi(optarg);
+            break;
+        case 'S':
+            conf.stats_file = optarg;
+            break;
+        case 'I':
+            conf.idle = atoi(optarg);
+            break;
+        case 'C':
+            conf.writer_cpus = optarg;
+            break;
+        case 'F':
+            conf.flush_usec = atoi(optarg);
+            break;
+        case 'z':
+            conf.flush_bytes = atoi(optarg);
+            break;
+        case 'g':
+            conf.compress = MLOG_COMPRESS_GZIP;
+            conf.compress_level = atoi(optarg);
+            break;
+        case 'm':
+            conf.io = MLOG_IO_MMAP;
+            break;
+        case 'r':
+            conf.crash_file = optarg;
+            break;
+        case 'u':
+            conf.io = MLOG_IO_URING;
+            conf.uring_depth = atoi(optarg);
+            break;
+        case 'y':
+            conf.batch_fsync = 1;
+            break;
+        case 'l':
+            conf.level = atoi(optarg);
+            break;
+        case 'f':
+            conf.filename = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if (threads < 1 || threads > 256 || max_threads > 256) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (max_threads == 0) {
+        return run_bench(&conf, threads);
+    }
+
+    /* one process per step, mlog is initialized once per process */
+
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+        pid = fork();
+        if (pid < 0) {
+            return -1;
+        }
+
+        if (pid == 0) {
+            exit(run_bench(&conf, threads) == 0 ? 0 : 1);
+        }
+
+        if (waitpid(pid, &status, 0) < 0 || status != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
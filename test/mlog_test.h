@@ -0,0 +1,36 @@
+#ifndef __M_LOG_TEST_H__
+#define __M_LOG_TEST_H__
+
+#include <stdio.h>
+
+
+/* what the tests share, each is a single file */
+
+static int      g_failed;
+
+
+static inline void
+expect(const char *what, long got, long want)
+{
+    if (got != want) {
+        printf("FAIL %s got=%ld want=%ld\n", what, got, want);
+        g_failed++;
+        return;
+    }
+
+    printf("ok   %s\n", what);
+}
+
+
+/* the verdict, and what main() returns */
+
+static inline int
+expect_done()
+{
+    printf("%s\n", g_failed ? "FAILED" : "PASSED");
+
+    return g_failed ? 1 : 0;
+}
+
+
+#endif /* __M_LOG_TEST_H__ */
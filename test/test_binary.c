@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+/*
+ * Runs the decoder, argv[1] or ./mlog_decode:
+ * gcc -o mlog_decode tools/mlog_decode.c src/mlog_bin.c src/mlog_fmt.c
+ *     src/mlog_time.c
+ */
+
+
+#define LOG_FILE        "/tmp/mlog_test_binary.log"
+#define TEXT_FILE       "/tmp/mlog_test_binary.txt"
+#define ROUNDS          3
+#define MIX_LINES       11
+#define MAX_LINES       (ROUNDS * MIX_LINES + 8)
+#define ROTATE_SIZE     256
+#define KEEP            16
+
+
+typedef struct {
+    char               *lines[MAX_LINES];
+    int                 levels[MAX_LINES];
+    int                 rounds[MAX_LINES];
+    int                 n;
+} lines_t;
+
+
+static const char      *g_decoder = "./mlog_decode";
+const char             *g_null;                 /* NULL, unknown to gcc */
+
+
+/* one call site per line, each round logs the same sites */
+
+static void *
+log_mix(void *arg)
+{
+    int  round = (int) (long) arg;
+
+    mlog_info("round=%d int %d %5i %-5u| %05x %X %o %c %%", round, -42, 7,
+              7u, 255, 255, 8, 'z');
+    mlog_warn("round=%d long %ld %lld %zu %zd %jd %td", round, -1L,
+              -9223372036854775807LL, (size_t) 123, (ssize_t) -5,
+              (intmax_t) -7, (ptrdiff_t) 9);
+    mlog_debug("round=%d star %*d|%-*d|%.*s|%*.*s|", round, 6, 1, 6, 2, 3,
+               "abcdef", 8, 2, "xyz");
+    mlog_info("round=%d float %f %.2e %g %Lf", round, 3.25, 1234.5, 0.0001,
+              (long double) 2.5);
+    mlog_error("round=%d ptr %p %p", round, (void *) 0x1234, (void *) NULL);
+    mlog_warn("round=%d str %s %.2s %10s %-4s| %s", round, "abc", "abc",
+              "right", "l", g_null);
+    mlog_info("round=%d x=%1500d end", round, 7);
+    mlog_debug("round=%d char %hhd short %hd", round, (char) -3,
+               (short) -300);
+
+    /* %m is formatted by the caller, a text entry in the file */
+
+    errno = ENOENT;
+    mlog_error("round=%d errno %m", round);
+
+    mlog_info("round=%d empty %s|", round, "");
+    mlog_warn("round=%d no arguments", round);
+
+    return NULL;
+}
+
+
+static void
+log_round(int round)
+{
+    pthread_t  t;
+
+    pthread_create(&t, NULL, log_mix, (void *) (long) round);
+    pthread_join(t, NULL);
+}
+
+
+/*
+ * "date time [level] pid#tid func#line: text" keeps "[level] func#line:
+ * text", what the time and the threads leave alike between two runs
+ */
+
+static void
+add_line(lines_t *l, const char *line)
+{
+    const char  *level, *end, *rest, *p;
+    char         buf[4096];
+
+    level = strchr(line, '[');
+    end = level ? strchr(level, ']') : NULL;
+    rest = end ? strchr(end + 2, ' ') : NULL;
+
+    if (rest == NULL || l->n == MAX_LINES) {
+        l->n = MAX_LINES + 1;
+        return;
+    }
+
+    snprintf(buf, sizeof(buf), "%.*s%s", (int) (end + 1 - level), level,
+             rest);
+
+    l->levels[l->n] = strncmp(level, "[error]", 7) == 0 ? MLOG_LEVEL_ERROR
+                      : strncmp(level, "[warn]", 6) == 0 ? MLOG_LEVEL_WARN
+                      : strncmp(level, "[info]", 6) == 0 ? MLOG_LEVEL_INFO
+                      : MLOG_LEVEL_DEBUG;
+
+    p = strstr(rest, "round=");
+    l->rounds[l->n] = p ? atoi(p + 6) : -1;
+    l->lines[l->n++] = strdup(buf);
+}
+
+
+static int
+read_file(lines_t *l, FILE *fp)
+{
+    char     *line = NULL;
+    size_t    cap = 0;
+    ssize_t   len;
+
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        if ((size_t) len != strlen(line)) {
+            free(line);
+            return -1;
+        }
+
+        add_line(l, line);
+    }
+
+    free(line);
+
+    return 0;
+}
+
+
+/* decodes the rotated files, oldest first, then the current one */
+
+static int
+decode(lines_t *l, const char *opts)
+{
+    int     i, ret = 0;
+    char    name[256], cmd[512];
+    FILE   *fp;
+
+    memset(l, 0, sizeof(lines_t));
+
+    for (i = KEEP; i >= 0; i--) {
+        if (i) {
+            snprintf(name, sizeof(name), "%s.%d", LOG_FILE, i);
+
+        } else {
+            snprintf(name, sizeof(name), "%s", LOG_FILE);
+        }
+
+        if (access(name, F_OK) != 0) {
+            continue;
+        }
+
+        /* each file decodes alone, its sites were entered again */
+
+        snprintf(cmd, sizeof(cmd), "%s %s '%s'", g_decoder, opts, name);
+
+        fp = popen(cmd, "r");
+        if (fp == NULL) {
+            return -1;
+        }
+
+        if (read_file(l, fp) != 0) {
+            ret = -1;
+        }
+
+        if (pclose(fp) != 0) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+
+static void
+remove_files()
+{
+    int   i;
+    char  name[256];
+
+    unlink(TEXT_FILE);
+    unlink(LOG_FILE);
+
+    for (i = 1; i <= KEEP; i++) {
+        snprintf(name, sizeof(name), "%s.%d", LOG_FILE, i);
+        unlink(name);
+    }
+}
+
+
+static int
+init(const char *filename, int output)
+{
+    mlog_conf_t  conf;
+
+    mlog_conf_default(&conf);
+
+    conf.level = MLOG_LEVEL_DEBUG;
+    conf.filename = filename;
+    conf.buf_size = 1024 * 1024;
+    conf.output = output;
+
+    if (output == MLOG_OUTPUT_BINARY) {
+        conf.rotate_size = ROTATE_SIZE;
+        conf.rotate_keep = KEEP;
+    }
+
+    return mlog_init_conf(&conf);
+}
+
+
+/* waits for the next second, returns it */
+
+static time_t
+next_second()
+{
+    time_t  now = time(NULL);
+
+    while (time(NULL) == now) {
+        usleep(10000);
+    }
+
+    usleep(50000);
+
+    return now + 1;
+}
+
+
+/* the decoded lines against the text ones the filter keeps */
+
+static void
+compare(const char *what, lines_t *text, lines_t *bin, int level, int from,
+    int to)
+{
+    int   i, n = 0, same = 0;
+    char  buf[128];
+
+    for (i = 0; i < text->n; i++) {
+        if (text->levels[i] > level || text->rounds[i] < from
+            || text->rounds[i] > to)
+        {
+            continue;
+        }
+
+        if (n < bin->n && strcmp(text->lines[i], bin->lines[n]) == 0) {
+            same++;
+
+        } else if (n < bin->n) {
+            printf("text:    %.200s", text->lines[i]);
+            printf("decoded: %.200s", bin->lines[n]);
+        }
+
+        n++;
+    }
+
+    snprintf(buf, sizeof(buf), "%s: as many lines", what);
+    expect(buf, bin->n, n);
+    snprintf(buf, sizeof(buf), "%s: the same lines", what);
+    expect(buf, same, n);
+}
+
+
+int main(int argc, char **argv)
+{
+    int       i, files;
+    char      name[256], opts[64];
+    time_t    last;
+    FILE     *fp;
+    lines_t   text, bin;
+
+    if (argc > 1) {
+        g_decoder = argv[1];
+    }
+
+    if (access(g_decoder, X_OK) != 0) {
+        printf("%s not built, skipped\n", g_decoder);
+        return 0;
+    }
+
+    remove_files();
+
+    /* what text output makes of the rounds */
+
+    if (init(TEXT_FILE, MLOG_OUTPUT_TEXT)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < ROUNDS; i++) {
+        log_round(i);
+    }
+
+    mlog_uinit();
+
+    memset(&text, 0, sizeof(lines_t));
+
+    fp = fopen(TEXT_FILE, "r");
+    if (fp == NULL || read_file(&text, fp) != 0) {
+        printf("read %s failed\n", TEXT_FILE);
+        return 1;
+    }
+
+    fclose(fp);
+
+    expect("text lines", text.n, ROUNDS * MIX_LINES);
+
+    /*
+     * binary output: the first rounds rotate the file, the last is
+     * appended to it by a run of its own, a second later
+     */
+
+    if (init(LOG_FILE, MLOG_OUTPUT_BINARY)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < ROUNDS - 1; i++) {
+        log_round(i);
+        mlog_flush();
+    }
+
+    mlog_uinit();
+
+    last = next_second();
+
+    if (init(LOG_FILE, MLOG_OUTPUT_BINARY)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    log_round(ROUNDS - 1);
+
+    mlog_uinit();
+
+    for (files = 0, i = 1; i <= KEEP; i++) {
+        snprintf(name, sizeof(name), "%s.%d", LOG_FILE, i);
+        files += access(name, F_OK) == 0;
+    }
+
+    expect("the binary file was rotated", files > 0, 1);
+
+    expect("decode", decode(&bin, ""), 0);
+    compare("decode", &text, &bin, MLOG_LEVEL_DEBUG, 0, ROUNDS - 1);
+
+    expect("decode -l", decode(&bin, "-l 1"), 0);
+    compare("decode -l 1", &text, &bin, MLOG_LEVEL_WARN, 0, ROUNDS - 1);
+
+    snprintf(opts, sizeof(opts), "-s %ld", (long) last);
+    expect("decode -s", decode(&bin, opts), 0);
+    compare("decode -s", &text, &bin, MLOG_LEVEL_DEBUG, ROUNDS - 1,
+            ROUNDS - 1);
+
+    snprintf(opts, sizeof(opts), "-e %ld -l 2", (long) last);
+    expect("decode -e", decode(&bin, opts), 0);
+    compare("decode -e -l 2", &text, &bin, MLOG_LEVEL_INFO, 0, ROUNDS - 2);
+
+    remove_files();
+
+    return expect_done();
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE        "/tmp/mlog_test_crash.log"
+#define CRASH_FILE      "/tmp/mlog_test_crash.rings"
+#define THREADS         2
+#define LINES           5000
+
+
+static void *
+flood(void *arg)
+{
+    int  i, id = (int) (long) arg;
+
+    for (i = 0; i < LINES; i++) {
+        mlog_info("crash thread=%d seq=%d", id, i);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Runs as a new program, so its deferred records point elsewhere than in
+ * the parent. The reorder window keeps every line in the kfifos until
+ * the process is killed.
+ */
+
+static int
+crash()
+{
+    int          i;
+    pthread_t    t[THREADS];
+    mlog_conf_t  conf;
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 1024 * 1024;
+    conf.format_mode = MLOG_FORMAT_DEFERRED;
+    conf.order = MLOG_ORDER_WINDOW;
+    conf.reorder_window = 60000;
+    conf.crash_file = CRASH_FILE;
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&t[i], NULL, flood, (void *) (long) i);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    raise(SIGKILL);
+
+    return 1;
+}
+
+
+/* counts the crashed run's lines and checks each thread's are in order */
+
+static long
+check_lines(long *after_last)
+{
+    int      id, seq, next[THREADS] = { 0 };
+    long     n = 0, bad = 0;
+    char     line[512], *p;
+    FILE    *fp;
+
+    *after_last = 0;
+
+    fp = fopen(LOG_FILE, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        *after_last = strstr(line, "after the crash") != NULL;
+
+        p = strstr(line, "crash thread=");
+        if (p == NULL
+            || sscanf(p, "crash thread=%d seq=%d", &id, &seq) != 2
+            || id < 0 || id >= THREADS)
+        {
+            continue;
+        }
+
+        bad += seq != next[id];
+        next[id] = seq + 1;
+        n++;
+    }
+
+    fclose(fp);
+
+    return bad ? -bad : n;
+}
+
+
+int main(int argc, char **argv)
+{
+    int          status;
+    long         lines, after_last;
+    pid_t        pid;
+    mlog_conf_t  conf;
+
+    if (argc > 1 && strcmp(argv[1], "crash") == 0) {
+        return crash();
+    }
+
+    unlink(LOG_FILE);
+    unlink(CRASH_FILE);
+
+    pid = fork();
+    if (pid == 0) {
+        execl("/proc/self/exe", argv[0], "crash", (char *) NULL);
+        _exit(1);
+    }
+
+    waitpid(pid, &status, 0);
+
+    expect("the child was killed",
+           WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL, 1);
+
+    expect("its lines are not in the file", check_lines(&after_last), 0);
+
+    /* the next run writes them before its own */
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 64 * 1024;
+    conf.crash_file = CRASH_FILE;
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    mlog_info("after the crash");
+
+    mlog_uinit();
+
+    lines = check_lines(&after_last);
+
+    expect("the crashed lines are recovered in order", lines,
+           THREADS * LINES);
+    expect("before the lines of the new run", after_last, 1);
+
+    /* and only once, by the run after */
+
+    pid = fork();
+    if (pid == 0) {
+        if (mlog_init_conf(&conf)) {
+            _exit(1);
+        }
+
+        mlog_uinit();
+        _exit(0);
+    }
+
+    waitpid(pid, &status, 0);
+
+    expect("the run after inits",
+           WIFEXITED(status) && WEXITSTATUS(status) == 0, 1);
+    expect("a clean run leaves nothing to recover", check_lines(&after_last),
+           THREADS * LINES);
+
+    return expect_done();
+}
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE        "/tmp/mlog_test_fatal.log"
+#define THREADS         2
+#define LINES           5000
+
+
+static void *
+flood(void *arg)
+{
+    int  i, id = (int) (long) arg;
+
+    for (i = 0; i < LINES; i++) {
+        mlog_info("fatal thread=%d seq=%d", id, i);
+    }
+
+    return NULL;
+}
+
+
+static void
+abort_handler(int signo)
+{
+    _exit(mlog_crash_flush() == THREADS * LINES + 1 ? 3 : 4);
+}
+
+
+/*
+ * The reorder window keeps every line in the kfifos, so only the drain
+ * of the crash handler gets them into the file.
+ */
+
+static void
+crash(int format_mode, int own_handler)
+{
+    int          i;
+    pthread_t    t[THREADS];
+    mlog_conf_t  conf;
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 1024 * 1024;
+    conf.format_mode = format_mode;
+    conf.order = MLOG_ORDER_WINDOW;
+    conf.reorder_window = 60000;
+    conf.fatal_flush = !own_handler;
+
+    if (mlog_init_conf(&conf)) {
+        _exit(1);
+    }
+
+    if (own_handler) {
+        signal(SIGABRT, abort_handler);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&t[i], NULL, flood, (void *) (long) i);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    mlog_error("about to crash");
+
+    if (own_handler) {
+        abort();
+    }
+
+    *(volatile int *) 0 = 0;
+
+    _exit(2);
+}
+
+
+static int
+recent_prefix(const char *line)
+{
+    char       level[8];
+    struct tm  tm;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_isdst = -1;
+
+    if (sscanf(line, "%d/%d/%d %d:%d:%d [%7[a-z]] ", &tm.tm_year, &tm.tm_mon,
+               &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, level) != 7
+        || strcmp(level, "info") != 0)
+    {
+        return 0;
+    }
+
+    tm.tm_year -= 1900;
+    tm.tm_mon--;
+
+    return labs((long) (mktime(&tm) - time(NULL))) < 300;
+}
+
+
+/* counts the lines and checks each thread's are in order */
+
+static long
+check_lines(long *found)
+{
+    int      id, seq, next[THREADS] = { 0 };
+    long     n = 0, bad = 0;
+    char     line[512], *p;
+    FILE    *fp;
+
+    *found = 0;
+
+    fp = fopen(LOG_FILE, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        *found += strstr(line, "about to crash") != NULL;
+
+        p = strstr(line, "fatal thread=");
+        if (p == NULL
+            || sscanf(p, "fatal thread=%d seq=%d", &id, &seq) != 2
+            || id < 0 || id >= THREADS)
+        {
+            continue;
+        }
+
+        /* a drained line has the prefix in local time, no snprintf */
+
+        bad += seq != next[id] || !recent_prefix(line);
+        next[id] = seq + 1;
+        n++;
+    }
+
+    fclose(fp);
+
+    return bad ? -bad : n;
+}
+
+
+static void
+run(const char *what, int format_mode, int own_handler, int signo,
+    int code)
+{
+    int     status;
+    long    found;
+    pid_t   pid;
+    char    buf[128];
+
+    unlink(LOG_FILE);
+
+    pid = fork();
+    if (pid == 0) {
+        crash(format_mode, own_handler);
+    }
+
+    waitpid(pid, &status, 0);
+
+    snprintf(buf, sizeof(buf), "%s: died as it would have", what);
+    expect(buf, signo ? WIFSIGNALED(status) && WTERMSIG(status) == signo
+                      : WIFEXITED(status) && WEXITSTATUS(status) == code, 1);
+
+    snprintf(buf, sizeof(buf), "%s: the queued lines are written in order",
+             what);
+    expect(buf, check_lines(&found), THREADS * LINES);
+
+    snprintf(buf, sizeof(buf), "%s: and the line before the crash", what);
+    expect(buf, found, 1);
+}
+
+
+int main(int argc, char **argv)
+{
+    run("SIGSEGV", MLOG_FORMAT_EAGER, 0, SIGSEGV, 0);
+    run("SIGSEGV deferred", MLOG_FORMAT_DEFERRED, 0, SIGSEGV, 0);
+    run("own SIGABRT handler", MLOG_FORMAT_EAGER, 1, 0, 3);
+
+    return expect_done();
+}
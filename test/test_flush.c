@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE        "/tmp/mlog_test_flush.log"
+#define THREADS         4
+#define LINES           2000
+
+
+static int
+count_lines(const char *needle)
+{
+    int      n = 0;
+    char     line[512];
+    FILE    *fp;
+
+    fp = fopen(LOG_FILE, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        n += strstr(line, needle) != NULL;
+    }
+
+    fclose(fp);
+
+    return n;
+}
+
+
+static double
+now_sec()
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* each thread only waits for its own lines */
+
+static void *
+writer(void *arg)
+{
+    int   i, id = (int) (long) arg;
+    char  needle[32];
+
+    for (i = 0; i < LINES; i++) {
+        mlog_info("flush thread=%d seq=%d", id, i);
+    }
+
+    if (mlog_flush() != 0) {
+        g_failed++;
+    }
+
+    snprintf(needle, sizeof(needle), "thread=%d ", id);
+
+    if (count_lines(needle) != LINES) {
+        printf("FAIL thread %d sees %d lines after mlog_flush()\n", id,
+               count_lines(needle));
+        g_failed++;
+    }
+
+    return NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+    int          i;
+    double       start;
+    pthread_t    t[THREADS];
+    mlog_conf_t  conf;
+
+    unlink(LOG_FILE);
+
+    /* batches wait 5 seconds unless something flushes them */
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 1024 * 1024;
+    conf.flush_usec = 5000000;
+    conf.order = MLOG_ORDER_WINDOW;
+    conf.reorder_window = 50;
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    mlog_info("held");
+    usleep(100000);
+    expect("an info line is held", count_lines("held"), 0);
+
+    mlog_error("urgent");
+
+    start = now_sec();
+
+    while (count_lines("urgent") != 1 && now_sec() - start < 2) {
+        usleep(1000);
+    }
+
+    expect("an error line writes the held batch",
+           count_lines("held") + count_lines("urgent"), 2);
+
+    mlog_info("barrier");
+    expect("mlog_flush() returns 0", mlog_flush(), 0);
+    expect("mlog_flush() writes the window", count_lines("barrier"), 1);
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&t[i], NULL, writer, (void *) (long) i);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    expect("every thread saw its lines", g_failed, 0);
+
+    mlog_uinit();
+
+    return expect_done();
+}
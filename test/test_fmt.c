@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE        "/tmp/mlog_test_fmt.log"
+#define MAX_LINES       16
+#define LINES           8
+#define LINE_LEN        2047    /* MLOG_MAX_LOG_LEN - 1, with the '\n' */
+
+
+static char    *g_lines[2][MAX_LINES];  /* of each mode, past the prefix */
+static int      g_nlines[2];
+static long     g_len[2][MAX_LINES];
+const char     *g_null;                 /* NULL, unknown to the compiler */
+
+
+/* one call site per line, so both modes log the same sites */
+
+static void *
+log_mix(void *arg)
+{
+    mlog_info("int %d %5i %-5u| %05x %X %o %c %%", -42, 7, 7u, 255, 255, 8,
+              'z');
+    mlog_info("long %ld %lld %zu %zd %jd %td", -1L, -9223372036854775807LL,
+              (size_t) 123, (ssize_t) -5, (intmax_t) -7, (ptrdiff_t) 9);
+    mlog_info("star %*d|%-*d|%.*s|%*.*s|", 6, 1, 6, 2, 3, "abcdef", 8, 2,
+              "xyz");
+    mlog_info("float %f %.2e %g %Lf", 3.25, 1234.5, 0.0001, (long double) 2.5);
+    mlog_info("ptr %p %p", (void *) 0x1234, (void *) NULL);
+    mlog_info("str %s %.2s %10s %-4s| %s", "abc", "abc", "right", "l",
+              g_null);
+    mlog_info("x=%3000d end", 7);
+    mlog_info("%2030s the literal tail runs past the end of the line", "s");
+
+    return NULL;
+}
+
+
+/* keeps what follows "func#line: " of each line, a '\0' in one fails */
+
+static int
+read_lines(int mode)
+{
+    int       n = 0;
+    char     *line = NULL, *p;
+    size_t    cap = 0;
+    FILE     *fp;
+    ssize_t   len;
+
+    fp = fopen(LOG_FILE, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while ((len = getline(&line, &cap, fp)) > 0 && n < MAX_LINES) {
+        p = strstr(line, ": ");
+        if ((size_t) len != strlen(line) || p == NULL) {
+            n = -1;
+            break;
+        }
+
+        g_len[mode][n] = len;
+        g_lines[mode][n++] = strdup(p + 2);
+    }
+
+    free(line);
+    fclose(fp);
+
+    return n;
+}
+
+
+static void
+run(int mode)
+{
+    pthread_t    t;
+    mlog_conf_t  conf;
+
+    unlink(LOG_FILE);
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 1024 * 1024;
+    conf.format_mode = mode;
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        g_failed++;
+        return;
+    }
+
+    pthread_create(&t, NULL, log_mix, NULL);
+    pthread_join(t, NULL);
+
+    mlog_uinit();
+
+    g_nlines[mode] = read_lines(mode);
+}
+
+
+int main(int argc, char **argv)
+{
+    int  i, same = 0;
+
+    run(MLOG_FORMAT_EAGER);
+    run(MLOG_FORMAT_DEFERRED);
+
+    unlink(LOG_FILE);
+
+    expect("eager lines without a '\\0'", g_nlines[MLOG_FORMAT_EAGER],
+           LINES);
+    expect("deferred lines without a '\\0'", g_nlines[MLOG_FORMAT_DEFERRED],
+           LINES);
+
+    if (g_failed) {
+        return expect_done();
+    }
+
+    for (i = 0; i < LINES; i++) {
+        if (strcmp(g_lines[MLOG_FORMAT_EAGER][i],
+                   g_lines[MLOG_FORMAT_DEFERRED][i]) == 0)
+        {
+            same++;
+            continue;
+        }
+
+        printf("eager:    %.200s", g_lines[MLOG_FORMAT_EAGER][i]);
+        printf("deferred: %.200s", g_lines[MLOG_FORMAT_DEFERRED][i]);
+    }
+
+    expect("the writer renders what the caller would", same, LINES);
+
+    for (i = 0; i < 2; i++) {
+        expect(i ? "deferred cuts an overlong argument"
+                 : "eager cuts an overlong argument", g_len[i][6], LINE_LEN);
+        expect(i ? "deferred cuts an overlong literal"
+                 : "eager cuts an overlong literal", g_len[i][7], LINE_LEN);
+    }
+
+    return expect_done();
+}
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <zlib.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+#include "../src/mlog_gz.h"
+
+
+/* build with -DMLOG_WITH_ZLIB and -lz */
+
+
+#define LOG_FILE        "/tmp/mlog_test_gzip.log"
+#define LINES           50000
+#define CRASH_LINES     20000
+
+
+/* inflates one member on its own, returns its lines or -1 */
+
+static long
+member_lines(const unsigned char *p, size_t size)
+{
+    long            n = 0;
+    int             ret;
+    z_stream        zs;
+    unsigned int    i;
+    unsigned char   out[65536];
+
+    memset(&zs, 0, sizeof(zs));
+
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+        return -1;
+    }
+
+    zs.next_in = (unsigned char *) p;
+    zs.avail_in = size;
+
+    do {
+        zs.next_out = out;
+        zs.avail_out = sizeof(out);
+
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            inflateEnd(&zs);
+            return -1;
+        }
+
+        for (i = 0; i < sizeof(out) - zs.avail_out; i++) {
+            n += out[i] == '\n';
+        }
+
+    } while (ret != Z_STREAM_END);
+
+    /* the member ends where its header said */
+
+    if (zs.avail_in != 0) {
+        n = -1;
+    }
+
+    inflateEnd(&zs);
+
+    return n;
+}
+
+
+/* reads the file back member by member */
+
+static void
+check_file(const char *what, long want)
+{
+    int             fd;
+    long            n, lines = 0, tail = 0, members = 0;
+    char            msg[128];
+    size_t          off, size;
+    struct stat     st;
+    unsigned char  *buf;
+
+    fd = open(LOG_FILE, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("open %s failed\n", LOG_FILE);
+        g_failed++;
+        return;
+    }
+
+    buf = malloc(st.st_size);
+    if (buf == NULL || read(fd, buf, st.st_size) != st.st_size) {
+        printf("read %s failed\n", LOG_FILE);
+        g_failed++;
+        return;
+    }
+
+    close(fd);
+
+    /* hop over the members by their headers alone */
+
+    for (off = 0; off < (size_t) st.st_size; off += size) {
+        size = mlog_gz_member_size(buf + off, st.st_size - off);
+
+        if (size == 0 || off + size > (size_t) st.st_size) {
+            break;
+        }
+
+        members++;
+
+        /* the second half is read starting at a member in the middle */
+
+        if (off >= (size_t) st.st_size / 2) {
+            n = member_lines(buf + off, size);
+            if (n < 0) {
+                break;
+            }
+
+            tail += n;
+        }
+    }
+
+    snprintf(msg, sizeof(msg), "%s: the headers chain to the end of the file",
+             what);
+    expect(msg, off, st.st_size);
+    snprintf(msg, sizeof(msg), "%s: more than one member", what);
+    expect(msg, members > 1, 1);
+    snprintf(msg, sizeof(msg), "%s: members in the middle inflate alone",
+             what);
+    expect(msg, tail > 0, 1);
+
+    for (off = 0; off < (size_t) st.st_size; off += size) {
+        size = mlog_gz_member_size(buf + off, st.st_size - off);
+        if (size == 0) {
+            break;
+        }
+
+        lines += member_lines(buf + off, size);
+    }
+
+    snprintf(msg, sizeof(msg), "%s: every line is in a member", what);
+    expect(msg, lines, want);
+
+    printf("%ld bytes in %ld members\n", (long) st.st_size, members);
+
+    free(buf);
+}
+
+
+/*
+ * The reorder window keeps the lines in the kfifos until the fatal signal
+ * handler drains them, which must not deflate
+ */
+
+static void *
+flood(void *arg)
+{
+    int  i;
+
+    for (i = 0; i < CRASH_LINES; i++) {
+        mlog_info("gzip seq=%d payload=%s", i, "some text that repeats");
+    }
+
+    return NULL;
+}
+
+
+static void
+crash()
+{
+    pthread_t    t;
+    mlog_conf_t  conf;
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 4 * 1024 * 1024;
+    conf.compress = MLOG_COMPRESS_GZIP;
+    conf.order = MLOG_ORDER_WINDOW;
+    conf.reorder_window = 60000;
+    conf.fatal_flush = 1;
+
+    if (mlog_init_conf(&conf)) {
+        _exit(1);
+    }
+
+    /* main's thread local kfifo went with the first mlog_uinit() */
+
+    pthread_create(&t, NULL, flood, NULL);
+    pthread_join(t, NULL);
+
+    *(volatile int *) 0 = 0;
+
+    _exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+    int             i, status;
+    pid_t           pid;
+    mlog_conf_t     conf;
+
+    unlink(LOG_FILE);
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 4 * 1024 * 1024;
+    conf.compress = MLOG_COMPRESS_GZIP;
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < LINES; i++) {
+        mlog_info("gzip seq=%d payload=%s", i, "some text that repeats");
+    }
+
+    mlog_uinit();
+
+    check_file("batches", LINES);
+
+    unlink(LOG_FILE);
+
+    pid = fork();
+    if (pid == 0) {
+        crash();
+    }
+
+    waitpid(pid, &status, 0);
+
+    expect("crash: died of SIGSEGV",
+           WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV, 1);
+
+    check_file("crash", CRASH_LINES);
+
+    unlink(LOG_FILE);
+
+    return expect_done();
+}
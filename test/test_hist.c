@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+#include "../src/mlog_hist.h"
+
+
+/* build with -DMLOG_LATENCY, the library too */
+
+
+#define LOG_FILE        "/tmp/mlog_test_hist.log"
+#define LINES           10000
+
+
+static mlog_hist_t      g_hist, g_part[2];
+
+
+/* the buckets tile the values in order, each within 1/16 of its values */
+
+static void
+check_buckets()
+{
+    unsigned int   i, last = 0, bad = 0;
+    unsigned long  v, low = 0;
+
+    for (v = 0; v < MLOG_HIST_SUB; v++) {
+        bad += mlog_hist_index(v) != v;
+    }
+
+    expect("a bucket per value below 16", bad, 0);
+
+    for (v = 1; v <= 1UL << 22; v++) {
+        i = mlog_hist_index(v);
+
+        if (i == last) {
+            continue;
+        }
+
+        /* the bucket that ended at v - 1 began at low */
+
+        bad += i != last + 1 || (low >= MLOG_HIST_SUB
+                                 && (v - low) * MLOG_HIST_SUB > low);
+        last = i;
+        low = v;
+    }
+
+    expect("the buckets follow each other, 1/16 wide", bad, 0);
+
+    expect("2^40 in the last range",
+           mlog_hist_index(1UL << MLOG_HIST_MAX_EXP) / MLOG_HIST_SUB,
+           MLOG_HIST_BUCKETS / MLOG_HIST_SUB - 1);
+    expect("2^41 in the last bucket",
+           mlog_hist_index(1UL << (MLOG_HIST_MAX_EXP + 1)),
+           MLOG_HIST_BUCKETS - 1);
+    expect("~0 in the last bucket", mlog_hist_index(~0UL),
+           MLOG_HIST_BUCKETS - 1);
+}
+
+
+/*
+ * 1..1000 once each: a quantile is the end of the bucket of its rank,
+ * 500 in 496..511, 990 in 960..991, 999 in 992..1023 but no more than
+ * the largest sample
+ */
+
+static void
+check_uniform()
+{
+    unsigned long  v;
+
+    expect("empty p50", mlog_hist_value_at(&g_hist, 0.5), 0);
+
+    for (v = 1; v <= 1000; v++) {
+        mlog_hist_add(&g_hist, v);
+        mlog_hist_add(&g_part[v & 1], v);
+    }
+
+    expect("count", g_hist.count, 1000);
+    expect("sum", g_hist.sum, 500500);
+    expect("max", g_hist.max, 1000);
+    expect("p50", mlog_hist_value_at(&g_hist, 0.5), 511);
+    expect("p99", mlog_hist_value_at(&g_hist, 0.99), 991);
+    expect("p999", mlog_hist_value_at(&g_hist, 0.999), 1000);
+    expect("p0 is the first sample", mlog_hist_value_at(&g_hist, 0), 1);
+
+    /* two halves merged are the whole */
+
+    mlog_hist_merge(&g_part[0], &g_part[1]);
+
+    expect("merged", memcmp(&g_part[0], &g_hist, sizeof(mlog_hist_t)), 0);
+}
+
+
+/* 998 of 100 and two outliers: 100 is in 100..103, 10000 in 9728..10239 */
+
+static void
+check_tail()
+{
+    int  i;
+
+    memset(&g_hist, 0, sizeof(mlog_hist_t));
+
+    for (i = 0; i < 998; i++) {
+        mlog_hist_add(&g_hist, 100);
+    }
+
+    mlog_hist_add(&g_hist, 10000);
+    mlog_hist_add(&g_hist, 1000000);
+
+    expect("tail p50", mlog_hist_value_at(&g_hist, 0.5), 103);
+    expect("tail p99", mlog_hist_value_at(&g_hist, 0.99), 103);
+    expect("tail p999", mlog_hist_value_at(&g_hist, 0.999), 10239);
+    expect("tail max", mlog_hist_value_at(&g_hist, 1), 1000000);
+}
+
+
+#ifdef MLOG_LATENCY
+
+static void *
+flood(void *arg)
+{
+    int  i;
+
+    for (i = 0; i < LINES; i++) {
+        mlog_info("hist seq=%d", i);
+    }
+
+    /* covers the lines of the calling thread */
+
+    mlog_flush();
+
+    return NULL;
+}
+
+
+/* the histograms mlog_get_latency() sums count every line once */
+
+static void
+check_latency()
+{
+    pthread_t       t;
+    mlog_conf_t     conf;
+    mlog_latency_t  queue, producer;
+
+    unlink(LOG_FILE);
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 1024 * 1024;
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        g_failed++;
+        return;
+    }
+
+    pthread_create(&t, NULL, flood, NULL);
+    pthread_join(t, NULL);
+
+    expect("mlog_get_latency", mlog_get_latency(&queue, &producer), 0);
+
+    mlog_uinit();
+
+    printf("producer p50=%lu p99=%lu p999=%lu max=%lu\n", producer.p50,
+           producer.p99, producer.p999, producer.max);
+    printf("queue    p50=%lu p99=%lu p999=%lu max=%lu\n", queue.p50,
+           queue.p99, queue.p999, queue.max);
+
+    expect("a producer sample per line", producer.count, LINES);
+    expect("a queue sample per line", queue.count, LINES);
+    expect("producer quantiles in order",
+           producer.p50 <= producer.p99 && producer.p99 <= producer.p999
+           && producer.p999 <= producer.max && producer.mean <= producer.max,
+           1);
+    expect("queue quantiles in order",
+           queue.p50 <= queue.p99 && queue.p99 <= queue.p999
+           && queue.p999 <= queue.max && queue.mean <= queue.max, 1);
+    expect("a line takes time", producer.p50 > 0 && queue.p50 > 0, 1);
+
+    unlink(LOG_FILE);
+}
+
+#endif
+
+
+int main(int argc, char **argv)
+{
+    check_buckets();
+    check_uniform();
+    check_tail();
+
+#ifdef MLOG_LATENCY
+    check_latency();
+#else
+    printf("built without -DMLOG_LATENCY, mlog_get_latency() skipped\n");
+#endif
+
+    return expect_done();
+}
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE        "/tmp/mlog_test_mmap.log"
+#define LINES           20000
+#define WINDOW          (256 * 1024)
+
+
+/* lines with the needle, and the NUL bytes of the file in *zeros */
+
+static long
+count_lines(const char *needle, long *zeros)
+{
+    int      c;
+    long     n = 0, len = 0;
+    char     line[512];
+    FILE    *fp;
+
+    *zeros = 0;
+
+    fp = fopen(LOG_FILE, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while ((c = getc(fp)) != EOF) {
+        if (c == '\0') {
+            (*zeros)++;
+            continue;
+        }
+
+        if (len < (long) sizeof(line) - 1) {
+            line[len++] = c;
+        }
+
+        if (c == '\n') {
+            line[len] = '\0';
+            n += strstr(line, needle) != NULL;
+            len = 0;
+        }
+    }
+
+    fclose(fp);
+
+    return n;
+}
+
+
+static int
+init_mmap(int fatal_flush)
+{
+    mlog_conf_t  conf;
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 4 * 1024 * 1024;
+    conf.io = MLOG_IO_MMAP;
+    conf.mmap_window = WINDOW;
+
+    if (fatal_flush) {
+        conf.order = MLOG_ORDER_WINDOW;
+        conf.reorder_window = 1000;
+        conf.fatal_flush = 1;
+    }
+
+    return mlog_init_conf(&conf);
+}
+
+
+/*
+ * The first line maps a window, the others stay in the kfifo for the
+ * fatal signal handler; they run past the window, which it must not move
+ */
+
+static void *
+crash(void *arg)
+{
+    int  i;
+
+    mlog_info("mapped");
+    sleep(2);
+
+    for (i = 0; i < LINES; i++) {
+        mlog_info("mmap crash seq=%d", i);
+    }
+
+    *(volatile int *) 0 = 0;
+
+    return NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+    int          i, status;
+    long         zeros;
+    pid_t        pid;
+    pthread_t    t;
+    struct stat  st;
+
+    unlink(LOG_FILE);
+
+    /* a child that dies without mlog_uinit() */
+
+    pid = fork();
+
+    if (pid == 0) {
+        if (init_mmap(0)) {
+            _exit(1);
+        }
+
+        for (i = 0; i < LINES; i++) {
+            mlog_info("mmap seq=%d", i);
+        }
+
+        mlog_flush();
+
+        _exit(0);
+    }
+
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || status != 0) {
+        printf("child failed\n");
+        return 1;
+    }
+
+    stat(LOG_FILE, &st);
+
+    expect("the dead child's lines are in the file",
+           count_lines("mmap seq=", &zeros), LINES);
+    expect("the file ends with its window", st.st_size % WINDOW, 0);
+
+    /* the next run trims the zeros and goes on after the last line */
+
+    if (init_mmap(0)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    mlog_info("after crash");
+    mlog_uinit();
+
+    stat(LOG_FILE, &st);
+
+    expect("the old lines stay", count_lines("mmap seq=", &zeros), LINES);
+    expect("the new line follows", count_lines("after crash", &zeros), 1);
+    expect("no zeros are left", zeros, 0);
+    expect("the size is truncated to the lines", st.st_size % WINDOW != 0,
+           1);
+
+    unlink(LOG_FILE);
+
+    /* main's thread local kfifo went with mlog_uinit(), log from another */
+
+    pid = fork();
+
+    if (pid == 0) {
+        if (init_mmap(1)) {
+            _exit(1);
+        }
+
+        pthread_create(&t, NULL, crash, NULL);
+        pthread_join(t, NULL);
+
+        _exit(2);
+    }
+
+    waitpid(pid, &status, 0);
+
+    expect("the crashed child died of SIGSEGV",
+           WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV, 1);
+    expect("its handler wrote the lines in and past the window",
+           count_lines("mmap crash seq=", &zeros), LINES);
+
+    unlink(LOG_FILE);
+
+    return expect_done();
+}
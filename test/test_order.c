@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE        "/tmp/mlog_test_order.log"
+#define THREADS         4
+#define TURNS           48
+#define BURST           50
+#define LINES           20000
+#define WINDOW          300     /* msec */
+
+
+static volatile int     g_turn;
+static volatile int     g_seen;
+
+
+static unsigned long
+now_msec(clockid_t clock)
+{
+    struct timespec  ts;
+
+    clock_gettime(clock, &ts);
+
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ * The threads log a burst each in turn, and the next turn begins once the
+ * clock the records take moved on, so every turn is later than the one
+ * before and a merge by time must keep the turns in order
+ */
+
+static void *
+take_turns(void *arg)
+{
+    int            i, turn, id = (int) (long) arg;
+    unsigned long  msec;
+
+    for (turn = id; turn < TURNS; turn += THREADS) {
+        while (__atomic_load_n(&g_turn, __ATOMIC_ACQUIRE) != turn) {
+            usleep(100);
+        }
+
+        for (i = 0; i < BURST; i++) {
+            mlog_info("order turn=%d thread=%d seq=%d", turn, id,
+                      turn / THREADS * BURST + i);
+        }
+
+        msec = now_msec(CLOCK_REALTIME_COARSE);
+
+        while (now_msec(CLOCK_REALTIME_COARSE) == msec) {
+            usleep(100);
+        }
+
+        __atomic_store_n(&g_turn, turn + 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+
+/* as fast as they can, only each thread's own order is kept */
+
+static void *
+flood(void *arg)
+{
+    int  i, id = (int) (long) arg;
+
+    for (i = 0; i < LINES; i++) {
+        mlog_info("order turn=0 thread=%d seq=%d", id, i);
+    }
+
+    return NULL;
+}
+
+
+/* logs one line and stays, an exited thread's kfifo is not held */
+
+static void *
+log_one(void *arg)
+{
+    mlog_info("order hold");
+
+    while (!__atomic_load_n(&g_seen, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+
+    return NULL;
+}
+
+
+static int
+count_lines(const char *needle)
+{
+    int      n = 0;
+    char     line[512];
+    FILE    *fp;
+
+    fp = fopen(LOG_FILE, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        n += strstr(line, needle) != NULL;
+    }
+
+    fclose(fp);
+
+    return n;
+}
+
+
+/* lines in each thread's order, *turns whether the turns never go back */
+
+static long
+check_lines(int *turns)
+{
+    int      turn, id, seq, last = 0, next[THREADS] = { 0 };
+    long     n = 0, bad = 0;
+    char     line[512], *p;
+    FILE    *fp;
+
+    *turns = 1;
+
+    fp = fopen(LOG_FILE, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        p = strstr(line, "order turn=");
+        if (p == NULL
+            || sscanf(p, "order turn=%d thread=%d seq=%d", &turn, &id, &seq)
+               != 3
+            || id < 0 || id >= THREADS)
+        {
+            continue;
+        }
+
+        bad += seq != next[id];
+        next[id] = seq + 1;
+
+        if (turn < last) {
+            *turns = 0;
+        }
+
+        last = turn;
+        n++;
+    }
+
+    fclose(fp);
+
+    return bad ? -bad : n;
+}
+
+
+static int
+init(int order)
+{
+    int          i;
+    mlog_conf_t  conf;
+
+    unlink(LOG_FILE);
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 1024 * 1024;
+    conf.order = order;
+    conf.reorder_window = WINDOW;
+
+    /* a dropped line would look out of order */
+
+    for (i = MLOG_LEVEL_ERROR; i <= MLOG_LEVEL_DEBUG; i++) {
+        conf.overflow[i] = MLOG_OVERFLOW_BLOCK;
+    }
+
+    return mlog_init_conf(&conf);
+}
+
+
+static void
+run(const char *what, int order, void *(*func)(void *), long want,
+    int ordered)
+{
+    int          i, turns;
+    char         buf[128];
+    pthread_t    t[THREADS];
+
+    if (init(order)) {
+        printf("mlog init failed\n");
+        g_failed++;
+        return;
+    }
+
+    g_turn = 0;
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&t[i], NULL, func, (void *) (long) i);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    mlog_uinit();
+
+    snprintf(buf, sizeof(buf), "%s: every line in its thread's order", what);
+    expect(buf, check_lines(&turns), want);
+
+    if (ordered) {
+        snprintf(buf, sizeof(buf), "%s: the turns in time order", what);
+        expect(buf, turns, 1);
+    }
+}
+
+
+/* msec from the line being logged to it showing up in the file */
+
+static long
+hold(int order)
+{
+    long           waited = -1;
+    pthread_t      t;
+    unsigned long  start;
+
+    if (init(order)) {
+        return -1;
+    }
+
+    g_seen = 0;
+
+    start = now_msec(CLOCK_MONOTONIC);
+
+    pthread_create(&t, NULL, log_one, NULL);
+
+    while (now_msec(CLOCK_MONOTONIC) - start < 4 * WINDOW) {
+        if (count_lines("order hold")) {
+            waited = now_msec(CLOCK_MONOTONIC) - start;
+            break;
+        }
+
+        usleep(5000);
+    }
+
+    __atomic_store_n(&g_seen, 1, __ATOMIC_RELEASE);
+    pthread_join(t, NULL);
+
+    mlog_uinit();
+
+    return waited;
+}
+
+
+int main(int argc, char **argv)
+{
+    long  waited;
+
+    run("thread", MLOG_ORDER_THREAD, flood, THREADS * LINES, 0);
+    run("thread turns", MLOG_ORDER_THREAD, take_turns, TURNS * BURST, 0);
+    run("global", MLOG_ORDER_GLOBAL, take_turns, TURNS * BURST, 1);
+    run("window", MLOG_ORDER_WINDOW, take_turns, TURNS * BURST, 1);
+
+    /* the window holds a line that long, global writes it at once */
+
+    waited = hold(MLOG_ORDER_WINDOW);
+    printf("window held a line %ld msec\n", waited);
+
+    expect("window: a line waits out the window", waited >= WINDOW - 20, 1);
+    expect("window: and no more than twice", waited < 2 * WINDOW, 1);
+
+    waited = hold(MLOG_ORDER_GLOBAL);
+    printf("global held a line %ld msec\n", waited);
+
+    expect("global: a line is written at once",
+           waited >= 0 && waited < WINDOW / 2, 1);
+
+    unlink(LOG_FILE);
+
+    return expect_done();
+}
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE        "/tmp/mlog_test_overflow.log"
+#define THREADS         8
+#define LINES           20000
+
+
+static void *
+flood(void *arg)
+{
+    int  i, id = (int) (long) arg;
+
+    for (i = 0; i < LINES; i++) {
+        mlog_info("overflow thread=%d seq=%d payload=%s", id, i,
+                  "some bytes to fill the small kfifo faster");
+    }
+
+    mlog_flush();
+
+    return NULL;
+}
+
+
+/*
+ * Counts the lines, each must parse; with in_order a thread's lines must
+ * come in order with holes only, spilled ones may not.
+ */
+
+static long
+check_lines(int in_order)
+{
+    int      id, seq, last[THREADS];
+    long     n = 0, bad = 0;
+    char     line[512], *p;
+    FILE    *fp;
+
+    memset(last, -1, sizeof(last));
+
+    fp = fopen(LOG_FILE, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        p = strstr(line, "overflow thread=");
+        if (p == NULL) {
+            continue;
+        }
+
+        if (sscanf(p, "overflow thread=%d seq=%d", &id, &seq) != 2
+            || id < 0 || id >= THREADS || seq < 0 || seq >= LINES
+            || strstr(p, "fill the small kfifo faster\n") == NULL)
+        {
+            bad++;
+            continue;
+        }
+
+        bad += in_order && seq <= last[id];
+        last[id] = seq;
+        n++;
+    }
+
+    fclose(fp);
+
+    return bad ? -bad : n;
+}
+
+
+static void
+run(const char *what, int policy)
+{
+    int           i;
+    long          lines;
+    char          buf[128];
+    pthread_t     t[THREADS];
+    mlog_conf_t   conf;
+    mlog_stats_t  base, stats;
+
+    unlink(LOG_FILE);
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 4096;
+    conf.spill_size = 64 * 1024;
+
+    for (i = MLOG_LEVEL_ERROR; i <= MLOG_LEVEL_DEBUG; i++) {
+        conf.overflow[i] = policy;
+    }
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        g_failed++;
+        return;
+    }
+
+    /* the counters of exited threads live on from the run before */
+
+    mlog_get_stats(&base);
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&t[i], NULL, flood, (void *) (long) i);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    mlog_get_stats(&stats);
+    mlog_uinit();
+
+    stats.total.overwritten -= base.total.overwritten;
+    stats.total.spilled -= base.total.spilled;
+    stats.total.dropped -= base.total.dropped;
+
+    lines = check_lines(policy == MLOG_OVERFLOW_OVERWRITE);
+
+    snprintf(buf, sizeof(buf), "%s: lines intact and in order", what);
+    expect(buf, lines >= 0, 1);
+
+    snprintf(buf, sizeof(buf), "%s: written, overwritten or dropped", what);
+    expect(buf, lines + stats.total.overwritten + stats.total.dropped,
+           THREADS * LINES);
+
+    printf("%s: written %ld overwritten %lu spilled %lu dropped %lu\n", what,
+           lines, stats.total.overwritten, stats.total.spilled,
+           stats.total.dropped);
+}
+
+
+int main(int argc, char **argv)
+{
+    run("overwrite", MLOG_OVERFLOW_OVERWRITE);
+    run("spill", MLOG_OVERFLOW_SPILL);
+
+    unlink(LOG_FILE);
+
+    return expect_done();
+}
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE        "/tmp/mlog_test_rotate.log"
+#define ROTATE_SIZE     (64 * 1024)
+#define KEEP            3
+
+
+static long
+file_size(const char *name)
+{
+    struct stat  st;
+
+    return stat(name, &st) == 0 ? st.st_size : -1;
+}
+
+
+static long
+count_lines(const char *name, const char *needle)
+{
+    long     n = 0;
+    char     line[512];
+    FILE    *fp;
+
+    fp = fopen(name, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        n += strstr(line, needle) != NULL;
+    }
+
+    fclose(fp);
+
+    return n;
+}
+
+
+static void
+cleanup()
+{
+    int   i;
+    char  name[64];
+
+    unlink(LOG_FILE);
+    unlink(LOG_FILE ".moved");
+
+    for (i = 1; i <= KEEP + 1; i++) {
+        snprintf(name, sizeof(name), "%s.%d", LOG_FILE, i);
+        unlink(name);
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    int          i;
+    long         big = 0;
+    char         name[64];
+    mlog_conf_t  conf;
+
+    cleanup();
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 1024 * 1024;
+    conf.rotate_size = ROTATE_SIZE;
+    conf.rotate_keep = KEEP;
+    conf.reopen_signal = SIGHUP;
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    expect("the next file is ready", file_size(LOG_FILE ".next"), 0);
+
+    /* about 10 files worth, in pieces so no batch is too far over */
+
+    for (i = 0; i < 10000; i++) {
+        mlog_info("rotate seq=%d", i);
+
+        if (i % 100 == 99) {
+            mlog_flush();
+        }
+    }
+
+    mlog_flush();
+
+    for (i = 1; i <= KEEP; i++) {
+        snprintf(name, sizeof(name), "%s.%d", LOG_FILE, i);
+
+        if (file_size(name) > ROTATE_SIZE + 64 * 1024) {
+            big++;
+        }
+    }
+
+    expect("rotated files are there",
+           file_size(LOG_FILE ".1") > 0 && file_size(LOG_FILE ".3") > 0, 1);
+    expect("older ones are gone", file_size(LOG_FILE ".4"), -1);
+    expect("rotated files are about rotate_size", big, 0);
+    expect("the last line is in the current file",
+           count_lines(LOG_FILE, "seq=9999"), 1);
+
+    /* what logrotate without copytruncate does */
+
+    rename(LOG_FILE, LOG_FILE ".moved");
+    raise(SIGHUP);
+
+    mlog_info("reopened");
+    mlog_flush();
+
+    expect("the moved file keeps its lines",
+           count_lines(LOG_FILE ".moved", "seq=9999"), 1);
+    expect("SIGHUP reopens the file", count_lines(LOG_FILE, "reopened"), 1);
+
+    mlog_uinit();
+
+    expect("the unused next file is removed", file_size(LOG_FILE ".next"),
+           -1);
+
+    cleanup();
+
+    return expect_done();
+}
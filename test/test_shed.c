@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE        "/tmp/mlog_test_shed.log"
+#define THREADS         4
+#define LINES           200000
+#define ERROR_EVERY     1000
+#define SMALL_SIZE      1024    /* kfifo_alloc() takes a page */
+#define RECORD_MAX      256     /* a record of the lines logged here */
+
+
+static unsigned int     g_peak[THREADS];
+static unsigned int     g_size[THREADS];
+
+
+static void *
+flood(void *arg)
+{
+    int  i, id = (int) (long) arg;
+
+    for (i = 0; i < LINES; i++) {
+        if (i % ERROR_EVERY == 0) {
+            mlog_error("flood thread=%d seq=%d", id, i);
+
+        } else if (i & 1) {
+            mlog_debug("flood thread=%d seq=%d payload=%s", id, i,
+                       "debug payload debug payload");
+
+        } else {
+            mlog_info("flood thread=%d seq=%d payload=%s", id, i,
+                      "info payload info payload");
+        }
+    }
+
+    return NULL;
+}
+
+
+/* INFO only, then the thread's own kfifo stats while it is still live */
+
+static void *
+flood_info(void *arg)
+{
+    int           i, id = (int) (long) arg;
+    pid_t         tid = syscall(SYS_gettid);
+    mlog_stats_t  stats;
+
+    for (i = 0; i < LINES / 4; i++) {
+        mlog_info("odd thread=%d seq=%d payload=%s", id, i,
+                  "info payload info payload");
+    }
+
+    if (mlog_get_stats(&stats) != 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < MLOG_STATS_THREADS; i++) {
+        if (stats.threads[i].tid == tid) {
+            g_peak[id] = stats.threads[i].peak;
+            g_size[id] = stats.threads[i].size;
+        }
+    }
+
+    return NULL;
+}
+
+
+static int
+count_lines(const char *needle)
+{
+    int      n = 0;
+    char     line[512];
+    FILE    *fp;
+
+    fp = fopen(LOG_FILE, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        n += strstr(line, needle) != NULL;
+    }
+
+    fclose(fp);
+
+    return n;
+}
+
+
+int main(int argc, char **argv)
+{
+    int          i, errors, want;
+    pthread_t    t[THREADS];
+    mlog_conf_t  conf;
+
+    unlink(LOG_FILE);
+
+    /* a small kfifo, the writer can not keep up with 4 threads */
+
+    mlog_conf_default(&conf);
+
+    conf.level = MLOG_LEVEL_DEBUG;
+    conf.filename = LOG_FILE;
+    conf.buf_size = 64 * 1024;
+    conf.watermark[MLOG_LEVEL_DEBUG] = 25;
+    conf.watermark[MLOG_LEVEL_INFO] = 50;
+    conf.watermark[MLOG_LEVEL_WARN] = 75;
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&t[i], NULL, flood, (void *) (long) i);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    mlog_uinit();
+
+    errors = count_lines("[error]");
+    want = THREADS * LINES / ERROR_EVERY;
+
+    printf("error=%d of %d info=%d debug=%d\n", errors, want,
+           count_lines("[info]"), count_lines("[debug]"));
+
+    expect("every error line is kept", errors, want);
+
+    /* below a page kfifo_alloc() rounds buf_size up, the watermark is of it */
+
+    unlink(LOG_FILE);
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = SMALL_SIZE;
+    conf.watermark[MLOG_LEVEL_INFO] = 50;
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&t[i], NULL, flood_info, (void *) (long) i);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    mlog_uinit();
+
+    for (i = 0; i < THREADS; i++) {
+        printf("thread=%d size=%u peak=%u\n", i, g_size[i], g_peak[i]);
+
+        expect("the kfifo is rounded up", g_size[i] > SMALL_SIZE, 1);
+        expect("info fills half the kfifo, not half of buf_size",
+               g_peak[i] > SMALL_SIZE, 1);
+        expect("and no more", g_peak[i] <= g_size[i] / 2 + RECORD_MAX, 1);
+    }
+
+    unlink(LOG_FILE);
+
+    return expect_done();
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE        "/tmp/mlog_test_sigsafe.log"
+#define THREADS         2
+#define LINES           200000
+
+
+static volatile int         g_seq[THREADS];     /* lines of each handler */
+static __thread int         g_id = -1;
+
+
+/* interrupts the thread anywhere, also in the middle of mlog_info() */
+
+static void
+prof_handler(int signo)
+{
+    if (g_id < 0) {
+        mlog_info_sigsafe("sig thread=%d seq=%d", g_id, 0);
+        return;
+    }
+
+    mlog_info_sigsafe("sig thread=%d seq=%d from=%s", g_id, g_seq[g_id]++,
+                      "SIGPROF");
+}
+
+
+static void *
+flood(void *arg)
+{
+    int       i;
+    sigset_t  set;
+
+    g_id = (int) (long) arg;
+
+    if (mlog_sigsafe_register() != 0) {
+        printf("register failed\n");
+        return NULL;
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    for (i = 0; i < LINES; i++) {
+        mlog_info("flood thread=%d seq=%d payload=%s", g_id, i,
+                  "flood payload");
+    }
+
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    return NULL;
+}
+
+
+/* checks each thread's lines of either kind are all there and in order */
+
+static long
+check_lines(const char *kind, long *stray)
+{
+    int      id, seq, next[THREADS] = { 0 };
+    long     n = 0, bad = 0;
+    char     line[512], needle[32], fmt[64], *p;
+    FILE    *fp;
+
+    *stray = 0;
+
+    fp = fopen(LOG_FILE, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    snprintf(needle, sizeof(needle), "%s thread=", kind);
+    snprintf(fmt, sizeof(fmt), "%s%%d seq=%%d", needle);
+
+    while (fgets(line, sizeof(line), fp)) {
+        p = strstr(line, needle);
+        if (p == NULL || sscanf(p, fmt, &id, &seq) != 2) {
+            continue;
+        }
+
+        if (id < 0 || id >= THREADS) {
+            (*stray)++;
+            continue;
+        }
+
+        bad += seq != next[id];
+        next[id] = seq + 1;
+        n++;
+    }
+
+    fclose(fp);
+
+    return bad ? -bad : n;
+}
+
+
+int main(int argc, char **argv)
+{
+    int                 i;
+    long                stray, sig_lines;
+    sigset_t            set;
+    pthread_t           t[THREADS];
+    mlog_conf_t         conf;
+    mlog_stats_t        stats;
+    struct sigaction    sa;
+    struct itimerval    it;
+
+    unlink(LOG_FILE);
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 1024 * 1024;
+    conf.sig_buf_size = 64 * 1024;
+    conf.overflow[MLOG_LEVEL_INFO] = MLOG_OVERFLOW_BLOCK;
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prof_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    /* a thread that never logged has no kfifo for its handlers */
+
+    raise(SIGPROF);
+
+    /* only the flooding threads take the profiling signal */
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 1000;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_PROF, &it, NULL);
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&t[i], NULL, flood, (void *) (long) i);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, NULL);
+
+    mlog_get_stats(&stats);
+    mlog_uinit();
+
+    printf("handler lines %d %d\n", g_seq[0], g_seq[1]);
+
+    expect("the profiling signal fired", g_seq[0] + g_seq[1] > 0, 1);
+    expect("no line was dropped", stats.total.dropped, 0);
+    expect("the interrupted lines are all there in order",
+           check_lines("flood", &stray), THREADS * LINES);
+
+    sig_lines = check_lines("sig", &stray);
+
+    expect("the handlers' lines are all there in order", sig_lines,
+           g_seq[0] + g_seq[1]);
+    expect("none from a thread without a kfifo", stray, 0);
+
+    return expect_done();
+}
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE        "/tmp/mlog_test_sink.log"
+#define WARN_FILE       "/tmp/mlog_test_sink.warn"
+#define DGRAM_PATH      "/tmp/mlog_test_sink.dgram"
+#define STREAM_PATH     "/tmp/mlog_test_sink.stream"
+#define THREADS         2
+#define LINES           20000
+
+
+static int      g_dgram_fd;
+static long     g_dgram_lines;  /* by the collector */
+static long     g_dgram_bad;
+
+
+/* every fourth line at each level, so each sink takes a known share */
+
+static void *
+flood(void *arg)
+{
+    int  i, id = (int) (long) arg;
+
+    for (i = 0; i < LINES; i++) {
+        switch (i % 4) {
+        case MLOG_LEVEL_ERROR:
+            mlog_error("sink thread=%d seq=%d level=0", id, i);
+            break;
+        case MLOG_LEVEL_WARN:
+            mlog_warn("sink thread=%d seq=%d level=1", id, i);
+            break;
+        case MLOG_LEVEL_INFO:
+            mlog_info("sink thread=%d seq=%d level=2", id, i);
+            break;
+        default:
+            mlog_debug("sink thread=%d seq=%d level=3", id, i);
+        }
+    }
+
+    /* the writer handed them to the sinks before it wrote the file */
+
+    mlog_flush();
+
+    return NULL;
+}
+
+
+/*
+ * Checks a line is of a level the destination takes and comes after the
+ * last one of its thread. Returns 1 for a line of the test, 0 otherwise.
+ */
+
+static int
+check_line(const char *line, int max_level, int *last, long *bad)
+{
+    int          id, seq, level;
+    const char  *p;
+
+    p = strstr(line, "sink thread=");
+    if (p == NULL
+        || sscanf(p, "sink thread=%d seq=%d level=%d", &id, &seq, &level) != 3
+        || id < 0 || id >= THREADS)
+    {
+        return 0;
+    }
+
+    *bad += level > max_level || seq <= last[id];
+    last[id] = seq;
+
+    return 1;
+}
+
+
+static long
+count_lines(const char *path, int max_level)
+{
+    int      last[THREADS] = { -1, -1 };
+    long     n = 0, bad = 0;
+    char     line[512];
+    FILE    *fp;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        n += check_line(line, max_level, last, &bad);
+    }
+
+    fclose(fp);
+
+    return bad ? -bad : n;
+}
+
+
+/* a local collector, a datagram is one line */
+
+static void *
+collect(void *arg)
+{
+    int      last[THREADS] = { -1, -1 };
+    char     line[4096];
+    ssize_t  n;
+
+    for ( ;; ) {
+        n = recv(g_dgram_fd, line, sizeof(line) - 1, 0);
+        if (n <= 0) {
+            break;
+        }
+
+        line[n] = '\0';
+
+        if (strcmp(line, "end") == 0) {
+            break;
+        }
+
+        g_dgram_bad += strchr(line, '\n') != line + n - 1;
+        g_dgram_lines += check_line(line, MLOG_LEVEL_INFO, last,
+                                    &g_dgram_bad);
+    }
+
+    return NULL;
+}
+
+
+static int
+unix_socket(const char *path, int type)
+{
+    int                  fd;
+    struct sockaddr_un   addr;
+
+    unlink(path);
+
+    fd = socket(AF_UNIX, type, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+        || (type == SOCK_STREAM && listen(fd, 1) != 0))
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+int main(int argc, char **argv)
+{
+    int                   i, stream_fd, fd;
+    pthread_t             t[THREADS], collector;
+    mlog_conf_t           conf;
+    mlog_stats_t          stats;
+    struct sockaddr_un    addr;
+
+    unlink(LOG_FILE);
+    unlink(WARN_FILE);
+
+    g_dgram_fd = unix_socket(DGRAM_PATH, SOCK_DGRAM);
+
+    /* listens but never accepts, its sink fills up and stays stuck */
+
+    stream_fd = unix_socket(STREAM_PATH, SOCK_STREAM);
+
+    if (g_dgram_fd < 0 || stream_fd < 0) {
+        printf("socket failed\n");
+        return 1;
+    }
+
+    pthread_create(&collector, NULL, collect, NULL);
+
+    mlog_conf_default(&conf);
+
+    conf.level = MLOG_LEVEL_DEBUG;
+    conf.filename = LOG_FILE;
+    conf.buf_size = 1024 * 1024;
+
+    for (i = MLOG_LEVEL_ERROR; i <= MLOG_LEVEL_DEBUG; i++) {
+        conf.overflow[i] = MLOG_OVERFLOW_BLOCK;
+    }
+
+    conf.sinks[0].type = MLOG_SINK_FILE;
+    conf.sinks[0].path = WARN_FILE;
+    conf.sinks[0].level = MLOG_LEVEL_WARN;
+    conf.sinks[0].buf_size = 4 * 1024 * 1024;
+
+    conf.sinks[1].type = MLOG_SINK_UNIX_DGRAM;
+    conf.sinks[1].path = DGRAM_PATH;
+    conf.sinks[1].level = MLOG_LEVEL_INFO;
+    conf.sinks[1].buf_size = 8 * 1024 * 1024;
+
+    conf.sinks[2].type = MLOG_SINK_UNIX_STREAM;
+    conf.sinks[2].path = STREAM_PATH;
+    conf.sinks[2].level = MLOG_LEVEL_DEBUG;
+    conf.sinks[2].buf_size = 64 * 1024;
+
+    conf.nsinks = 3;
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&t[i], NULL, flood, (void *) (long) i);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    mlog_get_stats(&stats);
+
+    /* the stuck sink gives up on what it still holds */
+
+    mlog_uinit();
+
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, DGRAM_PATH);
+    sendto(fd, "end", 3, 0, (struct sockaddr *) &addr, sizeof(addr));
+    close(fd);
+
+    pthread_join(collector, NULL);
+
+    expect("the file has every line", count_lines(LOG_FILE, MLOG_LEVEL_DEBUG),
+           THREADS * LINES);
+    expect("the file sink has ERROR and WARN in order",
+           count_lines(WARN_FILE, MLOG_LEVEL_WARN), THREADS * LINES / 2);
+    expect("the socket has up to INFO, a line per datagram",
+           g_dgram_lines, THREADS * LINES / 4 * 3);
+    expect("in order", g_dgram_bad, 0);
+    expect("the stuck sink dropped lines", stats.sink_dropped > 0, 1);
+    expect("queued to all sinks",
+           stats.sink_lines + stats.sink_dropped,
+           THREADS * LINES / 2 + THREADS * LINES / 4 * 3 + THREADS * LINES);
+
+    close(g_dgram_fd);
+    close(stream_fd);
+    unlink(DGRAM_PATH);
+    unlink(STREAM_PATH);
+    unlink(WARN_FILE);
+
+    return expect_done();
+}
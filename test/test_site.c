@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE    "/tmp/mlog_test_site.log"
+
+
+static int      g_calls;
+
+
+static int
+count_call()
+{
+    return ++g_calls;
+}
+
+
+static void
+net_recv()
+{
+    mlog_debug("net_recv debug %d", count_call());
+    mlog_info("net_recv info %d", count_call());
+}
+
+
+static void
+disk_read()
+{
+    mlog_debug("disk_read debug %d", count_call());
+    mlog_info("disk_read info %d", count_call());
+}
+
+
+static void
+storm()
+{
+    mlog_error("storm %d", count_call());
+}
+
+
+static void
+count_enabled(const mlog_site_t *site, void *data)
+{
+    if (strcmp(site->file, __FILE__) == 0 && site->level > MLOG_LEVEL_ERROR
+        && site->enabled)
+    {
+        (*(int *) data)++;
+    }
+}
+
+
+static int
+count_lines(const char *needle)
+{
+    int      n = 0;
+    char     line[512], *p;
+    FILE    *fp;
+
+    fp = fopen(LOG_FILE, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        p = strstr(line, needle);
+        if (p == NULL) {
+            continue;
+        }
+
+        /* "repeated N times" lines count N */
+
+        p = strstr(line, "repeated ");
+        n += p ? atoi(p + sizeof("repeated ") - 1) : 1;
+    }
+
+    fclose(fp);
+
+    return n;
+}
+
+
+int main(int argc, char **argv)
+{
+    int  i, enabled = 0;
+
+    unlink(LOG_FILE);
+
+    if (mlog_init(MLOG_LEVEL_INFO, LOG_FILE, 1024 * 1024)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    mlog_site_walk(count_enabled, &enabled);
+    expect("info level enables the 2 info sites", enabled, 2);
+
+    /* disabled sites do not evaluate their arguments */
+
+    net_recv();
+    disk_read();
+    expect("only enabled calls evaluate arguments", g_calls, 2);
+
+    expect("enable debug in net_recv",
+           mlog_site_set("test_site.c", "net_recv", 0, 0, MLOG_LEVEL_DEBUG,
+                         1), 1);
+    expect("a partial file name does not match",
+           mlog_site_set("site.c", NULL, 0, 0, MLOG_LEVEL_ANY, 1), 0);
+
+    net_recv();
+    disk_read();
+
+    expect("disable a line range",
+           mlog_site_set(__FILE__, NULL, 1, __LINE__, MLOG_LEVEL_INFO, 0), 2);
+
+    net_recv();
+    disk_read();
+
+    /* a burst of 5, then 10 lines per second */
+
+    expect("limit the storm site",
+           mlog_site_limit(NULL, "storm", 0, 0, MLOG_LEVEL_ANY, 10, 5,
+                           MLOG_LIMIT_REPORT), 1);
+
+    g_calls = 0;
+
+    for (i = 0; i < 1000000; i++) {
+        storm();
+    }
+
+    printf("storm let %d of %d calls through\n", g_calls, i);
+    expect("the storm is cut to the burst", g_calls >= 5 && g_calls < 100, 1);
+
+    mlog_set_log_level(MLOG_LEVEL_ERROR);
+    enabled = 0;
+    mlog_site_walk(count_enabled, &enabled);
+    expect("the global level resets the sites", enabled, 0);
+
+    mlog_uinit();
+
+    expect("net_recv debug lines", count_lines("net_recv debug"), 2);
+    expect("net_recv info lines", count_lines("net_recv info"), 2);
+    expect("disk_read debug lines", count_lines("disk_read debug"), 0);
+    expect("disk_read info lines", count_lines("disk_read info"), 2);
+    expect("storm lines and repeats", count_lines("storm"), 1000000);
+
+    return expect_done();
+}
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE        "/tmp/mlog_test_stats.log"
+#define STATS_FILE      "/tmp/mlog_test_stats.stats"
+#define THREADS         4
+#define LINES           20000   /* a quarter of each level */
+
+
+static void *
+flood(void *arg)
+{
+    int  i, id = (int) (long) arg;
+
+    for (i = 0; i < LINES; i++) {
+        switch (i & 3) {
+        case MLOG_LEVEL_ERROR:
+            mlog_error("stats thread=%d seq=%d", id, i);
+            break;
+        case MLOG_LEVEL_WARN:
+            mlog_warn("stats thread=%d seq=%d", id, i);
+            break;
+        case MLOG_LEVEL_INFO:
+            mlog_info("stats thread=%d seq=%d", id, i);
+            break;
+        default:
+            mlog_debug("stats thread=%d seq=%d", id, i);
+        }
+    }
+
+    return NULL;
+}
+
+
+/* the lines of the flood and their bytes */
+
+static long
+count_lines(long *bytes)
+{
+    long     n = 0;
+    char     line[512];
+    FILE    *fp;
+
+    *bytes = 0;
+
+    fp = fopen(LOG_FILE, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (strstr(line, "stats thread=")) {
+            *bytes += strlen(line);
+            n++;
+        }
+    }
+
+    fclose(fp);
+
+    return n;
+}
+
+
+/* as tools/mlogstat reads it, the writer updates it as a seqlock */
+
+static int
+read_stats(const volatile mlog_stats_t *map, mlog_stats_t *stats)
+{
+    int            i;
+    unsigned long  seq;
+
+    for (i = 0; i < 1000; i++) {
+        seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE);
+
+        if (seq & 1) {
+            usleep(100);
+            continue;
+        }
+
+        memcpy(stats, (const void *) map, sizeof(mlog_stats_t));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&map->seq, __ATOMIC_RELAXED) == seq) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+static unsigned long
+sum_levels(const unsigned long *v)
+{
+    int            i;
+    unsigned long  n = 0;
+
+    for (i = MLOG_LEVEL_ERROR; i <= MLOG_LEVEL_DEBUG; i++) {
+        n += v[i];
+    }
+
+    return n;
+}
+
+
+int main(int argc, char **argv)
+{
+    int            i, fd;
+    long           lines, bytes, queued;
+    pthread_t      t[THREADS];
+    mlog_conf_t    conf;
+    mlog_stats_t   before, after, file, last, *map;
+
+    unlink(LOG_FILE);
+    unlink(STATS_FILE);
+
+    /* a small kfifo that drops, but ERROR blocks and loses nothing */
+
+    mlog_conf_default(&conf);
+
+    conf.level = MLOG_LEVEL_DEBUG;
+    conf.filename = LOG_FILE;
+    conf.buf_size = 4096;
+    conf.stats_file = STATS_FILE;
+    conf.overflow[MLOG_LEVEL_ERROR] = MLOG_OVERFLOW_BLOCK;
+    conf.watermark[MLOG_LEVEL_DEBUG] = 50;
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    if (mlog_get_stats(&before) != 0) {
+        printf("mlog_get_stats failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&t[i], NULL, flood, (void *) (long) i);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    mlog_flush();
+
+    /* the threads exited, their counters stay in the total */
+
+    expect("mlog_get_stats", mlog_get_stats(&after), 0);
+
+    queued = sum_levels(after.total.lines) - sum_levels(before.total.lines);
+
+    printf("queued=%ld dropped=%lu shed=%lu blocked=%lu\n", queued,
+           after.total.dropped - before.total.dropped,
+           after.total.shed - before.total.shed,
+           after.total.blocked - before.total.blocked);
+
+    expect("queued, dropped and shed add up to the lines logged",
+           queued + (long) (after.total.dropped - before.total.dropped)
+           + (long) (after.total.shed - before.total.shed), THREADS * LINES);
+    expect("every error line is queued",
+           after.total.lines[MLOG_LEVEL_ERROR]
+           - before.total.lines[MLOG_LEVEL_ERROR], THREADS * LINES / 4);
+    expect("some lines are lost", queued < THREADS * LINES, 1);
+
+    /* the writer publishes once a second */
+
+    sleep(2);
+
+    fd = open(STATS_FILE, O_RDONLY);
+    map = fd < 0 ? MAP_FAILED : mmap(NULL, sizeof(mlog_stats_t), PROT_READ,
+                                     MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+        printf("map %s failed\n", STATS_FILE);
+        return 1;
+    }
+
+    close(fd);
+
+    expect("the stats file reads", read_stats(map, &file), 0);
+    expect("with its magic", file.magic == MLOG_STATS_MAGIC, 1);
+    expect("an even seq, updated", file.seq >= 2 && !(file.seq & 1), 1);
+    expect("of this process", file.pid, getpid());
+    expect("the same lines", sum_levels(file.total.lines),
+           sum_levels(after.total.lines));
+    expect("the same drops", file.total.dropped, after.total.dropped);
+
+    mlog_uinit();
+
+    /* the writer's final numbers */
+
+    expect("the final stats read", read_stats(map, &last), 0);
+    expect("a later seq", last.seq > file.seq && !(last.seq & 1), 1);
+    expect("the final batches", last.batches >= file.batches, 1);
+
+    munmap(map, sizeof(mlog_stats_t));
+
+    lines = count_lines(&bytes);
+
+    expect("the file has the queued lines", lines, queued);
+    expect("and the bytes counted", bytes,
+           sum_levels(after.total.bytes) - sum_levels(before.total.bytes));
+
+    unlink(LOG_FILE);
+    unlink(STATS_FILE);
+
+    return expect_done();
+}
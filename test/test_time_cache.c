@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/mlog_time.h"
+
+
+static int      g_failed;
+
+
+/* walk [start, start + span) second by second, as a busy thread would */
+
+static void
+check_range(const char *tz, time_t start, int span)
+{
+    char                 expect[64], got[MLOG_TIME_LEN + 1];
+    time_t               sec;
+    struct tm            tm;
+    mlog_time_cache_t    cache;
+
+    memset(&cache, 0, sizeof(cache));
+
+    for (sec = start; sec < start + span; sec++) {
+        localtime_r(&sec, &tm);
+        strftime(expect, sizeof(expect), "%Y/%m/%d %H:%M:%S", &tm);
+
+        mlog_time_format(&cache, sec, got);
+        got[MLOG_TIME_LEN] = '\0';
+
+        if (strcmp(expect, got) != 0) {
+            printf("FAIL tz=%s sec=%ld expect=%s got=%s\n",
+                   tz, (long) sec, expect, got);
+            g_failed++;
+            return;
+        }
+    }
+
+    printf("ok   tz=%s %ld +%ds\n", tz, (long) start, span);
+}
+
+
+static void
+set_tz(const char *tz)
+{
+    setenv("TZ", tz, 1);
+    mlog_time_tz_reload();
+}
+
+
+int main(int argc, char **argv)
+{
+    char                 got[MLOG_TIME_LEN + 1];
+    time_t               sec = 1700000000;  /* 2023/11/14 22:13:20 UTC */
+    mlog_time_cache_t    cache;
+
+    set_tz("America/New_York");
+
+    /* 2024/03/10 07:00:00 UTC, 02:00 EST jumps to 03:00 EDT */
+    check_range("America/New_York", 1710054000 - 3600, 7200);
+
+    /* 2024/11/03 06:00:00 UTC, 02:00 EDT falls back to 01:00 EST */
+    check_range("America/New_York", 1730613600 - 3600, 7200);
+
+    /* half hour DST shift, 2024/04/07 02:00 LHDT falls back to 01:30 */
+    set_tz("Australia/Lord_Howe");
+    check_range("Australia/Lord_Howe", 1712415600 - 3600, 7200);
+
+    /* a warm cache must follow a timezone change at once */
+
+    memset(&cache, 0, sizeof(cache));
+
+    set_tz("UTC");
+    mlog_time_format(&cache, sec, got);
+    got[MLOG_TIME_LEN] = '\0';
+
+    if (strcmp(got, "2023/11/14 22:13:20") != 0) {
+        printf("FAIL tz=UTC got=%s\n", got);
+        g_failed++;
+    }
+
+    set_tz("Asia/Tokyo");
+    mlog_time_format(&cache, sec + 1, got);
+    got[MLOG_TIME_LEN] = '\0';
+
+    if (strcmp(got, "2023/11/15 07:13:21") != 0) {
+        printf("FAIL tz=Asia/Tokyo got=%s\n", got);
+        g_failed++;
+
+    } else {
+        printf("ok   tz change UTC -> Asia/Tokyo\n");
+    }
+
+    printf("%s\n", g_failed ? "FAILED" : "PASSED");
+
+    return g_failed ? 1 : 0;
+}
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE        "/tmp/mlog_test_uring.log"
+#define THREADS         4
+#define LINES           50000
+#define ROTATE_KEEP     100
+
+
+static void *
+flood(void *arg)
+{
+    int  i, id = (int) (long) arg;
+
+    for (i = 0; i < LINES; i++) {
+        mlog_info("uring thread=%d seq=%d", id, i);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Counts the lines of the file and its rotated ones, oldest first, and
+ * checks each thread's are in order, the main thread's as thread THREADS;
+ * a hole the writes left shows up as NUL bytes in *zeros.
+ */
+
+static long
+check_lines(long *zeros)
+{
+    int      c, i, id, seq, next[THREADS + 1] = { 0 };
+    long     n = 0, len = 0, bad = 0;
+    char     path[256], line[512], *p;
+    FILE    *fp;
+
+    *zeros = 0;
+
+    for (i = ROTATE_KEEP; i >= 0; i--) {
+        if (i) {
+            snprintf(path, sizeof(path), "%s.%d", LOG_FILE, i);
+
+        } else {
+            snprintf(path, sizeof(path), "%s", LOG_FILE);
+        }
+
+        fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+
+        while ((c = getc(fp)) != EOF) {
+            if (c == '\0') {
+                (*zeros)++;
+                continue;
+            }
+
+            if (len < (long) sizeof(line) - 1) {
+                line[len++] = c;
+            }
+
+            if (c != '\n') {
+                continue;
+            }
+
+            line[len] = '\0';
+            len = 0;
+
+            p = strstr(line, "uring thread=");
+            if (p == NULL
+                || sscanf(p, "uring thread=%d seq=%d", &id, &seq) != 2
+                || id < 0 || id > THREADS)
+            {
+                continue;
+            }
+
+            bad += seq != next[id];
+            next[id] = seq + 1;
+            n++;
+        }
+
+        fclose(fp);
+    }
+
+    return bad ? -bad : n;
+}
+
+
+/*
+ * The batches may still be in flight, mlog_flush() waits for them. Not
+ * from the main thread, whose kfifo would outlive mlog_uinit().
+ */
+
+static void *
+flush_line(void *arg)
+{
+    long  zeros;
+
+    mlog_info("uring thread=%d seq=0", THREADS);
+    mlog_flush();
+
+    *(long *) arg = check_lines(&zeros);
+
+    return NULL;
+}
+
+
+static void
+clean()
+{
+    int   i;
+    char  path[256];
+
+    unlink(LOG_FILE);
+
+    for (i = 1; i <= ROTATE_KEEP; i++) {
+        snprintf(path, sizeof(path), "%s.%d", LOG_FILE, i);
+        unlink(path);
+    }
+}
+
+
+static void
+run(const char *what, int fsync, unsigned long rotate_size)
+{
+    int           i;
+    long          zeros, flushed;
+    char          buf[128];
+    pthread_t     t[THREADS];
+    mlog_conf_t   conf;
+    mlog_stats_t  stats;
+
+    clean();
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 1024 * 1024;
+    conf.batch_bytes = 8 * 1024;
+    conf.io = MLOG_IO_URING;
+    conf.uring_depth = 2;
+    conf.batch_fsync = fsync;
+    conf.rotate_size = rotate_size;
+    conf.rotate_keep = ROTATE_KEEP;
+    conf.overflow[MLOG_LEVEL_INFO] = MLOG_OVERFLOW_BLOCK;
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        g_failed++;
+        return;
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&t[i], NULL, flood, (void *) (long) i);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    pthread_create(&t[0], NULL, flush_line, &flushed);
+    pthread_join(t[0], NULL);
+
+    snprintf(buf, sizeof(buf), "%s: flushed lines are in the file", what);
+    expect(buf, flushed, THREADS * LINES + 1);
+
+    mlog_get_stats(&stats);
+    mlog_uinit();
+
+    snprintf(buf, sizeof(buf), "%s: all lines in order", what);
+    expect(buf, check_lines(&zeros), THREADS * LINES + 1);
+
+    snprintf(buf, sizeof(buf), "%s: no holes", what);
+    expect(buf, zeros, 0);
+
+    snprintf(buf, sizeof(buf), "%s: no write errors", what);
+    expect(buf, stats.write_errors, 0);
+}
+
+
+int main(int argc, char **argv)
+{
+    long         zeros;
+    mlog_conf_t  conf;
+
+    run("io_uring", 0, 0);
+    run("io_uring fsync rotated", 1, 256 * 1024);
+
+    /* the next run goes on at the end of the file */
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 64 * 1024;
+    conf.io = MLOG_IO_URING;
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        return 1;
+    }
+
+    mlog_info("uring thread=%d seq=1", THREADS);
+    mlog_uinit();
+
+    expect("a run after appends", check_lines(&zeros), THREADS * LINES + 2);
+    expect("without holes", zeros, 0);
+
+    clean();
+
+    return expect_done();
+}
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include "../src/mlog.h"
+#include "mlog_test.h"
+
+
+#define LOG_FILE        "/tmp/mlog_test_wrap.log"
+#define THREADS         2
+#define LINES           20000
+#define MAX_PAYLOAD     1500
+
+
+static char     g_payload[MAX_PAYLOAD + 1];
+
+
+/* lengths that land the records all over a page sized kfifo */
+
+static void *
+flood(void *arg)
+{
+    int  i, id = (int) (long) arg;
+
+    for (i = 0; i < LINES; i++) {
+        mlog_info("wrap thread=%d seq=%d len=%d %.*s|", id, i,
+                  i * 37 % MAX_PAYLOAD, i * 37 % MAX_PAYLOAD, g_payload);
+    }
+
+    return NULL;
+}
+
+
+/* as under a seccomp profile without it: no mirrored kfifos */
+
+static int
+deny_memfd()
+{
+    struct sock_filter   filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_memfd_create, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOSYS),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog    prog = {
+        .len = sizeof(filter) / sizeof(filter[0]),
+        .filter = filter,
+    };
+
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0
+        || prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) != 0)
+    {
+        return -1;
+    }
+
+    return syscall(__NR_memfd_create, "probe", 0) < 0 ? 0 : -1;
+}
+
+
+/* each line whole, with as many bytes as it says, and in order */
+
+static long
+check_lines()
+{
+    int      id, seq, len, n, next[THREADS] = { 0 };
+    long     lines = 0, bad = 0;
+    char     line[4096], *p;
+    FILE    *fp;
+
+    fp = fopen(LOG_FILE, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        p = strstr(line, "wrap thread=");
+        if (p == NULL
+            || sscanf(p, "wrap thread=%d seq=%d len=%d %n", &id, &seq, &len,
+                      &n) != 3
+            || id < 0 || id >= THREADS)
+        {
+            bad++;
+            continue;
+        }
+
+        p += n;
+
+        bad += seq != next[id] || (int) strspn(p, "x") != len
+               || strcmp(p + len, "|\n") != 0;
+        next[id] = seq + 1;
+        lines++;
+    }
+
+    fclose(fp);
+
+    return bad ? -bad : lines;
+}
+
+
+static void
+run(const char *what, int mode)
+{
+    int          i;
+    char         buf[128];
+    pthread_t    t[THREADS];
+    mlog_conf_t  conf;
+
+    unlink(LOG_FILE);
+
+    mlog_conf_default(&conf);
+
+    conf.filename = LOG_FILE;
+    conf.buf_size = 4096;
+    conf.format_mode = mode;
+
+    for (i = MLOG_LEVEL_ERROR; i <= MLOG_LEVEL_DEBUG; i++) {
+        conf.overflow[i] = MLOG_OVERFLOW_BLOCK;
+    }
+
+    if (mlog_init_conf(&conf)) {
+        printf("mlog init failed\n");
+        g_failed++;
+        return;
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&t[i], NULL, flood, (void *) (long) i);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    mlog_uinit();
+
+    snprintf(buf, sizeof(buf), "%s: every line whole and in order", what);
+    expect(buf, check_lines(), THREADS * LINES);
+}
+
+
+int main(int argc, char **argv)
+{
+    memset(g_payload, 'x', MAX_PAYLOAD);
+
+    if (deny_memfd() != 0) {
+        printf("seccomp unavailable, skipped\n");
+        return 0;
+    }
+
+    run("eager", MLOG_FORMAT_EAGER);
+    run("deferred", MLOG_FORMAT_DEFERRED);
+
+    unlink(LOG_FILE);
+
+    return expect_done();
+}
@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef MLOG_WITH_ZLIB
+#include <zlib.h>
+#endif
+#include "../src/mlog.h"
+#include "../src/mlog_bin.h"
+#include "../src/mlog_fmt.h"
+#include "../src/mlog_time.h"
+
+
+#define MLOG_DECODE_LINE_LEN    2048    /* MLOG_MAX_LOG_LEN */
+
+
+typedef struct {
+    char               *fmt;
+    char               *func;
+    long                line;
+} decode_site_t;
+
+
+typedef struct {
+    pid_t               pid;
+    pid_t               tid;
+} decode_thread_t;
+
+
+typedef struct {
+    decode_site_t      *sites;
+    unsigned int        nsites;
+    decode_thread_t    *threads;
+    unsigned int        nthreads;
+    unsigned long       msec;
+    mlog_time_cache_t   tcache;
+
+    int                 level;      /* filters */
+    unsigned long       from;
+    unsigned long       to;
+} decode_ctx_t;
+
+
+static void
+usage(const char *prog)
+{
+    printf("usage: %s [-l max level 0-3] [-s from] [-e to] file\n"
+           "       from/to: \"YYYY/MM/DD HH:MM:SS\" local time"
+           " or epoch seconds\n", prog);
+}
+
+
+static int
+parse_time(const char *s, unsigned long *msec)
+{
+    char       *end;
+    struct tm   tm;
+
+    memset(&tm, 0, sizeof(tm));
+
+    end = strptime(s, "%Y/%m/%d %H:%M:%S", &tm);
+    if (end && *end == '\0') {
+        tm.tm_isdst = -1;
+        *msec = (unsigned long) mktime(&tm) * 1000;
+        return 0;
+    }
+
+    *msec = strtoul(s, &end, 10) * 1000;
+
+    return *end == '\0' && end != s ? 0 : -1;
+}
+
+
+static void
+reset_ctx(decode_ctx_t *ctx)
+{
+    unsigned int  i;
+
+    for (i = 0; i < ctx->nsites; i++) {
+        free(ctx->sites[i].fmt);
+        free(ctx->sites[i].func);
+    }
+
+    free(ctx->sites);
+    free(ctx->threads);
+
+    ctx->sites = NULL;
+    ctx->nsites = 0;
+    ctx->threads = NULL;
+    ctx->nthreads = 0;
+    ctx->msec = 0;
+}
+
+
+static char *
+get_string(const unsigned char **p, const unsigned char *last)
+{
+    char                *s;
+    unsigned long long   len;
+
+    if (mlog_bin_get_varint(p, last, &len) != 0
+        || len > (unsigned long long) (last - *p))
+    {
+        return NULL;
+    }
+
+    s = strndup((const char *) *p, len);
+    *p += len;
+
+    return s;
+}
+
+
+static int
+decode_site(decode_ctx_t *ctx, const unsigned char **p,
+    const unsigned char *last)
+{
+    unsigned long long   id, line;
+    decode_site_t       *site;
+
+    if (mlog_bin_get_varint(p, last, &id) != 0 || id != ctx->nsites
+        || mlog_bin_get_varint(p, last, &line) != 0)
+    {
+        return -1;
+    }
+
+    site = realloc(ctx->sites, (ctx->nsites + 1) * sizeof(decode_site_t));
+    if (site == NULL) {
+        return -1;
+    }
+
+    ctx->sites = site;
+    site = &ctx->sites[ctx->nsites];
+
+    site->line = mlog_bin_unzigzag(line);
+    site->func = get_string(p, last);
+    site->fmt = site->func ? get_string(p, last) : NULL;
+
+    if (site->fmt == NULL) {
+        free(site->func);
+        return -1;
+    }
+
+    ctx->nsites++;
+
+    return 0;
+}
+
+
+static int
+decode_thread(decode_ctx_t *ctx, const unsigned char **p,
+    const unsigned char *last)
+{
+    unsigned long long   id, pid, tid;
+    decode_thread_t     *thread;
+
+    if (mlog_bin_get_varint(p, last, &id) != 0 || id != ctx->nthreads
+        || mlog_bin_get_varint(p, last, &pid) != 0
+        || mlog_bin_get_varint(p, last, &tid) != 0)
+    {
+        return -1;
+    }
+
+    thread = realloc(ctx->threads,
+                     (ctx->nthreads + 1) * sizeof(decode_thread_t));
+    if (thread == NULL) {
+        return -1;
+    }
+
+    ctx->threads = thread;
+    ctx->threads[ctx->nthreads].pid = pid;
+    ctx->threads[ctx->nthreads].tid = tid;
+    ctx->nthreads++;
+
+    return 0;
+}
+
+
+static int
+decode_record(decode_ctx_t *ctx, int tag, const unsigned char **p,
+    const unsigned char *last)
+{
+    int                  len, level, n, skip;
+    char                 line[MLOG_DECODE_LINE_LEN], *q, *end;
+    unsigned char        args[MLOG_DECODE_LINE_LEN * 2];
+    decode_site_t       *site;
+    decode_thread_t     *thread;
+    unsigned long long   delta, id, sid;
+
+    level = tag & MLOG_BIN_LEVEL_MASK;
+
+    if (level > MLOG_LEVEL_DEBUG
+        || mlog_bin_get_varint(p, last, &delta) != 0
+        || mlog_bin_get_varint(p, last, &id) != 0 || id >= ctx->nthreads
+        || mlog_bin_get_varint(p, last, &sid) != 0)
+    {
+        return -1;
+    }
+
+    ctx->msec += mlog_bin_unzigzag(delta);
+    thread = &ctx->threads[id];
+
+    skip = level > ctx->level || ctx->msec < ctx->from || ctx->msec >= ctx->to;
+
+    /* text entries are lines the process had to format itself */
+
+    if ((tag & MLOG_BIN_TAG_MASK) == MLOG_BIN_TEXT) {
+        if (sid > (unsigned long long) (last - *p)) {
+            return -1;
+        }
+
+        if (!skip) {
+            fwrite(*p, 1, sid, stdout);
+        }
+
+        *p += sid;
+
+        return 0;
+    }
+
+    if (sid >= ctx->nsites) {
+        return -1;
+    }
+
+    site = &ctx->sites[sid];
+
+    n = mlog_bin_decode_args(args, sizeof(args), site->fmt, p, last);
+    if (n < 0) {
+        return -1;
+    }
+
+    if (skip) {
+        return 0;
+    }
+
+    q = line;
+    end = line + sizeof(line) - 1;
+
+    len = mlog_fmt_prefix(q, end - q, &ctx->tcache, ctx->msec / 1000, level,
+                          thread->pid, thread->tid, site->func, site->line);
+    if (len > 0) {
+        q += len;
+        q += mlog_fmt_render(q, end - q, site->fmt, args, n);
+    }
+
+    *q++ = '\n';
+
+    fwrite(line, 1, q - line, stdout);
+
+    return 0;
+}
+
+
+static int
+decode(decode_ctx_t *ctx, const unsigned char *p, const unsigned char *last)
+{
+    int                   tag, ret;
+    const unsigned char  *start = p, *entry = p;
+
+    while (p < last) {
+        entry = p;
+        tag = *p;
+
+        /* an mmap'd file keeps zeros past its end if the process died */
+
+        if (tag == 0) {
+            p++;
+            continue;
+        }
+
+        if (tag == MLOG_BIN_HEADER) {
+            if (last - p < MLOG_BIN_MAGIC_LEN
+                || memcmp(p, MLOG_BIN_MAGIC, MLOG_BIN_MAGIC_LEN) != 0)
+            {
+                goto bad;
+            }
+
+            reset_ctx(ctx);
+            p += MLOG_BIN_MAGIC_LEN;
+            continue;
+        }
+
+        if (p == start) {
+            goto bad;
+        }
+
+        p++;
+
+        switch (tag & MLOG_BIN_TAG_MASK) {
+
+        case 0:
+            if (tag == MLOG_BIN_SITE) {
+                ret = decode_site(ctx, &p, last);
+
+            } else if (tag == MLOG_BIN_THREAD) {
+                ret = decode_thread(ctx, &p, last);
+
+            } else {
+                ret = -1;
+            }
+            break;
+
+        case MLOG_BIN_RECORD:
+        case MLOG_BIN_TEXT:
+            ret = decode_record(ctx, tag, &p, last);
+            break;
+
+        default:
+            ret = -1;
+        }
+
+        if (ret != 0) {
+            goto bad;
+        }
+    }
+
+    return 0;
+
+bad:
+
+    /* a writer that was killed leaves a torn entry at the end */
+
+    fprintf(stderr, "malformed entry 0x%02x at offset %ld\n",
+            tag, (long) (entry - start));
+
+    return -1;
+}
+
+
+#ifdef MLOG_WITH_ZLIB
+
+/* a file of gzip members (MLOG_COMPRESS_GZIP), inflated whole */
+
+static unsigned char *
+inflate_file(const char *name, size_t *size)
+{
+    int              n;
+    size_t           len = 0, cap = 1024 * 1024;
+    gzFile           gz;
+    unsigned char   *buf, *p;
+
+    gz = gzopen(name, "r");
+    if (gz == NULL) {
+        return NULL;
+    }
+
+    buf = malloc(cap);
+
+    while (buf) {
+        n = gzread(gz, buf + len, cap - len);
+        if (n <= 0) {
+            break;
+        }
+
+        len += n;
+
+        if (len == cap) {
+            cap *= 2;
+            p = realloc(buf, cap);
+            if (p == NULL) {
+                free(buf);
+            }
+
+            buf = p;
+        }
+    }
+
+    gzclose(gz);
+
+    *size = len;
+
+    return buf;
+}
+
+#endif
+
+
+int main(int argc, char **argv)
+{
+    int                   fd, opt, ret;
+    void                 *map;
+    struct stat           st;
+    decode_ctx_t          ctx;
+#ifdef MLOG_WITH_ZLIB
+    size_t                len;
+    unsigned char        *buf;
+#endif
+
+    memset(&ctx, 0, sizeof(ctx));
+
+    ctx.level = MLOG_LEVEL_DEBUG;
+    ctx.to = ~0UL;
+
+    while ((opt = getopt(argc, argv, "l:s:e:h")) != -1) {
+        switch (opt) {
+        case 'l':
+            ctx.level = atoi(optarg);
+            break;
+        case 's':
+            if (parse_time(optarg, &ctx.from) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'e':
+            if (parse_time(optarg, &ctx.to) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return 1;
+    }
+
+#ifdef MLOG_WITH_ZLIB
+
+    if (st.st_size >= 2 && ((unsigned char *) map)[0] == 0x1f
+        && ((unsigned char *) map)[1] == 0x8b)
+    {
+        munmap(map, st.st_size);
+        close(fd);
+
+        buf = inflate_file(argv[optind], &len);
+        if (buf == NULL) {
+            fprintf(stderr, "%s: inflate failed\n", argv[optind]);
+            return 1;
+        }
+
+        ret = decode(&ctx, buf, buf + len);
+
+        reset_ctx(&ctx);
+        free(buf);
+
+        return ret == 0 ? 0 : 1;
+    }
+
+#endif
+
+    ret = decode(&ctx, map, (unsigned char *) map + st.st_size);
+
+    reset_ctx(&ctx);
+    munmap(map, st.st_size);
+    close(fd);
+
+    return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../src/mlog.h"
+
+
+#define MLOGSTAT_RETRIES    1000
+
+
+static void
+usage(const char *prog)
+{
+    printf("usage: %s [-i interval sec] [-c count] [-t] stats_file\n"
+           "       -t also lists the kfifos of the threads\n", prog);
+}
+
+
+/* the writer updates the file as a seqlock */
+
+static int
+read_stats(const volatile mlog_stats_t *map, mlog_stats_t *stats)
+{
+    int            i;
+    unsigned long  seq;
+
+    for (i = 0; i < MLOGSTAT_RETRIES; i++) {
+        seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE);
+
+        if (seq & 1) {
+            usleep(100);
+            continue;
+        }
+
+        memcpy(stats, (const void *) map, sizeof(mlog_stats_t));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&map->seq, __ATOMIC_RELAXED) == seq) {
+            return stats->magic == MLOG_STATS_MAGIC ? 0 : -1;
+        }
+    }
+
+    return -1;
+}
+
+
+static unsigned long
+sum_levels(const unsigned long *v)
+{
+    int            i;
+    unsigned long  n = 0;
+
+    for (i = MLOG_LEVEL_ERROR; i <= MLOG_LEVEL_DEBUG; i++) {
+        n += v[i];
+    }
+
+    return n;
+}
+
+
+static void
+print_threads(const mlog_stats_t *stats)
+{
+    unsigned int                 i;
+    const mlog_thread_stats_t   *t;
+
+    printf("%8s %10s %10s %10s %12s %10s %10s\n",
+           "tid", "size", "used", "peak", "lines", "dropped", "shed");
+
+    for (i = 0; i < stats->nthreads && i < MLOG_STATS_THREADS; i++) {
+        t = &stats->threads[i];
+
+        printf("%8d %10u %10u %10u %12lu %10lu %10lu\n",
+               t->tid, t->size, t->used, t->peak,
+               sum_levels(t->counters.lines), t->counters.dropped,
+               t->counters.shed);
+    }
+
+    if (stats->nthreads > MLOG_STATS_THREADS) {
+        printf("... %u more\n", stats->nthreads - MLOG_STATS_THREADS);
+    }
+}
+
+
+/* rates over the interval */
+
+static void
+print_row(const mlog_stats_t *cur, const mlog_stats_t *prev)
+{
+    double                   sec, lines;
+    unsigned long            batches;
+    const mlog_counters_t   *c = &cur->total, *p = &prev->total;
+
+    sec = (cur->msec - prev->msec) / 1000.0;
+    if (sec <= 0) {
+        sec = 1;
+    }
+
+    batches = cur->batches - prev->batches;
+    lines = sum_levels(c->lines) - sum_levels(p->lines);
+
+    printf("%10.0f %8.0f %8.0f %8.0f %8.0f %10.0f %8lu %8lu %8lu %8lu %8lu"
+           " %7.1f %6.1f%% %6lu\n",
+           lines / sec,
+           (c->lines[MLOG_LEVEL_ERROR] - p->lines[MLOG_LEVEL_ERROR]) / sec,
+           (c->lines[MLOG_LEVEL_WARN] - p->lines[MLOG_LEVEL_WARN]) / sec,
+           (c->lines[MLOG_LEVEL_INFO] - p->lines[MLOG_LEVEL_INFO]) / sec,
+           (c->lines[MLOG_LEVEL_DEBUG] - p->lines[MLOG_LEVEL_DEBUG]) / sec,
+           (sum_levels(c->bytes) - sum_levels(p->bytes)) / sec,
+           c->dropped - p->dropped, c->shed - p->shed,
+           c->overwritten - p->overwritten, c->spilled - p->spilled,
+           c->blocked - p->blocked,
+           batches ? (double) (cur->batch_lines - prev->batch_lines)
+                     / batches : 0.0,
+           (cur->writer_cpu_usec - prev->writer_cpu_usec) / (sec * 1e4),
+           cur->write_errors - prev->write_errors);
+}
+
+
+int main(int argc, char **argv)
+{
+    int                   fd, opt, i, count = -1, threads = 0;
+    void                 *map;
+    unsigned int          interval = 1;
+    struct stat           st;
+    mlog_stats_t          cur, prev;
+
+    while ((opt = getopt(argc, argv, "i:c:th")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'c':
+            count = atoi(optarg);
+            break;
+        case 't':
+            threads = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1 || interval == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    if (st.st_size < (off_t) sizeof(mlog_stats_t)) {
+        fprintf(stderr, "%s: not an mlog stats file\n", argv[optind]);
+        close(fd);
+        return 1;
+    }
+
+    map = mmap(NULL, sizeof(mlog_stats_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    memset(&prev, 0, sizeof(prev));
+
+    if (read_stats(map, &cur) != 0) {
+        fprintf(stderr, "%s: no stats yet\n", argv[optind]);
+        munmap(map, sizeof(mlog_stats_t));
+        return 1;
+    }
+
+    printf("pid %d\n", cur.pid);
+    printf("%10s %8s %8s %8s %8s %10s %8s %8s %8s %8s %8s %7s %7s %6s\n",
+           "lines/s", "error/s", "warn/s", "info/s", "debug/s", "bytes/s",
+           "dropped", "shed", "overwr", "spilled", "blocked", "batch",
+           "writer", "wrerr");
+
+    for (i = 0; count < 0 || i < count; i++) {
+        if (i > 0) {
+            sleep(interval);
+
+            if (read_stats(map, &cur) != 0) {
+                fprintf(stderr, "read stats failed\n");
+                break;
+            }
+        }
+
+        /* the first row is since mlog_init */
+
+        if (i == 0) {
+            prev.msec = cur.start_msec;
+        }
+
+        print_row(&cur, &prev);
+
+        if (threads) {
+            print_threads(&cur);
+        }
+
+        prev = cur;
+    }
+
+    munmap(map, sizeof(mlog_stats_t));
+
+    return 0;
+}